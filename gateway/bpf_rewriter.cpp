@@ -0,0 +1,123 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "bpf_rewriter.h"
+#include <spdlog/spdlog.h>
+#ifdef MVVM_GATEWAY_BPF
+#include "rewrite_map.h"
+#include <arpa/inet.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <net/if.h>
+#include <utility>
+
+/* where the filter sits on the clsact ingress hook, so detach finds it again */
+#define MVVM_GATEWAY_TC_HANDLE 1
+#define MVVM_GATEWAY_TC_PRIORITY 1
+
+BpfRewriter::~BpfRewriter() {
+    for (auto ifindex : hooked_) {
+        LIBBPF_OPTS(bpf_tc_hook, hook, .ifindex = ifindex, .attach_point = BPF_TC_INGRESS);
+        LIBBPF_OPTS(bpf_tc_opts, opts, .handle = MVVM_GATEWAY_TC_HANDLE, .priority = MVVM_GATEWAY_TC_PRIORITY);
+        bpf_tc_detach(&hook, &opts);
+    }
+    bpf_object__close(obj_);
+}
+
+bool BpfRewriter::hook(int ifindex) {
+    LIBBPF_OPTS(bpf_tc_hook, hook, .ifindex = ifindex, .attach_point = BPF_TC_INGRESS);
+    LIBBPF_OPTS(bpf_tc_opts, opts, .prog_fd = prog_fd_, .handle = MVVM_GATEWAY_TC_HANDLE,
+                .priority = MVVM_GATEWAY_TC_PRIORITY);
+    // the clsact qdisc may be there already, from docker or an earlier run
+    auto err = bpf_tc_hook_create(&hook);
+    if ((err && err != -EEXIST) || bpf_tc_attach(&hook, &opts)) {
+        SPDLOG_ERROR("attaching to {} failed {}", ifindex, errno);
+        return false;
+    }
+    hooked_.push_back(ifindex);
+    return true;
+}
+
+void BpfRewriter::attach_ports() {
+    std::error_code ec;
+    for (auto &port : std::filesystem::directory_iterator(fmt::format("/sys/class/net/{}/brif", ifname_), ec)) {
+        auto ifindex = (int)if_nametoindex(port.path().filename().c_str());
+        if (ifindex && std::find(hooked_.begin(), hooked_.end(), ifindex) == hooked_.end() && hook(ifindex))
+            SPDLOG_DEBUG("udp from {} is rewritten by tc", port.path().filename().string());
+    }
+}
+
+bool BpfRewriter::attach(const char *ifname) {
+    if (!(ifindex_ = (int)if_nametoindex(ifname))) {
+        SPDLOG_ERROR("no interface {}", ifname);
+        return false;
+    }
+    obj_ = bpf_object__open_file(MVVM_GATEWAY_BPF_OBJECT, nullptr);
+    if (!obj_ || bpf_object__load(obj_)) {
+        SPDLOG_ERROR("loading {} failed {}", MVVM_GATEWAY_BPF_OBJECT, errno);
+        ifindex_ = 0;
+        return false;
+    }
+    map_fd_ = bpf_object__find_map_fd_by_name(obj_, "mvvm_rewrite_map");
+    prog_fd_ = bpf_program__fd(bpf_object__find_program_by_name(obj_, "mvvm_rewrite"));
+    ifname_ = ifname;
+    if (!hook(ifindex_)) {
+        ifindex_ = 0;
+        return false;
+    }
+    attach_ports();
+    SPDLOG_INFO("udp of resumed pairs is rewritten by tc on {} and its {} ports", ifname, hooked_.size() - 1);
+    return true;
+}
+
+bool BpfRewriter::set(const std::string &server, const std::string &client, const std::string &new_ip) {
+    struct mvvm_rewrite_key key {};
+    struct mvvm_rewrite_value value {};
+    value.ifindex = ifindex_;
+    if (inet_pton(AF_INET, server.c_str(), &key.saddr) != 1 || inet_pton(AF_INET, client.c_str(), &key.daddr) != 1 ||
+        inet_pton(AF_INET, new_ip.c_str(), &value.addr) != 1)
+        return false;
+    attach_ports();
+    // the same two cases as packet_handler: from the old server the source moves, towards it the destination
+    auto err = bpf_map_update_elem(map_fd_, &key, &value, BPF_ANY);
+    std::swap(key.saddr, key.daddr);
+    value.rewrite_dst = 1;
+    if (err || bpf_map_update_elem(map_fd_, &key, &value, BPF_ANY)) {
+        SPDLOG_ERROR("rewrite map update failed {}", errno);
+        return false;
+    }
+    return true;
+}
+
+void BpfRewriter::unset(const std::string &server, const std::string &client) {
+    struct mvvm_rewrite_key key {};
+    if (inet_pton(AF_INET, server.c_str(), &key.saddr) != 1 || inet_pton(AF_INET, client.c_str(), &key.daddr) != 1)
+        return;
+    // either may be missing, the pair was never handed to the kernel
+    bpf_map_delete_elem(map_fd_, &key);
+    std::swap(key.saddr, key.daddr);
+    bpf_map_delete_elem(map_fd_, &key);
+}
+#else
+BpfRewriter::~BpfRewriter() = default;
+bool BpfRewriter::attach(const char *ifname) {
+    SPDLOG_DEBUG("built without MVVM_GATEWAY_BPF, not attaching to {}", ifname);
+    return false;
+}
+bool BpfRewriter::set(const std::string &server, const std::string &client, const std::string &new_ip) {
+    return false;
+}
+void BpfRewriter::unset(const std::string &server, const std::string &client) {}
+#endif
@@ -0,0 +1,57 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#ifndef MVVM_GATEWAY_BPF_REWRITER_H
+#define MVVM_GATEWAY_BPF_REWRITER_H
+
+#include <string>
+#include <vector>
+
+struct bpf_object;
+
+/**
+ * Rewrites the udp of resumed pairs in the kernel with the tc program of rewrite.bpf.c, instead of copying each packet
+ * to the gateway and resending it. The gateway only updates its map on resume and suspend.
+ * A packet one container sends another is switched inside the bridge and never reaches the bridge's own ingress, so
+ * the program sits on the ingress of every port of the bridge, the host side of each container's veth, as well.
+ * What the host itself sends to a container enters no ingress and isn't rewritten here.
+ * Without MVVM_GATEWAY_BPF at build time attach() always fails and everything stays on the pcap path.
+ */
+class BpfRewriter {
+public:
+    BpfRewriter() = default;
+    ~BpfRewriter();
+    BpfRewriter(const BpfRewriter &) = delete;
+    BpfRewriter &operator=(const BpfRewriter &) = delete;
+
+    /** Load the program and attach it to the ingress of the bridge ifname and its ports, false if it can't be. */
+    bool attach(const char *ifname);
+    /** Send udp between server and client to new_ip from now on, as forward() does. */
+    bool set(const std::string &server, const std::string &client, const std::string &new_ip);
+    /** Leave udp between server and client alone again, the pair is suspended or gone. */
+    void unset(const std::string &server, const std::string &client);
+
+private:
+    /** Attach to the bridge ports that came up since the last call, containers start after the gateway does. */
+    void attach_ports();
+    bool hook(int ifindex);
+
+    struct bpf_object *obj_{};
+    int map_fd_ = -1;
+    int prog_fd_ = -1;
+    int ifindex_{};
+    std::string ifname_;
+    // every ingress the program sits on, the bridge first
+    std::vector<int> hooked_;
+};
+
+#endif // MVVM_GATEWAY_BPF_REWRITER_H
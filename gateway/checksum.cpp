@@ -0,0 +1,50 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "checksum.h"
+#include <netinet/udp.h>
+
+unsigned short in_cksum(unsigned short *buf, int len) {
+    unsigned long sum = 0;
+    while (len > 1) {
+        sum += *buf++;
+        len -= 2;
+    }
+    if (len)
+        sum += *(unsigned char *)buf;
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+    return (unsigned short)(~sum);
+}
+
+uint16_t cksum_adjust(uint16_t sum, uint32_t old, uint32_t now) {
+    uint32_t acc = (uint16_t)~sum;
+    acc += (uint16_t)~old + (uint16_t)~(old >> 16) + (uint16_t)now + (uint16_t)(now >> 16);
+    while (acc >> 16)
+        acc = (acc & 0xffff) + (acc >> 16);
+    return ~acc;
+}
+
+void rewrite_addr(struct ip *iphdr, struct in_addr &addr, in_addr_t now, size_t len) {
+    auto old = addr.s_addr;
+    addr.s_addr = now;
+    iphdr->ip_sum = cksum_adjust(iphdr->ip_sum, old, now);
+    // the udp checksum covers the addresses through the pseudo header, 0 means the sender didn't compute one.
+    // only the first fragment carries the udp header, the others start with payload
+    auto *udphdr = (struct udphdr *)((uint8_t *)iphdr + 4 * iphdr->ip_hl);
+    if (iphdr->ip_p == IPPROTO_UDP && !(ntohs(iphdr->ip_off) & IP_OFFMASK) &&
+        len >= 4 * iphdr->ip_hl + sizeof(*udphdr) && udphdr->uh_sum) {
+        udphdr->uh_sum = cksum_adjust(udphdr->uh_sum, old, now);
+        if (!udphdr->uh_sum)
+            udphdr->uh_sum = 0xffff;
+    }
+}
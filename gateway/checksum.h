@@ -0,0 +1,28 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#ifndef MVVM_GATEWAY_CHECKSUM_H
+#define MVVM_GATEWAY_CHECKSUM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+/** The internet checksum of len bytes at buf, to recalculate one from scratch. */
+unsigned short in_cksum(unsigned short *buf, int len);
+/** RFC 1624 eqn. 3, a checksum after a 32 bit word it covers went from old to now, all as they sit in the packet. */
+uint16_t cksum_adjust(uint16_t sum, uint32_t old, uint32_t now);
+/** Point addr, the source or destination of iphdr, at now and patch the ip and udp checksums to match. */
+void rewrite_addr(struct ip *iphdr, struct in_addr &addr, in_addr_t now, size_t len);
+
+#endif // MVVM_GATEWAY_CHECKSUM_H
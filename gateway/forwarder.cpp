@@ -0,0 +1,320 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "forwarder.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <spdlog/spdlog.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* epoll tag of the wakeup eventfd, flows are tagged flow << 1 | side */
+#define MVVM_GATEWAY_WAKE UINT64_MAX
+
+Forwarder::Forwarder()
+    : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)), wake_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    if (epoll_fd_ == -1 || wake_fd_ == -1) {
+        SPDLOG_ERROR("forwarder init failed {}", errno);
+        exit(EXIT_FAILURE);
+    }
+    // splice() has no MSG_NOSIGNAL, a peer that went away has to fail the relay instead of the gateway
+    signal(SIGPIPE, SIG_IGN);
+    struct epoll_event ev {.events = EPOLLIN, .data = {.u64 = MVVM_GATEWAY_WAKE}};
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+    loop_ = std::jthread([this](const std::stop_token &stop) { run(stop); });
+}
+
+Forwarder::~Forwarder() {
+    loop_.request_stop();
+    post([] {});
+    loop_.join();
+    for (auto &[_, f] : flows_)
+        for (auto &p : f.pipe) {
+            close(p[0]);
+            close(p[1]);
+        }
+    close(wake_fd_);
+    close(epoll_fd_);
+}
+
+void Forwarder::post(std::function<void()> fn) {
+    {
+        std::lock_guard lock(mtx_);
+        posted_.emplace_back(std::move(fn));
+    }
+    uint64_t one = 1;
+    if (write(wake_fd_, &one, sizeof(one)) == -1)
+        SPDLOG_ERROR("forwarder wakeup failed {}", errno);
+}
+
+int Forwarder::add(int a, int b) {
+    int flow;
+    {
+        std::lock_guard lock(mtx_);
+        flow = next_flow_++;
+    }
+    post([this, flow, a, b] {
+        auto &f = flows_[flow];
+        f.fd[0] = a;
+        f.fd[1] = b;
+        for (auto &p : f.pipe) {
+            if (pipe2(p, O_NONBLOCK | O_CLOEXEC) == -1) {
+                SPDLOG_ERROR("pipe failed {}", errno);
+                exit(EXIT_FAILURE);
+            }
+            fcntl(p[1], F_SETPIPE_SZ, MVVM_GATEWAY_PIPE_SIZE);
+        }
+        for (int side = 0; side < 2; side++)
+            watch(flow, f, side, EPOLL_CTL_ADD);
+        update(flow, f);
+        SPDLOG_DEBUG("flow {} relays {} <-> {}", flow, a, b);
+    });
+    return flow;
+}
+
+void Forwarder::pause(int flow, int keep, int held_fd) {
+    auto drained = std::make_shared<std::promise<void>>();
+    auto done = drained->get_future();
+    post([this, flow, keep, held_fd, drained] {
+        auto it = flows_.find(flow);
+        if (it == flows_.end()) {
+            drained->set_value();
+            return;
+        }
+        auto &f = it->second;
+        f.paused = true;
+        f.keep = keep;
+        f.held_fd = held_fd;
+        f.drained = drained;
+        pump(f, 0);
+        pump(f, 1);
+        update(flow, f);
+    });
+    if (done.wait_for(MVVM_GATEWAY_DRAIN_TIMEOUT) != std::future_status::ready)
+        SPDLOG_DEBUG("flow {} paused with bytes still queued", flow);
+}
+
+void Forwarder::resume(int flow, int a, int b) {
+    post([this, flow, a, b] {
+        auto it = flows_.find(flow);
+        if (it == flows_.end())
+            return;
+        auto &f = it->second;
+        for (int side = 0; side < 2; side++) {
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, f.fd[side], nullptr);
+            // the side that did not migrate may be handed back as is
+            if (f.fd[side] != a && f.fd[side] != b)
+                close(f.fd[side]);
+        }
+        f.fd[0] = a;
+        f.fd[1] = b;
+        f.paused = false;
+        f.failed = false;
+        f.holding = false;
+        f.held_fd = -1;
+        f.drained.reset();
+        for (int side = 0; side < 2; side++) {
+            f.eof[side] = f.shut[side] = f.hup[side] = false;
+            watch(flow, f, side, EPOLL_CTL_ADD);
+        }
+        // whatever was queued at pause goes to the new peers first, then what was held since
+        pump(f, 0);
+        pump(f, 1);
+        SPDLOG_DEBUG("flow {} resumed on {} <-> {}, {} bytes held", flow, a, b, f.held.size());
+        update(flow, f);
+    });
+}
+
+void Forwarder::watch(int flow, Flow &f, int side, int op) {
+    // the migrating side is out of the set until resume, its socket is about to die, and so is one that hung up
+    if ((f.holding && side != f.keep) || f.hup[side])
+        return;
+    if (op == EPOLL_CTL_ADD)
+        fcntl(f.fd[side], F_SETFL, fcntl(f.fd[side], F_GETFL) | O_NONBLOCK);
+    uint32_t events = 0;
+    // nothing new is taken in from the holding side before what was held is out
+    if (!f.paused && !f.eof[side] && f.pending[side] < MVVM_GATEWAY_PIPE_SIZE && (side != f.keep || f.held.empty()))
+        events |= EPOLLIN;
+    if (f.holding && side == f.keep && !f.eof[side] && !f.held.full())
+        events |= EPOLLIN;
+    if (f.pending[!side] || (!f.paused && f.keep == !side && !f.held.empty()))
+        events |= EPOLLOUT;
+    struct epoll_event ev {.events = events, .data = {.u64 = (uint64_t)flow << 1 | side}};
+    if (epoll_ctl(epoll_fd_, op, f.fd[side], &ev) == -1)
+        SPDLOG_DEBUG("epoll_ctl {} on {} failed {}", op, f.fd[side], errno);
+}
+
+void Forwarder::hold(Flow &f) {
+    uint8_t buf[MVVM_GATEWAY_HOLD_CHUNK];
+    while (!f.held.full()) {
+        auto n = recv(f.fd[f.keep], buf, std::min(sizeof(buf), f.held.room()), MSG_DONTWAIT);
+        if (n > 0) {
+            if (!f.held.push(buf, n)) {
+                SPDLOG_ERROR("flow dropped {} bytes it had no room to hold", n);
+                break;
+            }
+            continue;
+        }
+        if (n == 0 || errno != EAGAIN)
+            f.eof[f.keep] = true;
+        break;
+    }
+    // whoever waits for the peer to speak up learns about it once per pause
+    if (!f.held.empty() && f.held_fd != -1) {
+        uint64_t one = 1;
+        write(f.held_fd, &one, sizeof(one));
+        f.held_fd = -1;
+    }
+}
+
+bool Forwarder::flush_held(Flow &f) {
+    uint8_t buf[MVVM_GATEWAY_HOLD_CHUNK];
+    bool progress = false;
+    while (!f.held.empty()) {
+        auto len = f.held.peek(buf, sizeof(buf));
+        auto n = send(f.fd[!f.keep], buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n == -1 && errno != EAGAIN) {
+                SPDLOG_DEBUG("relay to {} failed {}, keeping {} held bytes", f.fd[!f.keep], errno, f.held.size());
+                f.failed = true;
+            }
+            break;
+        }
+        f.held.consume(n);
+        progress = true;
+    }
+    return progress;
+}
+
+void Forwarder::pump(Flow &f, int d) {
+    int src = f.fd[d], dst = f.fd[!d];
+    if (f.holding) {
+        if (d == f.keep)
+            hold(f);
+        return;
+    }
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        if (d == f.keep && !f.paused && !f.held.empty()) {
+            // older than anything that can be in the pipe, which stayed empty while holding
+            progress = flush_held(f);
+            if (!f.held.empty())
+                break;
+        }
+        if (!f.paused && !f.eof[d] && f.pending[d] < MVVM_GATEWAY_PIPE_SIZE && (d != f.keep || f.held.empty())) {
+            auto n = splice(src, nullptr, f.pipe[d][1], nullptr, MVVM_GATEWAY_PIPE_SIZE - f.pending[d],
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                f.pending[d] += n;
+                progress = true;
+            } else if (n == 0 || errno != EAGAIN) {
+                f.failed |= n == -1;
+                f.eof[d] = true;
+            }
+        }
+        if (f.pending[d]) {
+            auto n = splice(f.pipe[d][0], nullptr, dst, nullptr, f.pending[d], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                f.pending[d] -= n;
+                progress = true;
+            } else if (n == -1 && errno != EAGAIN) {
+                SPDLOG_DEBUG("relay to {} failed {}, keeping {} bytes", dst, errno, f.pending[d]);
+                f.failed = true;
+            }
+        }
+    }
+    // pass the half close on once everything before it got through
+    if (f.eof[d] && !f.pending[d] && (d != f.keep || f.held.empty()) && !f.shut[d]) {
+        shutdown(dst, SHUT_WR);
+        f.shut[d] = true;
+    }
+}
+
+void Forwarder::update(int flow, Flow &f) {
+    for (int side = 0; side < 2; side++)
+        watch(flow, f, side, EPOLL_CTL_MOD);
+    if (f.drained && !f.pending[0] && !f.pending[1]) {
+        f.drained->set_value();
+        f.drained.reset();
+        // the migrating side got everything, from now on the other side's bytes wait for resume
+        if (f.keep != -1) {
+            f.holding = true;
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, f.fd[!f.keep], nullptr);
+            hold(f);
+            watch(flow, f, f.keep, EPOLL_CTL_MOD);
+        }
+    }
+    // both halves closed with nothing left to deliver, or a peer is gone; a paused flow waits for its resume
+    if (!f.paused && (f.failed || (f.shut[0] && f.shut[1])))
+        close_flow(flow, f);
+}
+
+void Forwarder::close_flow(int flow, Flow &f) {
+    SPDLOG_DEBUG("flow {} on {} <-> {} closed{}", flow, f.fd[0], f.fd[1], f.failed ? " after a failed relay" : "");
+    for (int side = 0; side < 2; side++) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, f.fd[side], nullptr);
+        close(f.fd[side]);
+    }
+    for (auto &p : f.pipe) {
+        close(p[0]);
+        close(p[1]);
+    }
+    flows_.erase(flow);
+}
+
+void Forwarder::run(const std::stop_token &stop) {
+    struct epoll_event events[MVVM_GATEWAY_MAX_EVENTS];
+    while (!stop.stop_requested()) {
+        int n = epoll_wait(epoll_fd_, events, MVVM_GATEWAY_MAX_EVENTS, -1);
+        if (n == -1 && errno != EINTR) {
+            SPDLOG_ERROR("epoll_wait failed {}", errno);
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.u64 == MVVM_GATEWAY_WAKE) {
+                uint64_t count;
+                if (read(wake_fd_, &count, sizeof(count)) == -1 && errno != EAGAIN)
+                    SPDLOG_ERROR("forwarder wakeup read failed {}", errno);
+                std::vector<std::function<void()>> posted;
+                {
+                    std::lock_guard lock(mtx_);
+                    posted.swap(posted_);
+                }
+                for (auto &fn : posted)
+                    fn();
+                continue;
+            }
+            int flow = (int)(events[i].data.u64 >> 1), side = (int)(events[i].data.u64 & 1);
+            auto it = flows_.find(flow);
+            if (it == flows_.end())
+                continue;
+            auto &f = it->second;
+            // readable feeds this side's direction, writable drains the other one
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                pump(f, side);
+            if (events[i].events & EPOLLOUT)
+                pump(f, !side);
+            // nothing a paused flow does ends them, they would come back on every epoll_wait
+            if (f.paused && (events[i].events & (EPOLLHUP | EPOLLERR)) && !f.hup[side]) {
+                SPDLOG_DEBUG("flow {} side {} hung up while paused", flow, side);
+                f.hup[side] = true;
+                epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, f.fd[side], nullptr);
+            }
+            update(flow, f);
+        }
+    }
+}
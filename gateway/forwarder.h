@@ -0,0 +1,99 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#ifndef MVVM_GATEWAY_FORWARDER_H
+#define MVVM_GATEWAY_FORWARDER_H
+
+#include "spill_buffer.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/* per direction, what may sit in the kernel between the two sockets */
+#define MVVM_GATEWAY_PIPE_SIZE (1 << 20)
+#define MVVM_GATEWAY_MAX_EVENTS 256
+/* what moves between a socket and the held bytes per call */
+#define MVVM_GATEWAY_HOLD_CHUNK (64 << 10)
+/* how long pause() waits for the queued bytes to reach their peer */
+#define MVVM_GATEWAY_DRAIN_TIMEOUT std::chrono::seconds(1)
+
+/**
+ * Relays the bytes of tcp connection pairs on one epoll loop. Each direction goes socket -> pipe -> socket with
+ * splice(), so nothing is copied through user space and a byte is forwarded as soon as it arrives.
+ * All flow state lives on the loop thread, the control side only posts to it.
+ */
+class Forwarder {
+public:
+    Forwarder();
+    ~Forwarder();
+    Forwarder(const Forwarder &) = delete;
+    Forwarder &operator=(const Forwarder &) = delete;
+
+    /** Start relaying between two connected sockets, returns the flow id. */
+    int add(int a, int b);
+    /**
+     * Stop reading from both sides and wait for what is queued to be delivered, anything left is kept for resume.
+     * After that whatever side keep, the one not migrating, sends is held and goes out first on resume, and the
+     * eventfd held_fd, if given, is written to once the first byte is.
+     */
+    void pause(int flow, int keep = -1, int held_fd = -1);
+    /** Relay again, between a new pair of sockets. */
+    void resume(int flow, int a, int b);
+
+private:
+    struct Flow {
+        int fd[2];
+        // pipe[d] carries fd[d] -> fd[!d]
+        int pipe[2][2];
+        size_t pending[2]{};
+        bool eof[2]{}, shut[2]{};
+        bool paused{};
+        // hung up or errored while paused, out of the epoll set until resume as HUP and ERR can't be masked
+        bool hup[2]{};
+        // a relay failed, the flow is torn down unless it is paused for a resume
+        bool failed{};
+        std::shared_ptr<std::promise<void>> drained;
+        // while paused and drained, what fd[keep] sends lands in held
+        int keep = -1;
+        bool holding{};
+        SpillBuffer held;
+        int held_fd = -1;
+    };
+
+    void post(std::function<void()> fn);
+    void run(const std::stop_token &stop);
+    void watch(int flow, Flow &f, int side, int op);
+    void pump(Flow &f, int d);
+    void hold(Flow &f);
+    bool flush_held(Flow &f);
+    /** Refresh the watched events, f is gone afterwards if the flow ended. */
+    void update(int flow, Flow &f);
+    void close_flow(int flow, Flow &f);
+
+    int epoll_fd_;
+    int wake_fd_;
+    // 0 is never a flow, so a zeroed id can't stand for a live one
+    int next_flow_ = 1;
+    std::mutex mtx_;
+    std::vector<std::function<void()>> posted_;
+    std::unordered_map<int, Flow> flows_;
+    std::jthread loop_;
+};
+
+#endif // MVVM_GATEWAY_FORWARDER_H
@@ -13,107 +13,193 @@
 #include "crafter/Payload.h"
 #include "crafter/Protocols/RawLayer.h"
 #include "crafter/Utils/TCPConnection.h"
+#include "bpf_rewriter.h"
+#include "checksum.h"
+#include "forwarder.h"
+#include "raw_sender.h"
+#include "spill_buffer.h"
 #include "wamr.h"
+#include <atomic>
+#include <charconv>
 #include <chrono>
+#include <climits>
 #include <crafter.h>
 #include <cstddef>
 #include <cstdlib>
 #include <fcntl.h>
+#include <grp.h>
 #include <net/ethernet.h>
 #include <netinet/icmp6.h>
 #include <netinet/ip6.h>
 #include <netinet/ip_icmp.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
+#include <optional>
 #include <pcap/pcap.h>
+#include <poll.h>
+#include <pwd.h>
+#include <set>
+#include <shared_mutex>
 #include <spdlog/cfg/env.h>
 #include <spdlog/spdlog.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
 #include <thread>
 #include <tuple>
 #include <unistd.h>
+#include <unordered_map>
+
+/* what is captured while no pair is being forwarded */
+#define MVVM_GATEWAY_IDLE_FILTER "net 172.17.0.0/24"
+/* whole frames, forward() resends what was captured */
+#define MVVM_GATEWAY_SNAPLEN 65535
+#define MVVM_GATEWAY_CAPTURE_BUFFER (32 << 20)
+/* bounds how long a filter change waits for the capture thread */
+#define MVVM_GATEWAY_CAPTURE_TIMEOUT_MS 100
+/* what wakes a hibernated instance up, set by the build, run as an unprivileged user in the directory the instances
+ * hibernate in */
+#ifndef MVVM_GATEWAY_RESTORE_PATH
+#define MVVM_GATEWAY_RESTORE_PATH "/usr/local/bin/MVVM_restore"
+#endif
+#ifndef MVVM_GATEWAY_RESTORE_USER
+#define MVVM_GATEWAY_RESTORE_USER "nobody"
+#endif
+#ifndef MVVM_GATEWAY_SNAPSHOT_DIR
+#define MVVM_GATEWAY_SNAPSHOT_DIR "/var/lib/mvvm"
+#endif
+/* the seconds a restored instance idles before it hibernates again, and the most threads one may ask for */
+#define MVVM_GATEWAY_RESTORE_IDLE_TIMEOUT 300
+#define MVVM_GATEWAY_RESTORE_MAX_THREADS 1024
 
 using namespace Crafter;
 
-std::string client_ip;
-std::string server_ip;
-int client_port;
-int server_port;
 pcap_t *handle;
 int linkhdrlen = 14;
 int packets = 0;
-int client_fd;
 int fd;
 int new_fd;
 // assuming they are continuous
 struct connection_pair {
-    std::jthread *send;
-    std::jthread *recv;
+    int flow;
     int server_fd;
     int new_server;
     int new_client;
     bool is_sleep;
 };
 std::map<std::string, struct connection_pair> tcp_pair;
-std::vector<std::tuple<std::string, std::string, std::string>> forward_pair;
+std::mutex tcp_mtx;
+// a (server, client) pair as it was when its instance suspended
+using udp_pair = std::pair<std::string, std::string>;
+struct udp_pair_hash {
+    size_t operator()(const udp_pair &pair) const {
+        return std::hash<std::string>{}(pair.first) * 31 + std::hash<std::string>{}(pair.second);
+    }
+};
+// where the server of each pair is now, empty until its udp session resumes, erased once the session suspends again
+// or ends
+std::unordered_map<udp_pair, std::string, udp_pair_hash> forward_pair;
+// taken shared for every forwarded packet on the capture thread
+std::shared_mutex pair_mtx;
+// what the gateway keeps per instance, ops of one session run in order and sessions run side by side
+struct gateway_session : std::enable_shared_from_this<gateway_session> {
+    ~gateway_session() {
+        if (held_fd != -1)
+            close(held_fd);
+    }
+    std::mutex mtx;
+    // the pair handled last
+    std::string server_ip, client_ip;
+    int server_port{}, client_port{};
+    // this instance's keys in forward_pair
+    std::vector<udp_pair> pairs;
+    // the tcp_pair keys of the last suspend with the server port of each, resume reconnects all of them
+    std::vector<std::pair<std::string, int>> tcp_keys;
+    // between a suspend and its resume, and the control connection that spoke for the instance last. The session
+    // ends when that connection closes while the instance runs, ended tells a request that raced it to look again
+    bool suspended{}, ended{};
+    uint64_t conn{};
+    // the last request handled, a runtime that missed its ack sends it again
+    std::optional<uint32_t> last_seq;
+    // hibernated, the gateway's listening socket for it and the port behind it, an eventfd the forwarder writes to
+    // once a peer sends on a held connection, and a count that tells a watcher whether it is still the one to
+    // restore the instance
+    bool hibernated{};
+    int listen_fd = -1, listen_port{};
+    int held_fd = -1;
+    uint64_t generation{};
+    // what the instance hibernated to, in MVVM_GATEWAY_SNAPSHOT_DIR, and the threads it ran with
+    std::string snapshot;
+    uint32_t threads{};
+};
+std::mutex session_mtx;
+std::map<uint64_t, std::shared_ptr<gateway_session>> sessions;
+// what clients sent to a suspended udp pair, filled and replayed on the capture thread under a shared pair_mtx,
+// dropped with the pair under an exclusive one
+std::unordered_map<udp_pair, SpillBuffer, udp_pair_hash> held_packets;
+// set by resume to have the capture thread send what it held right away, then hand the pairs to the kernel
+std::atomic<bool> replay_pending;
+// attached when the gateway is built with MVVM_GATEWAY_BPF
+BpfRewriter *bpf_rewriter;
+// the pairs handed to the kernel, what the capture saw after since already went out rewritten, guarded like
+// held_packets
+struct kernel_pair {
+    std::string addr;
+    struct timeval since;
+};
+std::unordered_map<udp_pair, kernel_pair, udp_pair_hash> kernel_pairs;
 std::vector<std::jthread> backend_thread;
-bool is_forward = false;
+Forwarder *forwarder;
+// owned by the capture thread, flushed after every pcap_dispatch
+RawSender *raw_sender;
 int id = 0;
-struct mvvm_op_data *op_data;
-// Function to recalculate the IP checksum
-unsigned short in_cksum(unsigned short *buf, int len) {
-    unsigned long sum = 0;
-    while (len > 1) {
-        sum += *buf++;
-        len -= 2;
-    }
-    if (len)
-        sum += *(unsigned char *)buf;
-    sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
-    return (unsigned short)(~sum);
-}
+// per packet logs, SPDLOG_LEVEL=trace
+bool trace_packets = false;
+// the capture thread owns the handle, the control loop hands it a new filter through these
+std::mutex filter_mtx;
+std::string pending_filter;
+std::atomic<bool> filter_dirty;
 // https://github.com/pellegre/libcrafter-examples/blob/03832c5c6f68b55a714877bf53aaba2fc33c43ff/SimpleHijackConnection/main.cpp#L113
-void forward(const unsigned char *buf, int len) {
-    int sock;
-    struct sockaddr_in dst {};
-
-    memset(&dst, 0, sizeof(dst));
-    dst.sin_family = AF_INET;
-    dst.sin_addr.s_addr = ((const struct iphdr *)buf)->daddr;
-    sock = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
-    if (sendto(sock, buf, len, 0, (struct sockaddr *)&dst, sizeof(dst)) != len) {
-        SPDLOG_ERROR("forward: sending failed.");
-        return;
-    } else {
-        SPDLOG_INFO("DEBUG: forward: sending succeeded.");
+void forward(const unsigned char *buf, int len) { raw_sender->send(buf, len); }
+
+/** Keep a client packet for a suspended pair, its length first. */
+void hold_packet(const udp_pair &pair, const struct ip *iphdr, size_t len) {
+    static uint8_t record[sizeof(uint32_t) + MVVM_GATEWAY_SNAPLEN];
+    auto &held = held_packets.try_emplace(pair).first->second;
+    uint32_t size = len;
+    if (held.room() < sizeof(size) + len) {
+        SPDLOG_DEBUG("{} <-> {} holds all it can, dropping", pair.first, pair.second);
         return;
     }
+    memcpy(record, &size, sizeof(size));
+    memcpy(record + sizeof(size), iphdr, len);
+    held.push(record, sizeof(size) + len);
 }
-void forwardv6(const unsigned char *buf, int len) {
-    int sock;
-    struct sockaddr_in6 dst {};
-
-    memset(&dst, 0, sizeof(dst));
-    dst.sin6_family = AF_INET6;
-
-    // Extract the destination address from the IPv6 header
-    dst.sin6_addr = ((const struct ip6_hdr *)buf)->ip6_dst;
-
-    // Create a raw socket with IPv6 domain
-    sock = socket(AF_INET6, SOCK_RAW, IPPROTO_RAW);
-    if (sock < 0) {
-        SPDLOG_ERROR("forwardv6: socket creation failed.");
+/** Send what was held for a pair to where its server is now, oldest first. */
+void replay_held(const udp_pair &pair, const std::string &new_ip) {
+    static uint8_t record[sizeof(uint32_t) + MVVM_GATEWAY_SNAPLEN];
+    auto it = held_packets.find(pair);
+    if (it == held_packets.end())
         return;
+    auto &held = it->second;
+    auto now = inet_addr(new_ip.c_str());
+    size_t count = 0;
+    uint32_t size;
+    while (held.peek(&size, sizeof(size)) == sizeof(size) &&
+           held.peek(record, sizeof(size) + size) == sizeof(size) + size) {
+        held.consume(sizeof(size) + size);
+        auto *iphdr = (struct ip *)(record + sizeof(size));
+        rewrite_addr(iphdr, iphdr->ip_dst, now, size);
+        forward(reinterpret_cast<const unsigned char *>(iphdr), size);
+        count++;
     }
+    SPDLOG_INFO("replayed {} packets to {}", count, new_ip);
+    held_packets.erase(it);
+}
 
-    if (sendto(sock, buf, len, 0, (struct sockaddr *)&dst, sizeof(dst)) != len) {
-        SPDLOG_ERROR("forwardv6: sending failed.");
-    } else {
-        SPDLOG_INFO("forwardv6: sending succeeded.");
-    }
-
-    // Close the socket
-    close(sock);
+/** Whether tc rewrote this packet itself, the capture gets a copy from before the rewrite. */
+bool in_kernel(const udp_pair &pair, const struct timeval &ts) {
+    auto it = kernel_pairs.find(pair);
+    return it != kernel_pairs.end() && !timercmp(&ts, &it->second.since, <);
 }
 
 // can be rewrite by libcraft?
@@ -130,7 +216,8 @@ void packet_handler(u_char *user, const struct pcap_pkthdr *header, const u_char
     packetptr += linkhdrlen;
     iphdr = (struct ip *)packetptr;
     if (iphdr->ip_v == 6) {
-        SPDLOG_INFO("ipv6");
+        if (trace_packets)
+            SPDLOG_INFO("ipv6");
         packetptr += linkhdrlen;
         ipv6hdr = (struct ip6_hdr *)packetptr;
         inet_ntop(AF_INET6, &ipv6hdr->ip6_src, srcip, sizeof(srcip));
@@ -142,59 +229,56 @@ void packet_handler(u_char *user, const struct pcap_pkthdr *header, const u_char
         switch (ipv6hdr->ip6_nxt) {
         case IPPROTO_TCP:
             tcphdr = (struct tcphdr *)packetptr;
-            SPDLOG_INFO("TCP6  {}:{} -> {}:{}", srcip, ntohs(tcphdr->th_sport), dstip, ntohs(tcphdr->th_dport));
-            SPDLOG_INFO("ID:{} TOS:0x{}, TTL:{} IpLen:{} DgLen:{}", ntohs(iphdr->ip_id), iphdr->ip_tos, iphdr->ip_ttl,
-                        4 * iphdr->ip_hl, ntohs(iphdr->ip_len));
-            SPDLOG_INFO("{}{}{}{}{}{} Seq: 0x{} Ack: 0x{} Win: 0x{} TcpLen: {}",
-                        (tcphdr->th_flags & TH_URG ? 'U' : '*'), (tcphdr->th_flags & TH_ACK ? 'A' : '*'),
-                        (tcphdr->th_flags & TH_PUSH ? 'P' : '*'), (tcphdr->th_flags & TH_RST ? 'R' : '*'),
-                        (tcphdr->th_flags & TH_SYN ? 'S' : '*'), (tcphdr->th_flags & TH_SYN ? 'F' : '*'),
-                        ntohl(tcphdr->th_seq), ntohl(tcphdr->th_ack), ntohs(tcphdr->th_win), 4 * tcphdr->th_off);
-            SPDLOG_INFO("+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+");
+            if (trace_packets) {
+                SPDLOG_INFO("TCP6  {}:{} -> {}:{}", srcip, ntohs(tcphdr->th_sport), dstip, ntohs(tcphdr->th_dport));
+                SPDLOG_INFO("ID:{} TOS:0x{}, TTL:{} IpLen:{} DgLen:{}", ntohs(iphdr->ip_id), iphdr->ip_tos,
+                            iphdr->ip_ttl, 4 * iphdr->ip_hl, ntohs(iphdr->ip_len));
+                SPDLOG_INFO("{}{}{}{}{}{} Seq: 0x{} Ack: 0x{} Win: 0x{} TcpLen: {}",
+                            (tcphdr->th_flags & TH_URG ? 'U' : '*'), (tcphdr->th_flags & TH_ACK ? 'A' : '*'),
+                            (tcphdr->th_flags & TH_PUSH ? 'P' : '*'), (tcphdr->th_flags & TH_RST ? 'R' : '*'),
+                            (tcphdr->th_flags & TH_SYN ? 'S' : '*'), (tcphdr->th_flags & TH_SYN ? 'F' : '*'),
+                            ntohl(tcphdr->th_seq), ntohl(tcphdr->th_ack), ntohs(tcphdr->th_win), 4 * tcphdr->th_off);
+                SPDLOG_INFO("+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+");
+            }
             packets += 1;
             break;
 
         case IPPROTO_UDP:
             udphdr = (struct udphdr *)packetptr;
-            SPDLOG_INFO("UDP6  {}:{} -> {}:{}", srcip, ntohs(udphdr->uh_sport), dstip, ntohs(udphdr->uh_dport));
-            SPDLOG_INFO("ID:{} TOS:0x{}, TTL:{} IpLen:{} DgLen:{}", ntohs(iphdr->ip_id), iphdr->ip_tos, iphdr->ip_ttl,
-                        4 * iphdr->ip_hl, ntohs(iphdr->ip_len));
-            SPDLOG_INFO("+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+");
+            if (trace_packets) {
+                SPDLOG_INFO("UDP6  {}:{} -> {}:{}", srcip, ntohs(udphdr->uh_sport), dstip, ntohs(udphdr->uh_dport));
+                SPDLOG_INFO("ID:{} TOS:0x{}, TTL:{} IpLen:{} DgLen:{}", ntohs(iphdr->ip_id), iphdr->ip_tos,
+                            iphdr->ip_ttl, 4 * iphdr->ip_hl, ntohs(iphdr->ip_len));
+                SPDLOG_INFO("+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+");
+            }
             packets += 1;
             break;
 
         case IPPROTO_ICMPV6:
             icmp6hdr = (struct icmp6_hdr *)packetptr;
-            SPDLOG_INFO("ICMP6 {} -> {}", srcip, dstip);
-            SPDLOG_INFO("ID:{} TOS:0x{}, TTL:{} IpLen:{} DgLen:{}", ntohs(iphdr->ip_id), iphdr->ip_tos, iphdr->ip_ttl,
-                        4 * iphdr->ip_hl, ntohs(iphdr->ip_len));
-            SPDLOG_INFO("Type:{} Code:{}", icmp6hdr->icmp6_type, icmp6hdr->icmp6_code);
-            SPDLOG_INFO("+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+");
+            if (trace_packets) {
+                SPDLOG_INFO("ICMP6 {} -> {}", srcip, dstip);
+                SPDLOG_INFO("ID:{} TOS:0x{}, TTL:{} IpLen:{} DgLen:{}", ntohs(iphdr->ip_id), iphdr->ip_tos,
+                            iphdr->ip_ttl, 4 * iphdr->ip_hl, ntohs(iphdr->ip_len));
+                SPDLOG_INFO("Type:{} Code:{}", icmp6hdr->icmp6_type, icmp6hdr->icmp6_code);
+                SPDLOG_INFO("+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+");
+            }
             packets += 1;
             break;
         }
-        if (is_forward && !op_data->is_tcp) { // Skip the datalink layer header and get the IP header fields.
-            // init the socket
-            for (auto [srcip, destip, new_srcip] : forward_pair) {
-                if (srcip == inet_ntoa(iphdr->ip_src) && destip == inet_ntoa(iphdr->ip_dst)) {
-                    iphdr->ip_src.s_addr = inet_addr(new_srcip.c_str());
-                    // Recalculate the IP checksum
-                    iphdr->ip_sum = 0;
-                    iphdr->ip_sum = in_cksum((unsigned short *)iphdr, iphdr->ip_hl * 4);
-
-                    forward(reinterpret_cast<const unsigned char *>(iphdr), header->len);
-                    return;
-                }
-                if (srcip == inet_ntoa(iphdr->ip_dst) && destip == inet_ntoa(iphdr->ip_src)) {
-                    iphdr->ip_dst.s_addr = inet_addr(new_srcip.c_str());
-                    // Recalculate the IP checksum
-                    iphdr->ip_sum = 0;
-                    iphdr->ip_sum = in_cksum((unsigned short *)iphdr, iphdr->ip_hl * 4);
-
-                    forward(reinterpret_cast<const unsigned char *>(iphdr), header->len);
-                    return;
-                }
-            }
+        std::string src = inet_ntoa(iphdr->ip_src), dst = inet_ntoa(iphdr->ip_dst);
+        std::shared_lock lock(pair_mtx);
+        auto it = forward_pair.find({src, dst});
+        if (it != forward_pair.end() && !it->second.empty()) {
+            rewrite_addr(iphdr, iphdr->ip_src, inet_addr(it->second.c_str()), header->caplen - linkhdrlen);
+            forward(reinterpret_cast<const unsigned char *>(iphdr), header->caplen - linkhdrlen);
+            return;
+        }
+        it = forward_pair.find({dst, src});
+        if (it != forward_pair.end() && !it->second.empty()) {
+            rewrite_addr(iphdr, iphdr->ip_dst, inet_addr(it->second.c_str()), header->caplen - linkhdrlen);
+            forward(reinterpret_cast<const unsigned char *>(iphdr), header->caplen - linkhdrlen);
+            return;
         }
 
     } else {
@@ -207,76 +291,148 @@ void packet_handler(u_char *user, const struct pcap_pkthdr *header, const u_char
         switch (iphdr->ip_p) {
         case IPPROTO_TCP:
             tcphdr = (struct tcphdr *)packetptr;
-            SPDLOG_INFO("TCP  {}:{} -> {}:{}", srcip, ntohs(tcphdr->th_sport), dstip, ntohs(tcphdr->th_dport));
-            SPDLOG_INFO("ID:{} TOS:0x{}, TTL:{} IpLen:{} DgLen:{}", ntohs(iphdr->ip_id), iphdr->ip_tos, iphdr->ip_ttl,
-                        4 * iphdr->ip_hl, ntohs(iphdr->ip_len));
-            SPDLOG_INFO("{}{}{}{}{}{} Seq: 0x{} Ack: 0x{} Win: 0x{} TcpLen: {}",
-                        (tcphdr->th_flags & TH_URG ? 'U' : '*'), (tcphdr->th_flags & TH_ACK ? 'A' : '*'),
-                        (tcphdr->th_flags & TH_PUSH ? 'P' : '*'), (tcphdr->th_flags & TH_RST ? 'R' : '*'),
-                        (tcphdr->th_flags & TH_SYN ? 'S' : '*'), (tcphdr->th_flags & TH_SYN ? 'F' : '*'),
-                        ntohl(tcphdr->th_seq), ntohl(tcphdr->th_ack), ntohs(tcphdr->th_win), 4 * tcphdr->th_off);
-            SPDLOG_INFO("+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+");
+            if (trace_packets) {
+                SPDLOG_INFO("TCP  {}:{} -> {}:{}", srcip, ntohs(tcphdr->th_sport), dstip, ntohs(tcphdr->th_dport));
+                SPDLOG_INFO("ID:{} TOS:0x{}, TTL:{} IpLen:{} DgLen:{}", ntohs(iphdr->ip_id), iphdr->ip_tos,
+                            iphdr->ip_ttl, 4 * iphdr->ip_hl, ntohs(iphdr->ip_len));
+                SPDLOG_INFO("{}{}{}{}{}{} Seq: 0x{} Ack: 0x{} Win: 0x{} TcpLen: {}",
+                            (tcphdr->th_flags & TH_URG ? 'U' : '*'), (tcphdr->th_flags & TH_ACK ? 'A' : '*'),
+                            (tcphdr->th_flags & TH_PUSH ? 'P' : '*'), (tcphdr->th_flags & TH_RST ? 'R' : '*'),
+                            (tcphdr->th_flags & TH_SYN ? 'S' : '*'), (tcphdr->th_flags & TH_SYN ? 'F' : '*'),
+                            ntohl(tcphdr->th_seq), ntohl(tcphdr->th_ack), ntohs(tcphdr->th_win), 4 * tcphdr->th_off);
+                SPDLOG_INFO("+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+");
+            }
             packets += 1;
             break;
 
         case IPPROTO_UDP:
             udphdr = (struct udphdr *)packetptr;
-            SPDLOG_INFO("UDP  {}:{} -> {}:{}", srcip, ntohs(udphdr->uh_sport), dstip, ntohs(udphdr->uh_dport));
-            SPDLOG_INFO("ID:{} TOS:0x{}, TTL:{} IpLen:{} DgLen:{}", ntohs(iphdr->ip_id), iphdr->ip_tos, iphdr->ip_ttl,
-                        4 * iphdr->ip_hl, ntohs(iphdr->ip_len));
             id = ntohs(iphdr->ip_id) + 1;
-            SPDLOG_ERROR("id", id);
-            SPDLOG_INFO("+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+");
-
-            for (int idx = 0; idx < op_data->size; idx++)
-                if (op_data->addr[idx][0].port == 0) {
-                    op_data->addr[idx][0].port = udphdr->uh_sport;
-                }
+            if (trace_packets) {
+                SPDLOG_INFO("UDP  {}:{} -> {}:{}", srcip, ntohs(udphdr->uh_sport), dstip, ntohs(udphdr->uh_dport));
+                SPDLOG_INFO("ID:{} TOS:0x{}, TTL:{} IpLen:{} DgLen:{}", ntohs(iphdr->ip_id), iphdr->ip_tos,
+                            iphdr->ip_ttl, 4 * iphdr->ip_hl, ntohs(iphdr->ip_len));
+                SPDLOG_INFO("id {}", id);
+                SPDLOG_INFO("+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+");
+            }
             packets += 1;
-
             break;
 
         case IPPROTO_ICMP:
             icmphdr = (struct icmp *)packetptr;
-            SPDLOG_INFO("ICMP {} -> {}", srcip, dstip);
-            SPDLOG_INFO("ID:{} TOS:0x{}, TTL:{} IpLen:{} DgLen:{}", ntohs(iphdr->ip_id), iphdr->ip_tos, iphdr->ip_ttl,
-                        4 * iphdr->ip_hl, ntohs(iphdr->ip_len));
-            SPDLOG_INFO("Type:{} Code:{} ID:{} Seq:{}", icmphdr->icmp_type, icmphdr->icmp_code,
-                        ntohs(icmphdr->icmp_hun.ih_idseq.icd_id), ntohs(icmphdr->icmp_hun.ih_idseq.icd_seq));
-            SPDLOG_INFO("+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+");
+            if (trace_packets) {
+                SPDLOG_INFO("ICMP {} -> {}", srcip, dstip);
+                SPDLOG_INFO("ID:{} TOS:0x{}, TTL:{} IpLen:{} DgLen:{}", ntohs(iphdr->ip_id), iphdr->ip_tos,
+                            iphdr->ip_ttl, 4 * iphdr->ip_hl, ntohs(iphdr->ip_len));
+                SPDLOG_INFO("Type:{} Code:{} ID:{} Seq:{}", icmphdr->icmp_type, icmphdr->icmp_code,
+                            ntohs(icmphdr->icmp_hun.ih_idseq.icd_id), ntohs(icmphdr->icmp_hun.ih_idseq.icd_seq));
+                SPDLOG_INFO("+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+");
+            }
             packets += 1;
             break;
         }
-        if (is_forward && !op_data->is_tcp) { // Skip the datalink layer header and get the IP header fields.
-            // init the socket
-            for (auto [srcip_, destip_, new_srcip] : forward_pair) {
-                SPDLOG_DEBUG("{} srcip:{}, destip:{}", header->len, srcip_, destip_);
-
-                if (srcip_ == inet_ntoa(iphdr->ip_src) && destip_ == inet_ntoa(iphdr->ip_dst)) {
-                    iphdr->ip_src.s_addr = inet_addr(new_srcip.c_str());
-                    // Recalculate the IP checksum
-                    iphdr->ip_sum = 0;
-                    iphdr->ip_sum = in_cksum((unsigned short *)iphdr, iphdr->ip_hl * 4);
-
-                    forward(reinterpret_cast<const unsigned char *>(iphdr), header->len);
-                    return;
-                }
-                if (srcip_ == inet_ntoa(iphdr->ip_dst) && destip_ == inet_ntoa(iphdr->ip_src)) {
-                    iphdr->ip_dst.s_addr = inet_addr(new_srcip.c_str());
-                    // Recalculate the IP checksum
-                    iphdr->ip_sum = 0;
-                    iphdr->ip_sum = in_cksum((unsigned short *)iphdr, iphdr->ip_hl * 4);
-
-                    forward(reinterpret_cast<const unsigned char *>(iphdr), header->len);
-                    return;
-                }
-            }
+        // the captured length, not header->len, and never past what the ip header claims
+        size_t len = std::min<size_t>(header->caplen - linkhdrlen, ntohs(iphdr->ip_len));
+        SPDLOG_DEBUG("{} srcip:{}, destip:{}", len, srcip, dstip);
+        std::shared_lock lock(pair_mtx);
+        // from the server, as it was addressed before it moved
+        auto it = forward_pair.find({srcip, dstip});
+        if (it != forward_pair.end() && !it->second.empty()) {
+            if (in_kernel(it->first, header->ts))
+                return;
+            rewrite_addr(iphdr, iphdr->ip_src, inet_addr(it->second.c_str()), len);
+            forward(reinterpret_cast<const unsigned char *>(iphdr), len);
+            return;
         }
+        // to it
+        it = forward_pair.find({dstip, srcip});
+        if (it == forward_pair.end())
+            return;
+        // the instance is suspended, keep it for when it is back instead of leaving it to the client to resend
+        if (it->second.empty()) {
+            hold_packet(it->first, iphdr, len);
+            return;
+        }
+        if (in_kernel(it->first, header->ts))
+            return;
+        replay_held(it->first, it->second);
+        rewrite_addr(iphdr, iphdr->ip_dst, inet_addr(it->second.c_str()), len);
+        forward(reinterpret_cast<const unsigned char *>(iphdr), len);
     }
 }
+/** The capture filter for the pairs being forwarded, only their udp is ever rewritten. */
+std::string capture_filter() {
+    std::set<std::pair<std::string, std::string>> hosts;
+    std::shared_lock lock(pair_mtx);
+    for (auto &[pair, new_srcip] : forward_pair)
+        hosts.insert(pair);
+    if (hosts.empty())
+        return MVVM_GATEWAY_IDLE_FILTER;
+    std::string filter;
+    for (auto &[srcip, destip] : hosts)
+        filter += fmt::format("{}(host {} and host {})", filter.empty() ? "" : " or ", srcip, destip);
+    return fmt::format("udp and ({})", filter);
+}
+bool apply_capture_filter(pcap_t *handle, const std::string &filter) {
+    struct bpf_program fp {};
+    if (pcap_compile(handle, &fp, filter.c_str(), 1, PCAP_NETMASK_UNKNOWN) == -1) {
+        SPDLOG_ERROR("Couldn't parse filter {}: {}", filter, pcap_geterr(handle));
+        return false;
+    }
+    auto ok = pcap_setfilter(handle, &fp) != -1;
+    if (!ok)
+        SPDLOG_ERROR("Couldn't install filter {}: {}", filter, pcap_geterr(handle));
+    pcap_freecode(&fp);
+    return ok;
+}
+void set_capture_filter(std::string filter) {
+    SPDLOG_INFO("capture filter {}", filter);
+    {
+        std::lock_guard lock(filter_mtx);
+        pending_filter = std::move(filter);
+    }
+    filter_dirty = true;
+    pcap_breakloop(handle);
+}
 void pcap_loop_wrapper(const std::stop_token &stopToken, pcap_t *handle, pcap_handler packet_handler) {
-    while (!stopToken.stop_requested())
-        pcap_loop(handle, -1, packet_handler, nullptr);
+    while (!stopToken.stop_requested()) {
+        if (filter_dirty.exchange(false)) {
+            std::unique_lock lock(filter_mtx);
+            auto filter = pending_filter;
+            lock.unlock();
+            apply_capture_filter(handle, filter);
+        }
+        if (replay_pending.exchange(false)) {
+            std::shared_lock lock(pair_mtx);
+            std::vector<udp_pair> ready;
+            for (auto &[pair, held] : held_packets)
+                if (auto it = forward_pair.find(pair); it != forward_pair.end() && !it->second.empty())
+                    ready.push_back(pair);
+            for (auto &pair : ready)
+                replay_held(pair, forward_pair.at(pair));
+            // only after what was held, so nothing the client sent earlier overtakes it
+            for (auto &[pair, new_srcip] : forward_pair) {
+                if (!bpf_rewriter)
+                    break;
+                auto it = kernel_pairs.find(pair);
+                if (new_srcip.empty() || (it != kernel_pairs.end() && it->second.addr == new_srcip) ||
+                    !bpf_rewriter->set(pair.first, pair.second, new_srcip))
+                    continue;
+                if (it == kernel_pairs.end()) {
+                    it = kernel_pairs.emplace(pair, kernel_pair{}).first;
+                    gettimeofday(&it->second.since, nullptr);
+                }
+                it->second.addr = new_srcip;
+            }
+        }
+        // everything already in the ring is handled in one call, and what it rewrote goes out together
+        auto rc = pcap_dispatch(handle, -1, packet_handler, nullptr);
+        raw_sender->flush();
+        if (rc == PCAP_ERROR) {
+            SPDLOG_ERROR("pcap_dispatch(): {}", pcap_geterr(handle));
+            return;
+        }
+    }
 }
 
 void send_fin(std::string source_ip, int source_port, std::string dest_ip, int dest_port, const char *payload) {
@@ -312,8 +468,9 @@ void sigterm_handler(int sig) {
         SPDLOG_INFO("{} packets dropped", stats.ps_drop);
     }
     pcap_close(handle);
-    close(client_fd);
     close(fd);
+    // the filter outlives the process otherwise, rewriting for a gateway that is gone
+    delete bpf_rewriter;
     SPDLOG_INFO("Bye");
     exit(0);
 }
@@ -322,24 +479,442 @@ void sigterm_handler(int sig) {
 //     op_data->op = MVVM_SOCK_FIN;
 //     send_fin("172.17.0.3",12346,"172.17.0.2",15772,((char *)op_data));
 // }
+std::string format_addr(const SocketAddrPool &addr) {
+    if (addr.is_4)
+        return fmt::format("{}.{}.{}.{}", addr.ip4[0], addr.ip4[1], addr.ip4[2], addr.ip4[3]);
+    return fmt::format("{:04x}:{:04x}:{:04x}:{:04x}:{:04x}:{:04x}:{:04x}:{:04x}", addr.ip6[0], addr.ip6[1], addr.ip6[2],
+                       addr.ip6[3], addr.ip6[4], addr.ip6[5], addr.ip6[6], addr.ip6[7]);
+}
+/** Stop forwarding the pairs of the session's last suspend, they were resumed already or the instance is gone. */
+void drop_pairs(gateway_session &session) {
+    {
+        std::unique_lock lock(pair_mtx);
+        for (auto &pair : session.pairs) {
+            // what the kernel would have rewritten has to reach the capture again, and be held there
+            if (bpf_rewriter)
+                bpf_rewriter->unset(pair.first, pair.second);
+            kernel_pairs.erase(pair);
+            held_packets.erase(pair);
+            forward_pair.erase(pair);
+        }
+    }
+    session.pairs.clear();
+}
+void handle_suspend(gateway_session &session, const GatewayRequest &req) {
+    struct mvvm_op_data fin {};
+    fin.op = MVVM_SOCK_FIN;
+    fin.is_tcp = req.is_tcp;
+    session.suspended = true;
+    // suspended again, the pairs of the last time were resumed already and don't match anything anymore
+    drop_pairs(session);
+    session.tcp_keys.clear();
+    for (auto &[server, client] : req.addr) {
+        session.server_ip = format_addr(server);
+        session.client_ip = format_addr(client);
+        session.server_port = server.port;
+        session.client_port = client.port;
+        SPDLOG_INFO("server_ip: {}:{} client_ip: {}:{}", session.server_ip, session.server_port, session.client_ip,
+                    session.client_port);
+        {
+            std::unique_lock lock(pair_mtx);
+            session.pairs.emplace_back(session.server_ip, session.client_ip);
+            forward_pair.insert_or_assign(session.pairs.back(), "");
+        }
+        // send the fin to server
+        SPDLOG_INFO("send fin");
+        if (!req.is_tcp) {
+            send_fin(session.client_ip, session.client_port, session.server_ip, session.server_port, (char *)&fin);
+            continue;
+        }
+        auto key = fmt::format("{}:{}", session.server_ip, session.server_port);
+        struct connection_pair to_stop {};
+        {
+            std::lock_guard lock(tcp_mtx);
+            auto it = tcp_pair.find(key);
+            if (it == tcp_pair.end()) {
+                SPDLOG_ERROR("{} has no connection through the gateway, not suspending it", key);
+                continue;
+            }
+            it->second.is_sleep = true;
+            to_stop = it->second;
+        }
+        session.tcp_keys.emplace_back(key, session.server_port);
+        // everything relayed so far reaches the guest ahead of the fin, then the peer's bytes wait for resume at the
+        // gateway, the fin goes to the side that migrates, a hibernating instance is a server too
+        bool is_server = req.op != MVVM_SOCK_SUSPEND;
+        forwarder->pause(to_stop.flow, is_server ? 0 : 1, req.op == MVVM_SOCK_HIBERNATE ? session.held_fd : -1);
+        send(is_server ? to_stop.new_client : to_stop.new_server, (char *)&fin, sizeof(fin), 0);
+        if (req.op == MVVM_SOCK_HIBERNATE) {
+            session.listen_fd = to_stop.server_fd;
+            session.listen_port = session.server_port;
+        }
+    }
+    set_capture_filter(capture_filter());
+}
+int connect_to(const std::string &ip, int port) {
+    struct sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip.c_str(), &address.sin_addr) <= 0) {
+        SPDLOG_ERROR("Invalid address/ Address not supported");
+        return -1;
+    }
+    int conn = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(conn, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        SPDLOG_ERROR("connect failed {}", errno);
+        close(conn);
+        return -1;
+    }
+    return conn;
+}
+/** Take the snapshot name and thread count out of a hibernate request, false if either is not fit for a restore. */
+bool parse_hibernate(gateway_session &session, const std::string &data) {
+    std::vector<std::string> fields;
+    for (size_t pos = 0, end; (end = data.find('\0', pos)) != std::string::npos; pos = end + 1)
+        fields.emplace_back(data, pos, end - pos);
+    if (fields.size() != 2) {
+        SPDLOG_ERROR("hibernated with {} fields instead of a snapshot and a thread count", fields.size());
+        return false;
+    }
+    // a file right in the snapshot directory, and nothing MVVM_restore would take for an option
+    auto &name = fields[0];
+    if (name.empty() || name.size() > NAME_MAX || name == "." || name == ".." || name[0] == '-' ||
+        name.find('/') != std::string::npos) {
+        SPDLOG_ERROR("hibernated to a snapshot named '{}', not restoring it", name);
+        return false;
+    }
+    uint32_t threads{};
+    auto [end, ec] = std::from_chars(fields[1].data(), fields[1].data() + fields[1].size(), threads);
+    if (ec != std::errc() || end != fields[1].data() + fields[1].size() || !threads ||
+        threads > MVVM_GATEWAY_RESTORE_MAX_THREADS) {
+        SPDLOG_ERROR("hibernated with '{}' threads, not restoring it", fields[1]);
+        return false;
+    }
+    session.snapshot = std::move(name);
+    session.threads = threads;
+    return true;
+}
+/** Start MVVM_restore for a hibernated instance, as MVVM_GATEWAY_RESTORE_USER with nothing of the gateway's. */
+bool spawn_restore(const gateway_session &session) {
+    auto threads = std::to_string(session.threads);
+    auto idle_timeout = std::to_string(MVVM_GATEWAY_RESTORE_IDLE_TIMEOUT);
+    const char *argv[] = {MVVM_GATEWAY_RESTORE_PATH, "-t", session.snapshot.c_str(), "-T", threads.c_str(),
+                          "--idle_timeout", idle_timeout.c_str(), nullptr};
+    if (access(MVVM_GATEWAY_RESTORE_PATH, X_OK) == -1) {
+        SPDLOG_ERROR("can't run {} {}", MVVM_GATEWAY_RESTORE_PATH, errno);
+        return false;
+    }
+    // looked up before the fork, the child of a threaded process only gets to make plain system calls
+    struct passwd pw {}, *user{};
+    std::vector<char> buf(sysconf(_SC_GETPW_R_SIZE_MAX) > 0 ? sysconf(_SC_GETPW_R_SIZE_MAX) : 16384);
+    if (getpwnam_r(MVVM_GATEWAY_RESTORE_USER, &pw, buf.data(), buf.size(), &user) != 0 || !user) {
+        SPDLOG_ERROR("no user {} to restore as", MVVM_GATEWAY_RESTORE_USER);
+        return false;
+    }
+    bool drop = geteuid() == 0;
+    auto pid = fork();
+    if (pid == -1) {
+        SPDLOG_ERROR("fork failed {}", errno);
+        return false;
+    }
+    if (pid == 0) {
+        // nothing of the gateway's, like the listening sockets, goes along, nor does root
+        close_range(3, ~0U, 0);
+        if (chdir(MVVM_GATEWAY_SNAPSHOT_DIR) == -1)
+            _exit(127);
+        if (drop && (setgroups(1, &user->pw_gid) == -1 || setgid(user->pw_gid) == -1 || setuid(user->pw_uid) == -1))
+            _exit(127);
+        execv(argv[0], (char *const *)argv);
+        _exit(127);
+    }
+    SPDLOG_INFO("restoring {} as {}", session.snapshot, pid);
+    return true;
+}
+/** Hibernate is a tcp server suspend that the gateway ends with a restore itself, once someone connects. */
+void handle_hibernate(gateway_session &session, const GatewayRequest &req) {
+    if (session.held_fd == -1 && (session.held_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        SPDLOG_ERROR("eventfd failed {}, only a new connection wakes {:x}", errno, req.session);
+    // left over from a hibernation that was resumed some other way
+    uint64_t count;
+    read(session.held_fd, &count, sizeof(count));
+    handle_suspend(session, req);
+    if (session.listen_fd <= 0) {
+        SPDLOG_ERROR("no listening socket for {:x}, nothing will wake it up", req.session);
+        return;
+    }
+    if (!parse_hibernate(session, req.data))
+        return;
+    session.hibernated = true;
+    SPDLOG_INFO("{:x} hibernated, restoring on the next connection", req.session);
+    std::thread([s = session.shared_from_this(), generation = ++session.generation] {
+        // a new connection, or bytes on one the gateway holds for it
+        struct pollfd pfd[] = {{s->listen_fd, POLLIN, 0}, {s->held_fd, POLLIN, 0}};
+        while (poll(pfd, 2, -1) == -1 && errno == EINTR)
+            ;
+        std::lock_guard lock(s->mtx);
+        // resumed or hibernated again in the meantime, it's another watcher's turn
+        if (!s->hibernated || s->generation != generation)
+            return;
+        s->generation++;
+        uint64_t count;
+        read(s->held_fd, &count, sizeof(count));
+        spawn_restore(*s);
+    }).detach();
+}
+/** Relay the connections that queued up while the instance was hibernated to where it is now. */
+void hand_over_pending(int listen_fd, const std::string &ip, int port) {
+    struct pollfd pfd = {listen_fd, POLLIN, 0};
+    size_t count = 0;
+    while (poll(&pfd, 1, 0) == 1) {
+        int pending = accept(listen_fd, nullptr, nullptr);
+        if (pending == -1)
+            break;
+        int upstream = connect_to(ip, port);
+        if (upstream == -1) {
+            close(pending);
+            continue;
+        }
+        forwarder->add(pending, upstream);
+        count++;
+    }
+    SPDLOG_INFO("handed {} pending connections to {}:{}", count, ip, port);
+}
+void handle_resume(gateway_session &session, const GatewayRequest &req) {
+    auto new_ip = format_addr(req.addr[0][0]);
+    SPDLOG_INFO("resume {:x} at {}", req.session, new_ip);
+    session.suspended = false;
+    if (!req.is_tcp) {
+        {
+            std::unique_lock lock(pair_mtx);
+            for (auto &pair : session.pairs)
+                if (auto it = forward_pair.find(pair); it != forward_pair.end())
+                    it->second = new_ip;
+        }
+        replay_pending = true;
+        pcap_breakloop(handle);
+        return;
+    }
+    if (req.op == MVVM_SOCK_RESUME_TCP_SERVER)
+        sleep(5);
+    for (auto &[key, port] : session.tcp_keys) {
+        struct connection_pair to_start {};
+        {
+            std::lock_guard lock(tcp_mtx);
+            auto it = tcp_pair.find(key);
+            if (it == tcp_pair.end()) {
+                SPDLOG_ERROR("{} has no connection through the gateway, not resuming it", key);
+                continue;
+            }
+            to_start = it->second;
+        }
+        SPDLOG_INFO("{} resumes {}", new_ip, key);
+        struct sockaddr_in address {};
+        int new_server;
+        int new_client;
+        if (req.op != MVVM_SOCK_RESUME_TCP_SERVER) {
+            socklen_t size = sizeof(address);
+            new_server = accept(to_start.server_fd, (struct sockaddr *)&address, &size);
+            new_client = to_start.new_client;
+        } else {
+            new_server = to_start.new_server;
+            if ((new_client = connect_to(new_ip, port)) == -1)
+                continue;
+            to_start.new_client = new_client;
+        }
+
+        forwarder->resume(to_start.flow, new_server, new_client);
+        to_start.new_server = new_server;
+        to_start.is_sleep = false;
+        std::lock_guard lock(tcp_mtx);
+        tcp_pair.erase(key);
+        key = fmt::format("{}:{}", new_ip, port);
+        tcp_pair[key] = to_start;
+    }
+    if (session.hibernated) {
+        session.hibernated = false;
+        session.generation++;
+        hand_over_pending(session.listen_fd, new_ip, session.listen_port);
+    }
+}
+void handle_init(gateway_session &session, const GatewayRequest &req) {
+    struct sockaddr_in address {};
+    socklen_t addrlen = sizeof(address);
+    int opt = 1;
+    session.server_ip = format_addr(req.addr[0][0]);
+    session.client_ip = format_addr(req.addr[0][1]);
+    session.server_port = req.addr[0][0].port;
+    session.client_port = req.addr[0][1].port;
+
+    SPDLOG_INFO("server_ip:{}:{} client_ip:{}:{}", session.server_ip, session.server_port, session.client_ip,
+                session.client_port);
+
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0); // Create a socket
+
+    // Forcefully attaching socket to the port
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
+        SPDLOG_ERROR("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_port = htons(session.client_port);
+    // Convert IPv4 and IPv6 addresses from text to binary form
+    if (inet_pton(AF_INET, MVVM_SOCK_ADDR, &address.sin_addr) <= 0) {
+        SPDLOG_ERROR("Invalid address/ Address not supported");
+        exit(EXIT_FAILURE);
+    }
+
+    // Bind the socket to the network address and port
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        SPDLOG_ERROR("bind failed {}", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    // Start listening for connections
+    if (listen(server_fd, 3) < 0) {
+        SPDLOG_ERROR("listen");
+        exit(EXIT_FAILURE);
+    }
+    int new_server = accept(server_fd, (struct sockaddr *)&address, &addrlen); // will be instantly consumed
+    // Create a socket connect remote
+    int new_client = socket(AF_INET, SOCK_STREAM, 0);
+    // Convert IPv4 and IPv6 addresses from text to binary form
+
+    address.sin_family = AF_INET;
+    address.sin_port = htons(session.client_port);
+    if (inet_pton(AF_INET, session.client_ip.c_str(), &address.sin_addr) <= 0) {
+        SPDLOG_ERROR("Invalid address/ Address not supported");
+        exit(EXIT_FAILURE);
+    }
+
+    if (connect(new_client, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        SPDLOG_ERROR("connect failed {}", errno);
+        close(new_client);
+        exit(EXIT_FAILURE);
+    }
+    SPDLOG_DEBUG("new_client {}", new_client);
+    struct connection_pair cp = {
+        .server_fd = server_fd, .new_server = new_server, .new_client = new_client, .is_sleep = false};
+    cp.flow = forwarder->add(new_server, new_client);
+    // client send this for the server so reverse order
+    auto key = fmt::format("{}:{}", session.client_ip, session.client_port);
+    session.tcp_keys.emplace_back(key, session.client_port);
+    std::lock_guard lock(tcp_mtx);
+    tcp_pair[key] = cp;
+}
+/** The instance is gone for good, once the connection that spoke for it last closed while it was running. */
+void end_session(uint64_t id, uint64_t conn) {
+    std::shared_ptr<gateway_session> session;
+    {
+        std::lock_guard lock(session_mtx);
+        auto it = sessions.find(id);
+        if (it == sessions.end())
+            return;
+        session = it->second;
+    }
+    std::lock_guard lock(session->mtx);
+    // migrating or hibernated, its restore speaks up on a connection of its own, or already did
+    if (session->suspended || session->conn != conn)
+        return;
+    drop_pairs(*session);
+    {
+        std::lock_guard tcp_lock(tcp_mtx);
+        for (auto &[key, port] : session->tcp_keys) {
+            if (auto it = tcp_pair.find(key); it != tcp_pair.end()) {
+                close(it->second.server_fd);
+                tcp_pair.erase(it);
+            }
+        }
+    }
+    // a watcher left from a hibernation that was resumed finds its generation gone and returns
+    session->generation++;
+    if (session->held_fd != -1) {
+        uint64_t one = 1;
+        if (write(session->held_fd, &one, sizeof(one)) == -1)
+            SPDLOG_DEBUG("waking the watcher of {:x} failed {}", id, errno);
+    }
+    session->ended = true;
+    {
+        std::lock_guard sessions_lock(session_mtx);
+        sessions.erase(id);
+    }
+    set_capture_filter(capture_filter());
+    SPDLOG_INFO("{:x} ended", id);
+}
+/** One control connection, a runtime keeps it open for its whole life while older ones send a single request. */
+void serve_control(int client_fd) {
+    static std::atomic<uint64_t> next_conn{1};
+    auto conn = next_conn++;
+    std::set<uint64_t> served;
+    GatewayRequest req;
+    bool legacy = false;
+    while (!legacy && gateway_read_request(client_fd, req, legacy)) {
+        if (!legacy && !gateway_ack(client_fd, req))
+            SPDLOG_DEBUG("ack of seq {} to {:x} failed {}", req.seq, req.session, errno);
+        if (req.addr.empty() && req.op != MVVM_SOCK_SUSPEND && req.op != MVVM_SOCK_SUSPEND_TCP_SERVER &&
+            req.op != MVVM_SOCK_HIBERNATE) {
+            SPDLOG_ERROR("op {} without an address", (int)req.op);
+            continue;
+        }
+        std::shared_ptr<gateway_session> session;
+        std::unique_lock<std::mutex> lock;
+        do {
+            {
+                std::lock_guard sessions_lock(session_mtx);
+                auto &slot = sessions[req.session];
+                if (!slot)
+                    slot = std::make_shared<gateway_session>();
+                session = slot;
+            }
+            lock = std::unique_lock(session->mtx);
+        } while (session->ended);
+        // the requests of older runtimes are all filed under 0, which never ends
+        if (req.session) {
+            session->conn = conn;
+            served.insert(req.session);
+            if (std::exchange(session->last_seq, req.seq) == req.seq) {
+                SPDLOG_DEBUG("{:x} sent seq {} again, handled already", req.session, req.seq);
+                continue;
+            }
+        }
+        switch (req.op) {
+        case MVVM_SOCK_SUSPEND:
+        case MVVM_SOCK_SUSPEND_TCP_SERVER:
+            handle_suspend(*session, req);
+            break;
+        case MVVM_SOCK_HIBERNATE:
+            handle_hibernate(*session, req);
+            break;
+        case MVVM_SOCK_RESUME:
+        case MVVM_SOCK_RESUME_TCP_SERVER:
+            handle_resume(*session, req);
+            break;
+        case MVVM_SOCK_INIT:
+            handle_init(*session, req);
+            break;
+        default:
+            SPDLOG_ERROR("unknown op {}", (int)req.op);
+        }
+    }
+    for (auto id : served)
+        end_session(id, conn);
+    close(client_fd);
+}
 int main() {
     spdlog::cfg::load_env_levels();
+    trace_packets = spdlog::get_level() <= spdlog::level::trace;
     struct sockaddr_in address {};
     int opt = 1;
-    ssize_t rc;
-    int addrlen = sizeof(address);
-    char buffer[1024], buffer1[1024] = {0};
     char errbuf[PCAP_ERRBUF_SIZE];
-    struct bpf_program fp {};
-    // char filter_exp[] = ""; // The filter expression
-    char filter_exp[] = "net 172.17.0.0/24";
-    bpf_u_int32 netmask;
 
-    op_data = (struct mvvm_op_data *)malloc(sizeof(struct mvvm_op_data));
+    forwarder = new Forwarder();
+    raw_sender = new RawSender();
 
     signal(SIGTERM, sigterm_handler);
     signal(SIGQUIT, sigterm_handler);
     signal(SIGINT, sigterm_handler);
+    // restores of hibernated instances are not waited for
+    signal(SIGCHLD, SIG_IGN);
 
     fd = socket(AF_INET, SOCK_STREAM, 0); // Create a socket
 
@@ -364,313 +939,47 @@ int main() {
     }
 
     // Start listening for connections
-    if (listen(fd, 3) < 0) {
+    if (listen(fd, SOMAXCONN) < 0) {
         SPDLOG_ERROR("listen");
         exit(EXIT_FAILURE);
     }
 
-    handle = pcap_open_live(MVVM_SOCK_INTERFACE, BUFSIZ, 1, 1000, errbuf);
+    // immediate mode hands packets over as they arrive, a busy bridge still drains in batches through pcap_dispatch
+    handle = pcap_create(MVVM_SOCK_INTERFACE, errbuf);
     if (handle == nullptr) {
-        SPDLOG_ERROR("pcap_open_live(): {}", errbuf);
+        SPDLOG_ERROR("pcap_create(): {}", errbuf);
         exit(EXIT_FAILURE);
     }
-
-    // Compile and apply the filter
-    if (pcap_compile(handle, &fp, filter_exp, 1, PCAP_NETMASK_UNKNOWN) == -1) {
-        SPDLOG_ERROR("Couldn't parse filter {}: {}", filter_exp, pcap_geterr(handle));
-        exit(-1);
+    pcap_set_snaplen(handle, MVVM_GATEWAY_SNAPLEN);
+    pcap_set_promisc(handle, 1);
+    pcap_set_timeout(handle, MVVM_GATEWAY_CAPTURE_TIMEOUT_MS);
+    pcap_set_immediate_mode(handle, 1);
+    pcap_set_buffer_size(handle, MVVM_GATEWAY_CAPTURE_BUFFER);
+    if (pcap_activate(handle) < 0) {
+        SPDLOG_ERROR("pcap_activate(): {}", pcap_geterr(handle));
+        exit(EXIT_FAILURE);
     }
-
-    if (pcap_setfilter(handle, &fp) == -1) {
-        SPDLOG_ERROR("Couldn't install filter {}:", filter_exp, pcap_geterr(handle));
+    if (!apply_capture_filter(handle, capture_filter()))
         exit(-1);
+    // the capture still sees every packet, it is what holds them during a migration
+    bpf_rewriter = new BpfRewriter();
+    if (!bpf_rewriter->attach(MVVM_SOCK_INTERFACE)) {
+        delete bpf_rewriter;
+        bpf_rewriter = nullptr;
     }
 
     // Capture packets
     backend_thread.emplace_back(pcap_loop_wrapper, handle, packet_handler);
 
-    while (true) { // Open the device for sniffing
-        client_fd = accept(fd, (struct sockaddr *)&address, (socklen_t *)&addrlen);
+    while (true) {
+        int client_fd = accept(fd, nullptr, nullptr);
         if (client_fd < 0) {
+            if (errno == EINTR)
+                continue;
             SPDLOG_ERROR("accept");
             exit(EXIT_FAILURE);
         }
-        // offload info from client
-        if ((rc = recv(client_fd, buffer, sizeof(buffer), 0)) > 0) {
-            memcpy(op_data, buffer, sizeof(*op_data));
-            switch (op_data->op) {
-            case MVVM_SOCK_SUSPEND:
-            case MVVM_SOCK_SUSPEND_TCP_SERVER: {
-                // suspend
-                SPDLOG_ERROR("suspend");
-
-                for (int idx = 0; idx < op_data->size; idx++) {
-                    if (op_data->addr[idx][0].is_4) {
-                        server_ip =
-                            fmt::format("{}.{}.{}.{}", op_data->addr[idx][0].ip4[0], op_data->addr[idx][0].ip4[1],
-                                        op_data->addr[idx][0].ip4[2], op_data->addr[idx][0].ip4[3]);
-                        client_ip =
-                            fmt::format("{}.{}.{}.{}", op_data->addr[idx][1].ip4[0], op_data->addr[idx][1].ip4[1],
-                                        op_data->addr[idx][1].ip4[2], op_data->addr[idx][1].ip4[3]);
-                    } else {
-                        server_ip = fmt::format("{:04x}:{:04x}:{:04x}:{:04x}:{:04x}:{:04x}:{:04x}:{:04x}",
-                                                op_data->addr[idx][0].ip6[0], op_data->addr[idx][0].ip6[1],
-                                                op_data->addr[idx][0].ip6[2], op_data->addr[idx][0].ip6[3],
-                                                op_data->addr[idx][0].ip6[4], op_data->addr[idx][0].ip6[5],
-                                                op_data->addr[idx][0].ip6[6], op_data->addr[idx][0].ip6[7]);
-                        client_ip = fmt::format("{:04x}:{:04x}:{:04x}:{:04x}:{:04x}:{:04x}:{:04x}:{:04x}",
-                                                op_data->addr[idx][1].ip6[0], op_data->addr[idx][1].ip6[1],
-                                                op_data->addr[idx][1].ip6[2], op_data->addr[idx][1].ip6[3],
-                                                op_data->addr[idx][1].ip6[4], op_data->addr[idx][1].ip6[5],
-                                                op_data->addr[idx][1].ip6[6], op_data->addr[idx][1].ip6[7]);
-                    }
-                    server_port = op_data->addr[0][0].port;
-                    client_port = op_data->addr[0][1].port;
-                    SPDLOG_INFO("server_ip: {}:{} client_ip: {}:{}", server_ip, server_port, client_ip, client_port);
-
-                    forward_pair.emplace_back(server_ip, client_ip, "");
-                    // send the fin to server
-
-                    if (!op_data->is_tcp) {
-                        op_data->op = MVVM_SOCK_FIN;
-                        SPDLOG_INFO("send fin");
-                        send_fin(client_ip, client_port, server_ip, server_port, (char *)op_data);
-                    } else {
-                        auto to_stop = tcp_pair[fmt::format("{}:{}", server_ip, server_port)];
-
-                        SPDLOG_ERROR("is_tcp_server", fmt::format("{}:{}", server_ip, server_port))
-                        , to_stop.new_server, to_stop.new_client;
-                        SPDLOG_INFO("send fin");
-                        sleep(2);
-                        delete to_stop.send;
-                        delete to_stop.recv;
-                        if (op_data->op == MVVM_SOCK_SUSPEND_TCP_SERVER) {
-                            op_data->op = MVVM_SOCK_FIN;
-
-                            send(to_stop.new_client, (char *)op_data, sizeof(*op_data), 0);
-                        } else {
-                            op_data->op = MVVM_SOCK_FIN;
-
-                            send(to_stop.new_server, (char *)op_data, sizeof(*op_data), 0);
-                        }
-                        to_stop.is_sleep = true;
-                    }
-                }
-                break;
-            }
-            case MVVM_SOCK_RESUME:
-            case MVVM_SOCK_RESUME_TCP_SERVER: {
-                // resume
-                SPDLOG_ERROR("resume");
-
-                auto tmp_tuple = forward_pair[forward_pair.size() - 1];
-                auto &&tmp_ip4 = op_data->addr[0][0].ip4;
-                std::get<2>(tmp_tuple) = fmt::format("{}.{}.{}.{}", tmp_ip4[0], tmp_ip4[1], tmp_ip4[2], tmp_ip4[3]);
-                SPDLOG_ERROR("forward_pair[forward_pair.size()]", std::get<0>(forward_pair[forward_pair.size() - 1]))
-                , std::get<1>(forward_pair[forward_pair.size() - 1]);
-
-                if (op_data->is_tcp) {
-                    // client
-                    auto to_start = tcp_pair[fmt::format("{}:{}", server_ip, server_port)];
-                    SPDLOG_ERROR("{}.{}.{}.{} server_ip {}:{}", tmp_ip4[0], tmp_ip4[1], tmp_ip4[2], tmp_ip4[3],
-                                 server_ip, server_port);
-
-                    if (to_start.new_server == 0) {
-                        SPDLOG_ERROR("to_start is empty");
-                        exit(-1);
-                    } else {
-                        to_start.is_sleep = false;
-                    }
-                    int new_server;
-                    int new_client;
-                    if (op_data->op != MVVM_SOCK_RESUME_TCP_SERVER) {
-                        socklen_t size = sizeof(address);
-                        new_server = accept(to_start.server_fd, (struct sockaddr *)&address, &size);
-                        new_client = to_start.new_client;
-                    } else {
-                        new_server = to_start.new_server;
-                        new_client = socket(AF_INET, SOCK_STREAM, 0);
-                        to_start.new_client = new_client;
-                        address.sin_family = AF_INET;
-                        address.sin_port = htons(server_port);
-                        if (inet_pton(AF_INET, std::get<2>(tmp_tuple).c_str(), &address.sin_addr) <= 0) {
-                            SPDLOG_ERROR("Invalid address/ Address not supported");
-                            exit(EXIT_FAILURE);
-                        }
-                        sleep(5);
-                        if (connect(new_client, (struct sockaddr *)&address, sizeof(address)) == -1) {
-                            SPDLOG_ERROR("connect failed ", errno);
-                            close(new_client);
-                            exit(EXIT_FAILURE);
-                        }
-                    }
-
-                    to_start.send = new std::jthread([&](std::stop_token stopToken) {
-                        fcntl(new_server, F_SETFL, O_NONBLOCK);
-
-                        while (!stopToken.stop_requested()) {
-                            rc = recv(new_server, buffer1, sizeof(buffer1), 0);
-                            if (rc > 0) {
-                                SPDLOG_ERROR("send", sizeof(buffer));
-                                while ((rc = send(new_client, buffer, sizeof(buffer), 0) <= 0)) {
-                                    SPDLOG_ERROR("error sending", rc, errno);
-                                    sleep(1);
-                                }
-                            } else if (rc == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                                // Handle error
-                                break;
-                            }
-                            // Add a small sleep to prevent busy-waiting
-                            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                        };
-                    });
-                    to_start.recv = new std::jthread([&](std::stop_token stopToken) {
-                        // Set the socket to non-blocking
-                        fcntl(new_client, F_SETFL, O_NONBLOCK);
-
-                        while (!stopToken.stop_requested()) {
-                            rc = recv(new_client, buffer, sizeof(buffer), 0);
-                            if (rc > 0) {
-                                SPDLOG_ERROR("recv", sizeof(buffer));
-                                while ((rc = send(new_server, buffer, sizeof(buffer), 0) <= 0)) {
-                                    SPDLOG_ERROR("error sending", rc, errno);
-                                    sleep(1);
-                                }
-                            } else if (rc == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                                // Handle error
-                                break;
-                            }
-                            // Add a small sleep to prevent busy-waiting
-                            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                        }
-                    });
-                    to_start.new_server = new_server;
-                    to_start.is_sleep = false;
-                    tcp_pair[fmt::format("{}:{}", std::get<2>(tmp_tuple), server_port)] = to_start;
-                } else
-                    is_forward = true;
-                break;
-            }
-            case MVVM_SOCK_INIT: {
-                // init
-                SPDLOG_ERROR("init");
-                if (op_data->addr[0][0].is_4) {
-                    server_ip = fmt::format("{}.{}.{}.{}", op_data->addr[0][0].ip4[0], op_data->addr[0][0].ip4[1],
-                                            op_data->addr[0][0].ip4[2], op_data->addr[0][0].ip4[3]);
-                    client_ip = fmt::format("{}.{}.{}.{}", op_data->addr[0][1].ip4[0], op_data->addr[0][1].ip4[1],
-                                            op_data->addr[0][1].ip4[2], op_data->addr[0][1].ip4[3]);
-                } else {
-                    server_ip =
-                        fmt::format("{:04x}:{:04x}:{:04x}:{:04x}:{:04x}:{:04x}:{:04x}:{:04x}",
-                                    op_data->addr[0][0].ip6[0], op_data->addr[0][0].ip6[1], op_data->addr[0][0].ip6[2],
-                                    op_data->addr[0][0].ip6[3], op_data->addr[0][0].ip6[4], op_data->addr[0][0].ip6[5],
-                                    op_data->addr[0][0].ip6[6], op_data->addr[0][0].ip6[7]);
-                    client_ip =
-                        fmt::format("{:04x}:{:04x}:{:04x}:{:04x}:{:04x}:{:04x}:{:04x}:{:04x}",
-                                    op_data->addr[0][1].ip6[0], op_data->addr[0][1].ip6[1], op_data->addr[0][1].ip6[2],
-                                    op_data->addr[0][1].ip6[3], op_data->addr[0][1].ip6[4], op_data->addr[0][1].ip6[5],
-                                    op_data->addr[0][1].ip6[6], op_data->addr[0][1].ip6[7]);
-                }
-                server_port = op_data->addr[0][0].port;
-                client_port = op_data->addr[0][1].port;
-
-                SPDLOG_INFO("server_ip:{}:{} client_ip:{}:{}", server_ip, server_port, client_ip, client_port);
-
-                int server_fd = socket(AF_INET, SOCK_STREAM, 0); // Create a socket
-
-                // Forcefully attaching socket to the port
-                if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-                    SPDLOG_ERROR("setsockopt");
-                    exit(EXIT_FAILURE);
-                }
-
-                address.sin_family = AF_INET;
-                address.sin_port = htons(client_port);
-                // Convert IPv4 and IPv6 addresses from text to binary form
-                if (inet_pton(AF_INET, MVVM_SOCK_ADDR, &address.sin_addr) <= 0) {
-                    SPDLOG_ERROR("Invalid address/ Address not supported");
-                    exit(EXIT_FAILURE);
-                }
-
-                // Bind the socket to the network address and port
-                if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-                    SPDLOG_ERROR("bind failed", errno);
-                    exit(EXIT_FAILURE);
-                }
-
-                // Start listening for connections
-                if (listen(server_fd, 3) < 0) {
-                    SPDLOG_ERROR("listen");
-                    exit(EXIT_FAILURE);
-                }
-                // sleep(1);
-                int new_server =
-                    accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen); // will be instantly consumed
-                // Create a socket connect remote
-                int new_client = socket(AF_INET, SOCK_STREAM, 0);
-                // Convert IPv4 and IPv6 addresses from text to binary form
-
-                address.sin_family = AF_INET;
-                address.sin_port = htons(client_port);
-                if (inet_pton(AF_INET, client_ip.c_str(), &address.sin_addr) <= 0) {
-                    SPDLOG_ERROR("Invalid address/ Address not supported");
-                    exit(EXIT_FAILURE);
-                }
-
-                if (connect(new_client, (struct sockaddr *)&address, sizeof(address)) == -1) {
-                    SPDLOG_ERROR("connect failed ", errno);
-                    close(new_client);
-                    exit(EXIT_FAILURE);
-                }
-                SPDLOG_ERROR("new_client ", new_client);
-                struct connection_pair cp = {
-                    .server_fd = server_fd, .new_server = new_server, .new_client = new_client, .is_sleep = false};
-                cp.send = new std::jthread([&](std::stop_token stopToken) {
-                    // Set the socket to non-blocking
-                    fcntl(new_server, F_SETFL, O_NONBLOCK);
-
-                    while (!stopToken.stop_requested()) {
-                        rc = recv(new_server, buffer1, sizeof(buffer1), 0);
-                        if (rc > 0) {
-                            SPDLOG_ERROR("send", sizeof(buffer));
-                            while ((rc = send(new_client, buffer, sizeof(buffer), 0) <= 0)) {
-                                SPDLOG_ERROR("error sending", rc, errno);
-                                sleep(1);
-                            }
-                        } else if (rc == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                            // Handle error
-                            break;
-                        }
-                        // Add a small sleep to prevent busy-waiting
-                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                    }
-                });
-                cp.recv = new std::jthread([&](std::stop_token stopToken) {
-                    // Set the socket to non-blocking
-                    fcntl(new_client, F_SETFL, O_NONBLOCK);
-
-                    while (!stopToken.stop_requested()) {
-                        rc = recv(new_client, buffer, sizeof(buffer), 0);
-                        if (rc > 0) {
-                            SPDLOG_ERROR("recv", sizeof(buffer));
-                            while ((rc = send(new_server, buffer, sizeof(buffer), 0) <= 0)) {
-                                SPDLOG_ERROR("error sending", rc, errno);
-                                sleep(1);
-                            }
-                        } else if (rc == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                            // Handle error
-                            break;
-                        }
-                        // Add a small sleep to prevent busy-waiting
-                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                    }
-                });
-                // client send this for the server so reverse order
-                SPDLOG_ERROR("{}:{}", client_ip, client_port);
-                tcp_pair[fmt::format("{}:{}", client_ip, client_port)] = cp;
-                break;
-            }
-            }
-        }
+        // a slow op, like waiting for a tcp peer, only holds up its own session
+        std::thread(serve_control, client_fd).detach();
     }
 }
@@ -0,0 +1,98 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "raw_sender.h"
+#include <cerrno>
+#include <cstring>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <spdlog/spdlog.h>
+#include <unistd.h>
+
+RawSender::~RawSender() {
+    flush();
+    for (auto &b : batch_)
+        if (b.fd != -1)
+            close(b.fd);
+}
+
+bool RawSender::open(Batch &b, int family) {
+    b.fd = socket(family, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+    if (b.fd == -1) {
+        SPDLOG_ERROR("raw socket for family {} failed {}", family, errno);
+        return false;
+    }
+    b.buf.resize((size_t)MVVM_GATEWAY_SEND_BATCH * MVVM_GATEWAY_MAX_PACKET);
+    b.iov.resize(MVVM_GATEWAY_SEND_BATCH);
+    b.dst.resize(MVVM_GATEWAY_SEND_BATCH);
+    b.msgs.resize(MVVM_GATEWAY_SEND_BATCH);
+    return true;
+}
+
+void RawSender::send(const uint8_t *packet, size_t len) {
+    if (len < sizeof(struct ip) || len > MVVM_GATEWAY_MAX_PACKET)
+        return;
+    bool v6 = packet[0] >> 4 == 6;
+    auto &b = batch_[v6];
+    if (b.fd == -1 && !open(b, v6 ? AF_INET6 : AF_INET))
+        return;
+
+    auto slot = b.count;
+    auto *data = b.buf.data() + slot * MVVM_GATEWAY_MAX_PACKET;
+    memcpy(data, packet, len);
+    auto &dst = b.dst[slot];
+    memset(&dst, 0, sizeof(dst));
+    socklen_t dst_len;
+    if (v6) {
+        if (len < sizeof(struct ip6_hdr))
+            return;
+        auto *sin6 = (struct sockaddr_in6 *)&dst;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr = ((const struct ip6_hdr *)packet)->ip6_dst;
+        dst_len = sizeof(*sin6);
+    } else {
+        auto *sin = (struct sockaddr_in *)&dst;
+        sin->sin_family = AF_INET;
+        sin->sin_addr = ((const struct ip *)packet)->ip_dst;
+        dst_len = sizeof(*sin);
+    }
+    b.iov[slot] = {.iov_base = data, .iov_len = len};
+    b.msgs[slot] = {};
+    b.msgs[slot].msg_hdr.msg_name = &dst;
+    b.msgs[slot].msg_hdr.msg_namelen = dst_len;
+    b.msgs[slot].msg_hdr.msg_iov = &b.iov[slot];
+    b.msgs[slot].msg_hdr.msg_iovlen = 1;
+    if (++b.count == MVVM_GATEWAY_SEND_BATCH)
+        flush(b);
+}
+
+void RawSender::flush() {
+    for (auto &b : batch_)
+        flush(b);
+}
+
+void RawSender::flush(Batch &b) {
+    size_t sent = 0;
+    while (sent < b.count) {
+        int n = sendmmsg(b.fd, b.msgs.data() + sent, b.count - sent, 0);
+        if (n > 0) {
+            sent += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else {
+            // the first packet in what is left was refused, drop it and carry on with the rest
+            SPDLOG_ERROR("forward: sending failed {}", errno);
+            sent++;
+        }
+    }
+    b.count = 0;
+}
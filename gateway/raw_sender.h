@@ -0,0 +1,60 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#ifndef MVVM_GATEWAY_RAW_SENDER_H
+#define MVVM_GATEWAY_RAW_SENDER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <vector>
+
+/* packets queued per family before a sendmmsg */
+#define MVVM_GATEWAY_SEND_BATCH 64
+#define MVVM_GATEWAY_MAX_PACKET 65535
+
+/**
+ * Sends complete ip packets through one IPPROTO_RAW socket per address family, opened on first use and kept for the
+ * life of the gateway. Packets are copied into a batch and go out with a single sendmmsg when it fills up or on
+ * flush(). Not thread safe, it belongs to the capture thread.
+ */
+class RawSender {
+public:
+    RawSender() = default;
+    ~RawSender();
+    RawSender(const RawSender &) = delete;
+    RawSender &operator=(const RawSender &) = delete;
+
+    /** Queue an ip packet, the destination is taken from its header. */
+    void send(const uint8_t *packet, size_t len);
+    /** Send everything queued. */
+    void flush();
+
+private:
+    struct Batch {
+        int fd = -1;
+        size_t count{};
+        std::vector<uint8_t> buf;
+        std::vector<struct iovec> iov;
+        std::vector<struct sockaddr_storage> dst;
+        std::vector<struct mmsghdr> msgs;
+    };
+
+    bool open(Batch &b, int family);
+    void flush(Batch &b);
+
+    // [0] is AF_INET, [1] AF_INET6
+    Batch batch_[2];
+};
+
+#endif // MVVM_GATEWAY_RAW_SENDER_H
@@ -0,0 +1,70 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "rewrite_map.h"
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/pkt_cls.h>
+#include <linux/udp.h>
+#include <stddef.h>
+#include <bpf/bpf_endian.h>
+#include <bpf/bpf_helpers.h>
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, MVVM_GATEWAY_REWRITE_ENTRIES);
+    __type(key, struct mvvm_rewrite_key);
+    __type(value, struct mvvm_rewrite_value);
+} mvvm_rewrite_map SEC(".maps");
+
+/* the kernel side of forward() in main.cpp: udp of a resumed pair gets its address and checksums patched in place */
+SEC("tc")
+int mvvm_rewrite(struct __sk_buff *skb) {
+    void *data = (void *)(long)skb->data;
+    void *data_end = (void *)(long)skb->data_end;
+    struct ethhdr *eth = data;
+    if ((void *)(eth + 1) > data_end || eth->h_proto != bpf_htons(ETH_P_IP))
+        return TC_ACT_OK;
+    struct iphdr *ip = (void *)(eth + 1);
+    if ((void *)(ip + 1) > data_end || ip->protocol != IPPROTO_UDP || ip->ihl < 5)
+        return TC_ACT_OK;
+
+    struct mvvm_rewrite_key key = {.saddr = ip->saddr, .daddr = ip->daddr};
+    struct mvvm_rewrite_value *v = bpf_map_lookup_elem(&mvvm_rewrite_map, &key);
+    if (!v)
+        return TC_ACT_OK;
+
+    __u32 ip_off = sizeof(*eth);
+    __u32 udp_off = ip_off + ip->ihl * 4;
+    __u32 old = v->rewrite_dst ? ip->daddr : ip->saddr;
+    __u32 now = v->addr;
+    __u32 addr_off = ip_off + (v->rewrite_dst ? offsetof(struct iphdr, daddr) : offsetof(struct iphdr, saddr));
+    // only the first fragment carries the udp header
+    if (!(ip->frag_off & bpf_htons(0x1fff))) {
+        struct udphdr *udp = data + udp_off;
+        if ((void *)(udp + 1) > data_end)
+            return TC_ACT_OK;
+        // 0 means the sender didn't compute one, the helper leaves it so and never produces it
+        if (udp->check)
+            bpf_l4_csum_replace(skb, udp_off + offsetof(struct udphdr, check), old, now,
+                                BPF_F_PSEUDO_HDR | BPF_F_MARK_MANGLED_0 | sizeof(now));
+    }
+    bpf_l3_csum_replace(skb, ip_off + offsetof(struct iphdr, check), old, now, sizeof(now));
+    bpf_skb_store_bytes(skb, addr_off, &now, sizeof(now), 0);
+    if (v->ifindex)
+        return bpf_redirect_neigh(v->ifindex, NULL, 0, 0);
+    return TC_ACT_OK;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,34 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#ifndef MVVM_GATEWAY_REWRITE_MAP_H
+#define MVVM_GATEWAY_REWRITE_MAP_H
+
+#include <linux/types.h>
+
+/* shared by rewrite.bpf.c and the gateway, addresses in network order */
+#define MVVM_GATEWAY_REWRITE_ENTRIES 4096
+
+struct mvvm_rewrite_key {
+    __u32 saddr;
+    __u32 daddr;
+};
+struct mvvm_rewrite_value {
+    // what replaces the source, or with rewrite_dst the destination
+    __u32 addr;
+    __u8 rewrite_dst;
+    __u8 reserved[3];
+    // where the rewritten packet is sent out, resolving the next hop like a routed packet
+    __u32 ifindex;
+};
+
+#endif // MVVM_GATEWAY_REWRITE_MAP_H
@@ -0,0 +1,84 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "spill_buffer.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <spdlog/spdlog.h>
+#include <unistd.h>
+#include <utility>
+
+SpillBuffer::SpillBuffer(size_t budget, size_t limit) : budget_(budget), limit_(limit) {}
+
+SpillBuffer::SpillBuffer(SpillBuffer &&other) noexcept
+    : budget_(other.budget_), limit_(other.limit_), mem_(std::move(other.mem_)),
+      mem_head_(std::exchange(other.mem_head_, 0)), file_(std::exchange(other.file_, nullptr)),
+      file_head_(std::exchange(other.file_head_, 0)), file_size_(std::exchange(other.file_size_, 0)) {}
+
+SpillBuffer::~SpillBuffer() {
+    if (file_)
+        fclose(file_);
+}
+
+bool SpillBuffer::push(const void *data, size_t len) {
+    // memory only while nothing is on disk, or the order would break
+    if (file_size_ == file_head_ && mem_.size() - mem_head_ + len <= budget_) {
+        if (mem_head_ > budget_ / 2) {
+            mem_.erase(mem_.begin(), mem_.begin() + (ptrdiff_t)mem_head_);
+            mem_head_ = 0;
+        }
+        mem_.insert(mem_.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+        return true;
+    }
+    if (file_size_ - file_head_ + len > limit_)
+        return false;
+    if (!file_ && !(file_ = tmpfile())) {
+        SPDLOG_ERROR("spill file failed {}", errno);
+        return false;
+    }
+    if (pwrite(fileno(file_), data, len, (off_t)file_size_) != (ssize_t)len) {
+        SPDLOG_ERROR("spill write failed {}", errno);
+        return false;
+    }
+    file_size_ += len;
+    return true;
+}
+
+size_t SpillBuffer::peek(void *out, size_t len) {
+    auto in_mem = std::min(len, mem_.size() - mem_head_);
+    memcpy(out, mem_.data() + mem_head_, in_mem);
+    auto in_file = std::min(len - in_mem, file_size_ - file_head_);
+    if (in_file) {
+        auto n = pread(fileno(file_), (uint8_t *)out + in_mem, in_file, (off_t)file_head_);
+        in_file = n > 0 ? n : 0;
+    }
+    return in_mem + in_file;
+}
+
+void SpillBuffer::consume(size_t len) {
+    auto in_mem = std::min(len, mem_.size() - mem_head_);
+    mem_head_ += in_mem;
+    if (mem_head_ == mem_.size()) {
+        mem_.clear();
+        mem_head_ = 0;
+    }
+    file_head_ += std::min(len - in_mem, file_size_ - file_head_);
+    if (file_ && file_head_ && file_head_ == file_size_) {
+        // drained, give the disk space back, or keep appending past what is there if that fails
+        if (ftruncate(fileno(file_), 0) == -1) {
+            SPDLOG_DEBUG("spill truncate failed {}", errno);
+            return;
+        }
+        file_head_ = file_size_ = 0;
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#ifndef MVVM_GATEWAY_SPILL_BUFFER_H
+#define MVVM_GATEWAY_SPILL_BUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+/* what a suspended flow may hold in memory, and on disk after that */
+#define MVVM_GATEWAY_BUFFER_BUDGET (4 << 20)
+#define MVVM_GATEWAY_SPILL_LIMIT (256 << 20)
+
+/**
+ * Bytes a flow receives while its instance is suspended, first in, first out. They stay in memory up to the budget,
+ * the rest goes to an unlinked temporary file, and once that reaches its limit push() refuses more.
+ */
+class SpillBuffer {
+public:
+    explicit SpillBuffer(size_t budget = MVVM_GATEWAY_BUFFER_BUDGET, size_t limit = MVVM_GATEWAY_SPILL_LIMIT);
+    SpillBuffer(SpillBuffer &&other) noexcept;
+    SpillBuffer(const SpillBuffer &) = delete;
+    SpillBuffer &operator=(const SpillBuffer &) = delete;
+    ~SpillBuffer();
+
+    /** Append all of data or nothing, false once full. */
+    bool push(const void *data, size_t len);
+    /** Copy up to len of the oldest bytes to out without consuming them, returns how many. */
+    size_t peek(void *out, size_t len);
+    void consume(size_t len);
+    [[nodiscard]] size_t size() const { return mem_.size() - mem_head_ + file_size_ - file_head_; }
+    [[nodiscard]] bool empty() const { return size() == 0; }
+    /** How much the next push() is sure to take. */
+    [[nodiscard]] size_t room() const { return limit_ - (file_size_ - file_head_); }
+    [[nodiscard]] bool full() const { return room() == 0; }
+
+private:
+    size_t budget_, limit_;
+    std::vector<uint8_t> mem_;
+    size_t mem_head_{};
+    // everything in the file is newer than everything in memory
+    FILE *file_{};
+    size_t file_head_{}, file_size_{};
+};
+
+#endif // MVVM_GATEWAY_SPILL_BUFFER_H
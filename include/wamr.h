@@ -19,10 +19,16 @@
 #include "bh_read_file.h"
 #include "wamr_exec_env.h"
 #include "wamr_export.h"
+#include "wamr_fd_table.h"
+#include "wamr_gateway.h"
+#include "wamr_hibernate.h"
 #include "wamr_read_write.h"
+#include "wamr_recv_journal.h"
+#include "wamr_thread_state.h"
 #include "wamr_wasi_context.h"
 #include "wasm_runtime.h"
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <cstdlib>
@@ -31,21 +37,25 @@
 #include <functional>
 #include <iostream>
 #include <iterator>
+#include <latch>
 #include <list>
 #include <mutex>
 #include <numeric>
 #include <ranges>
 #include <semaphore>
+#include <shared_mutex>
 #include <spdlog/cfg/env.h>
 #include <spdlog/spdlog.h>
 #include <sstream>
 #include <string>
 #include <tuple>
+#include <unordered_map>
 #if !defined(_WIN32)
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <semaphore.h>
 #else
 #include <winsock2.h>
 #endif
@@ -71,23 +81,10 @@ inline constexpr Enumerate enumerate;
 #define MVVM_SOCK_MASK 24
 #define MVVM_SOCK_MASK6 48
 #define MVVM_SOCK_PORT 1235
-#define MVVM_MAX_ADDR 5
 #define MVVM_SOCK_INTERFACE "docker0"
+#define MVVM_RESTORE_HEAP_SIZE (1 << 20)
+#define MVVM_HEAP_SIZE 3355443200u
 
-enum opcode {
-    MVVM_SOCK_SUSPEND = 0,
-    MVVM_SOCK_SUSPEND_TCP_SERVER = 1,
-    MVVM_SOCK_RESUME = 2,
-    MVVM_SOCK_RESUME_TCP_SERVER = 3,
-    MVVM_SOCK_INIT = 4,
-    MVVM_SOCK_FIN = 5
-};
-struct mvvm_op_data {
-    enum opcode op;
-    bool is_tcp;
-    int size;
-    SocketAddrPool addr[MVVM_MAX_ADDR][2];
-};
 std::string removeExtension(std::string &);
 bool is_ip_in_cidr(const char *base_ip, int subnet_mask_len, uint32_t ip);
 bool is_ipv6_in_cidr(const char *base_ip_str, int subnet_mask_len, struct in6_addr *ip);
@@ -100,6 +97,9 @@ public:
     WASMModuleInstanceCommon *module_inst{};
     WASMModuleCommon *module;
     WASMFunctionInstanceCommon *func{};
+    // find_func by name, for the module instance it was built on
+    std::unordered_map<std::string, WASMFunctionInstanceCommon *> func_index_{};
+    WASMModuleInstanceCommon *func_index_inst_{};
 
     std::string aot_file_path{};
     std::string wasm_file_path{};
@@ -115,41 +115,106 @@ public:
     std::vector<const char *> addr_{};
     std::vector<const char *> ns_pool_{};
     std::vector<WAMRExecEnv *> execEnv{};
-    std::map<int, std::tuple<std::string, std::vector<std::tuple<int, int, fd_op>>>> fd_map_{};
+    // the snapshot's fd_map is only built from this at checkpoint
+    WAMRFdTable fd_table_{};
     // add offset to pair->tuple, 3rd param 'int'
     std::map<int, int> new_sock_map_{};
     std::map<int, SocketMetaData, std::greater<>> socket_fd_map_{};
+    // packets drained at the checkpoint boundary, per socket
+    std::map<int, WAMRRecvJournal> recv_journal_{};
+    bool journal_spill = true;
     SocketAddrPool local_addr{};
-    // lwcp is LightWeight CheckPoint
-    std::map<uint64, int> lwcp_list;
-    size_t ready = 0;
+    // lwcp is LightWeight CheckPoint, counted per thread, as_mtx is only taken once a checkpoint is pending
+    WAMRThreadRegistry threads{};
+    std::atomic<bool> lwcp_pending{};
     std::mutex as_mtx{};
     std::vector<struct sync_op_t> sync_ops;
     bool should_snapshot{};
     std::string policy{};
     WASMMemoryInstance **tmp_buf = nullptr;
     uint32 tmp_buf_size{};
-    std::vector<struct sync_op_t>::iterator sync_iter;
-    std::map<uint64, uint64> tid_map;
-    std::map<korp_tid, korp_tid> korp_tid_map;
+    // restore side replay of sync_ops, a queue per thread and a direct handoff to the owner of the next op
+    std::unordered_map<uint64, std::vector<size_t>> sync_queue;
+    // counting, a turn may be handed to a thread that has yet to start waiting for it
+    std::unordered_map<uint64, std::unique_ptr<std::counting_semaphore<>>> sync_turn;
+    // ops that wait for another thread, a cond wait or a lock somebody earlier in the list holds
+    std::vector<bool> sync_blocking;
+    std::atomic<size_t> sync_next{};
+    std::atomic<bool> sync_ready{}, sync_done{};
+    // old tid -> new tid and back, written while children spawn concurrently
+    std::shared_mutex tid_mtx{};
+    std::unordered_map<uint64, uint64> tid_map;
+    std::unordered_map<uint64, uint64> rev_tid_map;
+    // restore side thread tree, children grouped by their parent's tid at checkpoint (0 for main)
+    std::unordered_map<uint64, std::vector<WAMRExecEnv *>> restore_children;
+    std::unordered_map<WASMExecEnv *, WAMRExecEnv *> restored_envs;
+    std::unique_ptr<std::latch> restore_latch;
+    std::atomic<bool> restore_go{};
     std::map<uint64, uint64> child_tid_map;
     std::map<uint64, std::pair<int, int>> tid_start_arg_map;
     uint32 id{};
     size_t cur_thread;
     std::chrono::time_point<std::chrono::high_resolution_clock> time;
-    std::vector<long long> latencies;
+    uint64 recv_count{};
+    long long recv_latency_sum{};
     bool is_jit{};
     bool is_aot{};
     char error_buf[128]{};
     struct mvvm_op_data op_data {};
-    uint32 buf_size{}, stack_size = 65536, heap_size = 3355443200;
+    // persistent control connection to the gateway
+    GatewayClient gateway{};
+    uint32 buf_size{}, stack_size = 65536, heap_size = MVVM_HEAP_SIZE;
+    // prepare frame, sent by the source and a memory mapping faulted in ahead of time on the destination
+    bool send_prepare{};
+    uint8 *prepared_memory{};
+    // the frame goes out once, from the preparer thread the SIGINT handler posts or from serialize_to_file
+    std::mutex prepare_mtx{};
+    bool prepare_sent{};
+#if !defined(_WIN32)
+    sem_t prepare_sem{};
+#endif
+    // linear memory goes after the struct_pack'd envs as raw bytes, in this order
+    std::vector<std::pair<const uint8 *, size_t>> snapshot_trailer{};
+    // restore side, (memory_data, heap_data) read off the trailer before the module was instantiated
+    std::map<const WAMRMemoryInstance *, std::pair<uint8 *, uint8 *>> loaded_memory{};
+    // restore side, madvise advice for cold linear memory (0 keeps it all resident), and seconds to sample for
+    // after resume instead of trusting the snapshot's hot pages
+    int demote_advice{};
+    uint32 demote_after{};
+    // milliseconds the guest runs on after SIGINT while the pages it writes are recorded as the hot pages that go
+    // first in the trailer, 0 records none. hot_sampled is set once that window has started
+    uint32 hot_window{};
+    std::atomic<bool> hot_sampled{};
+#if !defined(_WIN32)
+    sem_t hot_sem{};
+#endif
+    // same host migration, linear memory lives in memory_fd from instantiation and the restore side adopts the
+    // source's host fds, keyed by guest fd
+    bool same_host{};
+    int memory_fd = -1;
+    std::map<int, int> adopted_fds_{};
+    // take established tcp connections along with TCP_REPAIR instead of through the gateway
+    bool tcp_repair{};
+    // checkpoints to the snapshot file and exits once the guest stays off the network for long enough
+    WAMRIdleWatchdog idle{};
     typedef struct ThreadArgs {
         wasm_exec_env_t exec_env;
     } ThreadArgs;
+    std::vector<ThreadArgs> thread_args;
 
-    explicit WAMRInstance(const char *wasm_path, bool is_jit, std::string policy = "compression");
+    explicit WAMRInstance(const char *wasm_path, bool is_jit, std::string policy = "compression",
+                          uint32 max_threads = 16);
 
     void instantiate();
+    /** instantiate() without the initializers restore overwrites anyway. */
+    void instantiate_for_restore();
+    void prepare_destination();
+    /** Start the thread that sends the prepare frame once prepare_sem is posted. */
+    void start_preparer();
+    /** Apply demote_advice to the memory outside hot_pages, now or after sampling demote_after seconds. */
+    void demote_cold_memory(uint8 *memory, size_t size, std::vector<uint32> hot_pages);
+    /** Start the thread that records hot_window ms of writes once hot_sem is posted, and then arms the checkpoint. */
+    void start_hot_sampler();
     void recover(std::vector<std::unique_ptr<WAMRExecEnv>> *);
     bool load_wasm_binary(const char *wasm_path, char **buffer_ptr);
     bool get_int3_addr();
@@ -175,9 +240,15 @@ public:
     void find_func(const char *name);
     int invoke_main();
     void invoke_init_c();
+    /** Reopen a checkpointed file on the host at its old fd, false to fall back to invoke_fopen/invoke_fseek. */
+    bool restore_fd(uint32 fd, const std::string &path, const WAMRFdTable::fd_ops &ops);
+    /** Install the host fd handed over for a guest fd, false if none was. */
+    bool adopt_fd(uint32 fd);
+    /** The memfd and the host fds behind the guest's files and sockets, as (guest fd or MVVM_FD_MEMORY, host fd). */
+    std::vector<std::pair<int32_t, int>> live_fds();
     int invoke_fopen(std::string &path, uint32 option);
     int invoke_frenumber(uint32 fd, uint32 to);
-    int invoke_fseek(uint32 fd, uint32 flags, uint32 offset);
+    int invoke_fseek(uint32 fd, uint32 flags, int64 offset);
     int invoke_preopen(uint32 fd, const std::string &path);
     int invoke_sock_open(uint32_t domain, uint32_t socktype, uint32_t protocol, uint32_t sockfd);
     int invoke_sock_client_connect(uint32_t sockfd, struct sockaddr *sock, socklen_t sock_size);
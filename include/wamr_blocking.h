@@ -0,0 +1,30 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#ifndef MVVM_WAMR_BLOCKING_H
+#define MVVM_WAMR_BLOCKING_H
+
+/* sent to a thread inside a blocking wasi call to get it out for a checkpoint */
+#define MVVM_WAKE_SIGNAL SIGUSR2
+/* how often the threads that have yet to park are signalled again */
+#define MVVM_WAKE_INTERVAL std::chrono::milliseconds(50)
+
+/**
+ * A guest blocked in poll_oneoff, sock_accept or sock_recv never reaches an int3, so these go through wrappers that
+ * are woken up by a checkpoint request and join the checkpoint from inside the call. Nothing has been consumed at that
+ * point and the restored frame rows back to the call, so it is simply issued again. Call before the module is loaded.
+ */
+void register_interruptible_wasi();
+/** Get every thread out of the wrapped calls, for a checkpoint that is now pending. Safe in a signal handler. */
+void wake_blocking_calls();
+
+#endif // MVVM_WAMR_BLOCKING_H
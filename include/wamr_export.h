@@ -82,7 +82,9 @@ extern uint32 wasm_runtime_atomic_notify(WASMModuleInstanceCommon *module, void
 void serialize_to_file(struct WASMExecEnv *);
 #endif
 
-void insert_fd(int, const char *, int, int, enum fd_op op);
+/* fopen passes the path and its oflags. fread/fwrite pass the bytes they moved the file position by, fseek its whence
+ * and offset as fd_seek got them, so every offset but a SEEK_SET/SEEK_END seek is relative to where the file was. */
+void insert_fd(int, const char *, int, int64, enum fd_op op);
 void remove_fd(int);
 void rename_fd(int, char const *, int, char const *);
 bool is_atomic_checkpointable();
@@ -93,6 +95,7 @@ void lightweight_checkpoint(WASMExecEnv *);
 void lightweight_uncheckpoint(WASMExecEnv *);
 void wamr_wait(wasm_exec_env_t);
 void sigint_handler(int sig);
+void arm_checkpoint();
 void register_sigtrap();
 void register_sigint();
 void sigtrap_handler(int sig);
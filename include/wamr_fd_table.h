@@ -0,0 +1,55 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#ifndef MVVM_WAMR_FD_TABLE_H
+#define MVVM_WAMR_FD_TABLE_H
+
+#include "wamr_export.h"
+#include <map>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+/** Fixed size record per guest fd, updated in place by the fd hooks. */
+struct WAMRFdState {
+    /* Index into the interned paths, -1 for a slot that is not open. */
+    int32 path_id = -1;
+    int32 flags{};
+    /* Where the file position is, offset bytes from SEEK_SET or SEEK_END, folded from the fread/fwrite/fseek
+     * hooks. SEEK_CUR and the byte counts of fread/fwrite move the offset from the last base. */
+    int32 whence{};
+    int64 offset{};
+    bool moved{};
+};
+
+/** Flat fd table indexed by the guest fd, the op list the snapshot wants is only built at checkpoint. */
+class WAMRFdTable {
+public:
+    using fd_ops = std::vector<std::tuple<int, int64, fd_op>>;
+
+    void insert(int fd, const char *path, int flags, int64 offset, fd_op op);
+    void rename(int old_fd, const char *old_path, int new_fd, const char *new_path);
+    bool remove(int fd);
+    [[nodiscard]] bool contains(int fd) const { return fd >= 0 && fd < (int)fds_.size() && fds_[fd].path_id >= 0; }
+    /** open + seek to the current position for every live fd, the same shape the compression policy logged. */
+    [[nodiscard]] std::map<int, std::tuple<std::string, fd_ops>> compact() const;
+
+private:
+    int32 intern(const std::string &path);
+
+    std::vector<WAMRFdState> fds_{};
+    std::vector<std::string> paths_{};
+    std::unordered_map<std::string, int32> path_ids_{};
+};
+
+#endif // MVVM_WAMR_FD_TABLE_H
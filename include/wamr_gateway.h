@@ -0,0 +1,114 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#ifndef MVVM_WAMR_GATEWAY_H
+#define MVVM_WAMR_GATEWAY_H
+
+#include "wamr_export.h"
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define MVVM_MAX_ADDR 5
+/* "MVGW", first on the wire so the gateway can tell a frame from a bare mvvm_op_data */
+#define MVVM_GATEWAY_MAGIC 0x5747564du
+#define MVVM_GATEWAY_VERSION 1
+/* bounds what a single frame may make the gateway allocate */
+#define MVVM_GATEWAY_MAX_PAIRS 65536
+/* "MVGA", what the gateway answers a frame with once it has read it */
+#define MVVM_GATEWAY_ACK_MAGIC 0x4147564du
+/* without an ack by then the gateway is taken for gone and the request goes out again on a new connection */
+#define MVVM_GATEWAY_ACK_TIMEOUT_MS 1000
+#define MVVM_GATEWAY_SEND_ATTEMPTS 3
+
+enum opcode {
+    MVVM_SOCK_SUSPEND = 0,
+    MVVM_SOCK_SUSPEND_TCP_SERVER = 1,
+    MVVM_SOCK_RESUME = 2,
+    MVVM_SOCK_RESUME_TCP_SERVER = 3,
+    MVVM_SOCK_INIT = 4,
+    MVVM_SOCK_FIN = 5,
+    // a tcp server suspended to its snapshot file, the gateway restores it on the next connection
+    MVVM_SOCK_HIBERNATE = 6
+};
+/* the one shot request of older runtimes, and still the fin the gateway puts in front of a guest */
+struct mvvm_op_data {
+    enum opcode op;
+    bool is_tcp;
+    int size;
+    SocketAddrPool addr[MVVM_MAX_ADDR][2];
+};
+/* a control request, followed by addr_count (server, client) address pairs and data_len bytes of data */
+struct mvvm_gateway_frame {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t op;
+    uint64_t session;
+    uint32_t seq;
+    uint8_t is_tcp;
+    uint8_t reserved;
+    uint16_t data_len;
+    uint32_t addr_count;
+};
+
+struct mvvm_gateway_ack {
+    uint32_t magic;
+    uint32_t seq;
+};
+
+struct GatewayRequest {
+    enum opcode op;
+    bool is_tcp;
+    // which instance it is about, it survives migration through the snapshot, 0 for older runtimes
+    uint64_t session;
+    uint32_t seq;
+    std::vector<std::array<SocketAddrPool, 2>> addr;
+    // for hibernate, the target's file name and then the thread count, each ended by a NUL
+    std::string data;
+};
+
+/**
+ * The runtime's end of the control channel: one connection to the gateway, kept open for the life of the instance.
+ * The gateway acks each request as soon as it has read it, not once it has acted on it.
+ */
+class GatewayClient {
+public:
+    GatewayClient();
+    ~GatewayClient();
+    GatewayClient(const GatewayClient &) = delete;
+    GatewayClient &operator=(const GatewayClient &) = delete;
+
+    /** Deliver a request for this instance, false if no ack came back on any of MVVM_GATEWAY_SEND_ATTEMPTS tries. */
+    bool send(enum opcode op, bool is_tcp, const std::vector<std::array<SocketAddrPool, 2>> &addr,
+              const std::string &data = {});
+
+    uint64_t session;
+
+private:
+    bool connect();
+
+    std::mutex mtx_;
+    int fd_ = -1;
+    uint32_t seq_{};
+};
+
+/**
+ * Read the next request off a control connection, a frame or the bare mvvm_op_data of an older runtime, which also
+ * sets legacy since nothing follows it. False once the connection is closed or sends garbage.
+ */
+bool gateway_read_request(int fd, GatewayRequest &req, bool &legacy);
+/** Tell the runtime that sent req it arrived, older runtimes don't wait for it and get none. */
+bool gateway_ack(int fd, const GatewayRequest &req);
+
+#endif // MVVM_WAMR_GATEWAY_H
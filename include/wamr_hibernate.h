@@ -0,0 +1,48 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#ifndef MVVM_WAMR_HIBERNATE_H
+#define MVVM_WAMR_HIBERNATE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+/**
+ * Scale to zero. Once the guest has gone timeout seconds without network activity it is checkpointed to its snapshot
+ * file the way SIGINT does and the process exits, the gateway keeps its listening socket and runs MVVM_restore on the
+ * target and thread count given here when the next connection arrives. It restores in its own snapshot directory, the
+ * instance has to run there on a target right in it.
+ */
+class WAMRIdleWatchdog {
+public:
+    /** Watch from now on, a timeout of 0 never fires. */
+    void start(uint32_t timeout, const std::string &target, uint32_t max_threads);
+    /** Note guest network activity, cheap enough for every send and recv. */
+    void touch() { last_active_.store(now(), std::memory_order_relaxed); }
+    /** Whether the checkpoint under way is this watchdog's doing. */
+    [[nodiscard]] bool fired() const { return fired_.load(); }
+    /** The target's file name and the thread count, as the gateway expects them with MVVM_SOCK_HIBERNATE. */
+    [[nodiscard]] std::string restore_data() const;
+
+private:
+    static int64_t now();
+
+    std::atomic<int64_t> last_active_{};
+    std::atomic<bool> fired_{};
+    std::string target_;
+    uint32_t max_threads_{};
+    std::jthread thread_;
+};
+
+#endif // MVVM_WAMR_HIBERNATE_H
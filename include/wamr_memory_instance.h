@@ -12,10 +12,10 @@
 
 #ifndef MVVM_WAMR_MEMORY_INSTANCE_H
 #define MVVM_WAMR_MEMORY_INSTANCE_H
+#include "wamr_memory_policy.h"
 #include "wamr_serializer.h"
 #include "wasm_runtime.h"
 #include <memory>
-#include <span>
 #include <vector>
 struct WAMRMemoryInstance {
     /* Module type */
@@ -35,11 +35,15 @@ struct WAMRMemoryInstance {
      *   the app-heap might be inserted in to the linear memory,
      *   when memory is re-allocated, the heap data and memory data
      *   must be copied to new memory also
+     * Only the sizes go through struct_pack, the bytes follow the snapshot raw and are read in place on restore.
      */
-    std::span<uint8_t> memory_data;
+    uint64 memory_data_size;
 
     /* Heap data base address */
-    std::vector<uint8> heap_data;
+    uint64 heap_data_size;
+    /* MVVM_PAGE_SIZE pages written recently, streamed and faulted in first on restore, only set for the memories that
+     * go in the trailer */
+    std::vector<uint32> hot_pages;
 
     void dump_impl(WASMMemoryInstance *env) {
         module_type = env->module_type;
@@ -48,11 +52,12 @@ struct WAMRMemoryInstance {
         cur_page_count = env->cur_page_count;
         max_page_count = env->max_page_count;
         is_shared_memory = env->is_shared_memory;
-        // memory_data.resize(env->memory_data_size);
-        memory_data = std::span<uint8_t>(env->memory_data, env->memory_data_size);
-        // memcpy(memory_data.data(), env->memory_data, env->memory_data_size);
-        heap_data = std::vector<uint8>(env->heap_data, env->heap_data_end);
+        memory_data_size = env->memory_data_size;
+        heap_data_size = env->heap_data_end - env->heap_data;
     };
+    /** Map the memory (or take prepared, the memfd's mapping if adopted) and the heap, and read the trailer's bytes
+     * for them into place. Only needs the snapshot, so restore can run it before the module is instantiated. */
+    std::pair<uint8 *, uint8 *> load_data(uint8 *prepared, bool adopted, uint64 reserve, size_t guest_threads);
     void restore_impl(WASMMemoryInstance *env);
 };
 
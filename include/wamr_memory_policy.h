@@ -0,0 +1,70 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#ifndef MVVM_WAMR_MEMORY_POLICY_H
+#define MVVM_WAMR_MEMORY_POLICY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+/* below this a single read beats spawning workers */
+#define MVVM_POPULATE_CHUNK (64ul << 20)
+/* past this the image won't fit in cache anyway, so bypass it */
+#define MVVM_NT_THRESHOLD (1ul << 30)
+/* a stream is received this much at a time, while the workers copy out the window before */
+#define MVVM_STREAM_WINDOW (256ul << 20)
+/* granularity of the hot page set */
+#define MVVM_PAGE_SIZE 4096
+
+enum class WAMRPlacement {
+    /* pages on the restoring thread's node, where a single threaded guest keeps running */
+    FirstTouch,
+    /* pages spread over all nodes, the guest's threads may run anywhere */
+    Interleave,
+};
+
+WAMRPlacement placement_for(size_t guest_threads);
+/** Set where the not yet faulted pages of linear memory go. */
+void place_memory(uint8_t *dst, size_t len, WAMRPlacement placement);
+/** Copy a restored image into linear memory over several workers. */
+void populate_memory(uint8_t *dst, const uint8_t *src, size_t len);
+/** Read a restored image from a file into linear memory, each worker preads its own slice. */
+bool pread_memory(int fd, off_t offset, uint8_t *dst, size_t len);
+/** Same from a stream only read() can consume in order, it fills one window while the workers copy out the last. */
+bool stream_memory(uint8_t *dst, size_t len, const std::function<bool(uint8_t *, size_t)> &read);
+
+/** Start a new window for soft_dirty_pages, process wide. */
+void clear_soft_dirty();
+/** Pages of [base, base + len) written since the last clear_soft_dirty, as MVVM_PAGE_SIZE indices. */
+std::vector<uint32_t> soft_dirty_pages(const uint8_t *base, size_t len);
+/** [offset, length) runs covering len, the hot ones first, and how many of them are hot. */
+std::pair<std::vector<std::pair<size_t, size_t>>, size_t> hot_first_ranges(const std::vector<uint32_t> &hot_pages,
+                                                                          size_t len);
+/** Fault a range in ahead of use. */
+void prefault_memory(uint8_t *dst, size_t len);
+/** madvise everything outside the hot pages with advice (MADV_COLD or MADV_PAGEOUT), returns the bytes advised. */
+size_t demote_cold(uint8_t *base, size_t len, const std::vector<uint32_t> &hot_pages, int advice);
+/** Bytes of [base, base + len) currently resident. */
+size_t resident_bytes(const uint8_t *base, size_t len);
+/**
+ * Move [base, base + used) onto a memfd mapped shared at the same address, returns the fd or -1. base has to be page
+ * aligned, and nothing past used is mapped over, so the memory must never grow or move.
+ */
+int memfd_back_memory(uint8_t *base, size_t used);
+/** Map all of a memfd another process handed over, nullptr on failure. */
+uint8_t *map_memfd(int fd);
+
+#endif // MVVM_WAMR_MEMORY_POLICY_H
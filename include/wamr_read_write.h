@@ -11,6 +11,7 @@
  */
 #ifndef MVVM_WAMR_READ_WRITE_H
 #define MVVM_WAMR_READ_WRITE_H
+#include "wamr_memory_policy.h"
 #include "ylt/struct_pack.hpp"
 #include <cstdint>
 #include <spdlog/spdlog.h>
@@ -18,9 +19,39 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #endif
 
+/** Optional frame the source sends ahead of the snapshot as soon as a checkpoint is requested, so the destination can
+ * map and fault in the linear memory while the source is still quiescing. */
+#define MVVM_PREPARE_MAGIC 0x5056564du
+#define MVVM_PREPARE_VERSION 1
+struct mvvm_prepare_frame {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t memory_bytes;
+};
+
+/** Ahead of the struct_pack'd envs, as what follows them changed with the raw memory trailer. */
+#define MVVM_SNAPSHOT_MAGIC 0x5356564du
+#define MVVM_SNAPSHOT_VERSION 2
+struct mvvm_snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+/** Same host migration hands live fds over ahead of the snapshot, each tagged with the guest fd it backs. */
+#define MVVM_FD_MAGIC 0x4456564du
+/* SCM_MAX_FD in the kernel */
+#define MVVM_FD_BATCH 253
+/* the tag of the memfd behind linear memory */
+#define MVVM_FD_MEMORY (-1)
+struct mvvm_fd_frame {
+    uint32_t magic;
+    uint32_t count;
+};
+
 struct WriteStream {
     virtual bool write(const char *data, std::size_t sz) const { return false; };
     virtual ~WriteStream() = default;
@@ -40,7 +71,17 @@ struct FwriteStream : public WriteStream {
 };
 struct FreadStream : public ReadStream {
     FILE *file;
-    bool read(char *data, std::size_t sz) const override { return fread(data, sz, 1, file) == 1; }
+    bool read(char *data, std::size_t sz) const override {
+#ifndef _WIN32
+        // the memory trailer, fan it out over the page cache
+        if (sz >= 2 * MVVM_POPULATE_CHUNK) {
+            auto offset = ftell(file);
+            return offset >= 0 && pread_memory(fileno(file), offset, (uint8_t *)data, sz) &&
+                   fseek(file, offset + (long)sz, SEEK_SET) == 0;
+        }
+#endif
+        return fread(data, sz, 1, file) == 1;
+    }
     const char *read_view(size_t len) override {
         char *buffer = new char[len];
         if (fread(buffer, len, 1, file) != 1) {
@@ -70,6 +111,7 @@ struct SocketWriteStream : public WriteStream {
         }
         return true;
     }
+    SocketWriteStream() = default;
     explicit SocketWriteStream(const char *address, int port) {
         sock_fd = socket(AF_INET, SOCK_STREAM, 0);
         if (sock_fd == -1) {
@@ -93,6 +135,13 @@ struct SocketReadStream : public ReadStream {
     int client_fd;
     mutable std::size_t position = 0;
     bool read(char *data, std::size_t sz) const override {
+        // the memory trailer, received a window ahead of the workers copying it out
+        if (sz >= 2 * MVVM_POPULATE_CHUNK)
+            return stream_memory((uint8_t *)data, sz,
+                                 [this](uint8_t *buf, size_t n) { return recv_all((char *)buf, n); });
+        return recv_all(data, sz);
+    }
+    bool recv_all(char *data, std::size_t sz) const {
         std::size_t totalReceived = 0;
         while (totalReceived < sz) {
             ssize_t received = recv(client_fd, data + totalReceived, sz - totalReceived, 0);
@@ -120,6 +169,7 @@ struct SocketReadStream : public ReadStream {
 
         return buffer;
     }
+    SocketReadStream() = default;
     explicit SocketReadStream(const char *address, int port) {
         sock_fd = socket(AF_INET, SOCK_STREAM, 0);
         if (sock_fd == -1) {
@@ -162,6 +212,102 @@ struct SocketReadStream : public ReadStream {
 };
 static_assert(ReaderStreamTrait<SocketReadStream, char>, "Reader must conform to ReaderStreamTrait");
 static_assert(WriterStreamTrait<SocketWriteStream, char>, "Writer must conform to WriterStreamTrait");
+/** Migration to another process on this host, the snapshot goes over a unix socket and fds go along with it. */
+struct UnixWriteStream : public SocketWriteStream {
+    bool send_fds(const std::vector<std::pair<int32_t, int>> &fds) const {
+        mvvm_fd_frame frame{.magic = MVVM_FD_MAGIC, .count = (uint32_t)fds.size()};
+        if (!write((const char *)&frame, sizeof(frame)))
+            return false;
+        for (size_t i = 0; i < fds.size(); i += MVVM_FD_BATCH) {
+            auto n = std::min<size_t>(MVVM_FD_BATCH, fds.size() - i);
+            int32_t tags[MVVM_FD_BATCH];
+            char control[CMSG_SPACE(sizeof(int) * MVVM_FD_BATCH)]{};
+            for (size_t j = 0; j < n; j++)
+                tags[j] = fds[i + j].first;
+            struct iovec iov {.iov_base = tags, .iov_len = n * sizeof(int32_t)};
+            struct msghdr msg {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+            auto cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+            for (size_t j = 0; j < n; j++)
+                ((int *)CMSG_DATA(cmsg))[j] = fds[i + j].second;
+            if (sendmsg(sock_fd, &msg, 0) != (ssize_t)iov.iov_len)
+                return false;
+        }
+        return true;
+    }
+    explicit UnixWriteStream(const char *path) {
+        sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock_fd == -1) {
+            SPDLOG_ERROR("Socket creation failed");
+            return;
+        }
+        sockaddr_un server_addr{.sun_family = AF_UNIX};
+        strncpy(server_addr.sun_path, path, sizeof(server_addr.sun_path) - 1);
+        if (connect(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+            SPDLOG_ERROR("Connection failed");
+            close(sock_fd);
+            exit(EXIT_FAILURE);
+        }
+    }
+};
+struct UnixReadStream : public SocketReadStream {
+    std::string path;
+    /** The fds sent with send_fds, in order, false if the frame or the fds didn't come through. */
+    bool recv_fds(std::vector<std::pair<int32_t, int>> &fds) const {
+        mvvm_fd_frame frame{};
+        if (!read((char *)&frame, sizeof(frame)) || frame.magic != MVVM_FD_MAGIC)
+            return false;
+        while (fds.size() < frame.count) {
+            auto n = std::min<size_t>(MVVM_FD_BATCH, frame.count - fds.size());
+            int32_t tags[MVVM_FD_BATCH];
+            char control[CMSG_SPACE(sizeof(int) * MVVM_FD_BATCH)]{};
+            struct iovec iov {.iov_base = tags, .iov_len = n * sizeof(int32_t)};
+            struct msghdr msg {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            auto received = recvmsg(client_fd, &msg, MSG_CMSG_CLOEXEC);
+            auto cmsg = CMSG_FIRSTHDR(&msg);
+            if (received <= 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS || (msg.msg_flags & MSG_CTRUNC))
+                return false;
+            // the tags may arrive short, the fds never do
+            if ((size_t)received < iov.iov_len && !read((char *)tags + received, iov.iov_len - received))
+                return false;
+            position += iov.iov_len;
+            for (size_t j = 0; j < n; j++)
+                fds.emplace_back(tags[j], ((int *)CMSG_DATA(cmsg))[j]);
+        }
+        return true;
+    }
+    explicit UnixReadStream(const char *path) : path(path) {
+        sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock_fd == -1) {
+            SPDLOG_ERROR("Socket creation failed");
+            return;
+        }
+        sockaddr_un server_addr{.sun_family = AF_UNIX};
+        strncpy(server_addr.sun_path, path, sizeof(server_addr.sun_path) - 1);
+        unlink(path);
+        SPDLOG_INFO("[Server] Bind socket {}", path);
+        if (bind(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            SPDLOG_ERROR("Bind failed");
+            exit(EXIT_FAILURE);
+        }
+        if (listen(sock_fd, 1) < 0) {
+            SPDLOG_ERROR("Listen failed");
+            exit(EXIT_FAILURE);
+        }
+        client_fd = accept(sock_fd, nullptr, nullptr);
+    }
+    ~UnixReadStream() override { unlink(path.c_str()); }
+};
 #endif
 
 #if __linux__
@@ -611,7 +757,11 @@ public:
         if (position + sz > buffer_size) {
             std::throw_with_nested(std::runtime_error("Buffer overflow"));
         }
-        memcpy(data, buffer.data() + position, sz);
+        // the memory trailer is already here, only the copy out is left to fan out
+        if (sz >= 2 * MVVM_POPULATE_CHUNK)
+            populate_memory((uint8_t *)data, (const uint8_t *)buffer.data() + position, sz);
+        else
+            memcpy(data, buffer.data() + position, sz);
         position += sz;
         return true;
     }
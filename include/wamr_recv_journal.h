@@ -0,0 +1,52 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#ifndef MVVM_WAMR_RECV_JOURNAL_H
+#define MVVM_WAMR_RECV_JOURNAL_H
+
+#include "wamr_wasi_context.h"
+#include <cstdio>
+#include <vector>
+
+#define MVVM_JOURNAL_CAPACITY 64
+
+/**
+ * Packets received on one socket while it is drained at the checkpoint boundary, i.e. the data the guest has not
+ * consumed yet. Once the ring is full the oldest entries go to a temporary file. Without spilling the ring is all
+ * there is, and a peer that sends more than it holds fails the checkpoint instead of losing the packet.
+ */
+class WAMRRecvJournal {
+public:
+    explicit WAMRRecvJournal(size_t capacity = MVVM_JOURNAL_CAPACITY, bool spill = true);
+    WAMRRecvJournal(WAMRRecvJournal &&other) noexcept;
+    WAMRRecvJournal(const WAMRRecvJournal &) = delete;
+    WAMRRecvJournal &operator=(const WAMRRecvJournal &) = delete;
+    ~WAMRRecvJournal();
+
+    /** Exits if the ring is full and spilling is off, a snapshot without the packet would lose it. */
+    void push(WasiSockRecvFromData &&data);
+    /** Everything journaled, oldest first, and reset. */
+    std::vector<WasiSockRecvFromData> drain();
+    [[nodiscard]] size_t size() const { return size_ + spilled_; }
+
+private:
+    void spill(const WasiSockRecvFromData &data);
+    bool unspill(WasiSockRecvFromData &data);
+
+    std::vector<WasiSockRecvFromData> ring_;
+    size_t head_{}, size_{};
+    bool spill_enabled_;
+    FILE *spill_{};
+    size_t spilled_{};
+};
+
+#endif // MVVM_WAMR_RECV_JOURNAL_H
@@ -0,0 +1,55 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#ifndef MVVM_WAMR_TCP_REPAIR_H
+#define MVVM_WAMR_TCP_REPAIR_H
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Kernel state of an established TCP connection taken with TCP_REPAIR, enough to bring the same connection up in
+ * another process without the peer noticing. Needs CAP_NET_ADMIN on both sides.
+ */
+struct WAMRTcpRepair {
+    bool valid{};
+    int family{};
+    /* sockaddr_in or sockaddr_in6 */
+    std::vector<uint8_t> local_addr;
+    std::vector<uint8_t> remote_addr;
+    uint32_t send_seq{};
+    uint32_t recv_seq{};
+    /* the send queue holds sent but unacked data followed by unsent_len bytes never put on the wire */
+    std::vector<uint8_t> send_queue;
+    uint32_t unsent_len{};
+    std::vector<uint8_t> recv_queue;
+    uint32_t mss{};
+    uint8_t snd_wscale{};
+    uint8_t rcv_wscale{};
+    bool wscale{};
+    bool sack{};
+    bool timestamps{};
+    uint32_t timestamp{};
+    /* struct tcp_repair_window */
+    uint32_t snd_wl1{};
+    uint32_t snd_wnd{};
+    uint32_t max_window{};
+    uint32_t rcv_wnd{};
+    uint32_t rcv_wup{};
+};
+
+/** Put host_fd in repair mode and read its state, it stays in repair mode so closing it never reaches the peer. */
+bool tcp_repair_dump(int host_fd, WAMRTcpRepair &state);
+/** A new host socket for the connection in state, established without a handshake, or -1. */
+int tcp_repair_restore(const WAMRTcpRepair &state);
+
+#endif // MVVM_WAMR_TCP_REPAIR_H
@@ -0,0 +1,91 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#ifndef MVVM_WAMR_THREAD_STATE_H
+#define MVVM_WAMR_THREAD_STATE_H
+
+#include "wamr_export.h"
+#include "wasm_runtime.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#define MVVM_MAX_THREADS 1024
+
+/** State the hot export hooks touch, one cache line per thread so that no two threads ever share a line. */
+struct alignas(64) WAMRThreadState {
+    /* Taken by a thread, given back when it exits so that the slot can go to another. */
+    std::atomic<bool> used{};
+    /* The exec_env handle of the owning thread. */
+    std::atomic<uint64> tid{};
+    /* lwcp is LightWeight CheckPoint, only the owning thread writes it. */
+    std::atomic<int64_t> lwcp_depth{};
+    /* Mutex refs currently held, in acquisition order, only the owning thread writes it. */
+    std::vector<uint32> held{};
+    /* Non zero while blocked in a cond/atomic wait, other threads clear it when they wake us. */
+    std::atomic<uint64> wait_seq{};
+    std::atomic<uint32> wait_ref{};
+    std::atomic<enum sync_op> wait_op{};
+    /* Only read at checkpoint, when every thread is suspended. */
+    uint64 wait_expected{};
+    bool wait64{};
+    /* The mutex a cond wait let go of, out of held until the wait returns with it taken again. */
+    uint32 wait_mutex{};
+    bool reacquire{};
+    /* Set while inside a wasi call that can block, host_thread is who to signal to get it out for a checkpoint. */
+    std::atomic<bool> blocking{};
+    std::atomic<uint64> host_thread{};
+};
+
+/** Owns every WAMRThreadState, a fixed array so that any thread can walk it without taking a lock. */
+class WAMRThreadRegistry {
+public:
+    WAMRThreadRegistry();
+    ~WAMRThreadRegistry();
+    /** The calling thread's slot, registered on first use and given back when the thread exits. */
+    WAMRThreadState *local(uint64 tid);
+    /** Number of outstanding lightweight checkpoints over all threads, only meaningful once they stop moving. */
+    size_t lwcp_ready();
+
+    /** Live lock state tracking, these replace the ever growing sync_ops log. */
+    void on_sync_op(uint64 tid, uint32 ref, enum sync_op op, uint64 expected = 0, bool wait64 = false);
+    void on_atomic_wake(uint32 ref);
+    /** The calling thread is back from a call that may have been a cond wait, and holds its mutex again if so. */
+    static void on_return(WAMRThreadState *s) {
+        if (s->reacquire) [[unlikely]] {
+            s->wait_seq.store(0, std::memory_order_release);
+            s->held.push_back(s->wait_mutex);
+            s->reacquire = false;
+        }
+    }
+    /** Held mutexes and pending waits as a replayable list, sized by live locks rather than history. */
+    std::vector<struct sync_op_t> live_sync_ops();
+
+    template <typename F> void for_each(F &&f) {
+        auto n = std::min(count_.load(std::memory_order_acquire), (size_t)MVVM_MAX_THREADS);
+        for (size_t i = 0; i < n; i++)
+            f(slots_[i]);
+    }
+
+private:
+    void wake(uint32 ref, enum sync_op op, bool all);
+    WAMRThreadState *claim();
+
+    std::unique_ptr<WAMRThreadState[]> slots_;
+    std::atomic<size_t> count_{};
+    std::atomic<uint64> wait_seq_{};
+    uint64 id_;
+};
+
+#endif // MVVM_WAMR_THREAD_STATE_H
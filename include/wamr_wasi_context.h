@@ -15,6 +15,7 @@
 
 #include "wamr_export.h"
 #include "wamr_serializer.h"
+#include "wamr_tcp_repair.h"
 #include "wasm_runtime.h"
 #include <atomic>
 #include <filesystem>
@@ -66,10 +67,16 @@ struct SocketMetaData {
     bool is_server = false;
     bool is_collection = false;
     WasiSockSendToData socketSentToData{}; //
+    // first peer we heard from, the gateway needs it for connectionless sockets
+    WAMRWasiAddr peer_addr{};
+    bool has_peer = false;
+    // only the packets still in flight at the checkpoint
     std::vector<WasiSockRecvFromData> socketRecvFromDatas;
+    // established tcp connection taken over as is, no gateway in between
+    WAMRTcpRepair tcp_repair{};
 };
 struct WAMRWASIContext {
-    std::map<int, std::tuple<std::string, std::vector<std::tuple<int, int, fd_op>>>> fd_map;
+    std::map<int, std::tuple<std::string, std::vector<std::tuple<int, int64, fd_op>>>> fd_map;
     std::map<int, SocketMetaData> socket_fd_map;
     std::vector<struct sync_op_t> sync_ops;
     std::vector<std::string> dir;
@@ -82,10 +89,16 @@ struct WAMRWASIContext {
     std::map<uint64, std::pair<int, int>> tid_start_arg_map;
     std::map<int, int> child_tid_map;
     uint32_t exit_code;
+    // GatewayClient::session, carried over so the gateway can match resume to suspend
+    uint64_t gateway_session;
 
     void dump_impl(WASIArguments *env);
     void restore_impl(WASIArguments *env);
 };
+#if __linux__
+/** The host socket behind a guest socket, -1 if it can't be told apart from others. */
+int host_sock_fd(const SocketMetaData &metaData, bool is_tcp);
+#endif
 template <SerializerTrait<WASIArguments *> T> void dump(T t, WASIArguments *env) { t->dump_impl(env); }
 template <SerializerTrait<WASIArguments *> T> void restore(T t, WASIArguments *env) { t->restore_impl(env); }
 
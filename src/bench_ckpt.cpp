@@ -0,0 +1,347 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "wamr.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <cxxopts.hpp>
+#include <fcntl.h>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+WAMRInstance *wamr = nullptr;
+ReadStream *reader;
+WriteStream *writer;
+std::vector<std::unique_ptr<WAMRExecEnv>> as;
+
+/* every operator new in the process, the serializer allocates through nothing else */
+static std::atomic<uint64_t> allocs{};
+
+// out of line, or gcc sees the free() behind an inlined delete and takes it for a mismatch
+[[gnu::noinline]] void *operator new(std::size_t sz) {
+    allocs.fetch_add(1, std::memory_order_relaxed);
+    if (auto p = malloc(sz ? sz : 1))
+        return p;
+    throw std::bad_alloc();
+}
+[[gnu::noinline]] void *operator new[](std::size_t sz) { return operator new(sz); }
+[[gnu::noinline]] void operator delete(void *p) noexcept { free(p); }
+[[gnu::noinline]] void operator delete[](void *p) noexcept { free(p); }
+[[gnu::noinline]] void operator delete(void *p, std::size_t) noexcept { free(p); }
+[[gnu::noinline]] void operator delete[](void *p, std::size_t) noexcept { free(p); }
+
+/* the snapshot kept in memory, so that the structs are measured apart from where they are written to */
+struct BufferWriteStream : public WriteStream {
+    mutable std::vector<char> buffer;
+    bool write(const char *data, std::size_t sz) const override {
+        buffer.insert(buffer.end(), data, data + sz);
+        return true;
+    }
+};
+struct BufferReadStream : public ReadStream {
+    const std::vector<char> *buffer{};
+    mutable std::size_t position = 0;
+    bool read(char *data, std::size_t sz) const override {
+        if (position + sz > buffer->size())
+            return false;
+        memcpy(data, buffer->data() + position, sz);
+        position += sz;
+        return true;
+    }
+    const char *read_view(size_t len) override {
+        if (position + len > buffer->size())
+            return nullptr;
+        position += len;
+        return buffer->data() + position - len;
+    }
+    bool ignore(std::size_t sz) const override {
+        position += sz;
+        return position <= buffer->size();
+    }
+    std::size_t tellg() const override { return position; }
+};
+
+static std::string filter;
+static size_t target_bytes;
+static size_t max_size;
+
+static bool enabled(const std::string &group) { return group.find(filter) != std::string::npos; }
+
+[[noreturn]] static void fail(const std::string &name) {
+    SPDLOG_ERROR("{} failed {}", name, errno);
+    exit(EXIT_FAILURE);
+}
+
+/** Time op over enough iterations to move target_bytes, after one untimed round to warm caches and buffers. */
+template <typename F> static void run(const std::string &name, size_t size, size_t bytes, F &&op) {
+    auto iters = std::clamp<size_t>(target_bytes / std::max<size_t>(bytes, 1), 3, 1000000);
+    op();
+    auto allocs_before = allocs.load(std::memory_order_relaxed);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iters; i++)
+        op();
+    auto ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start)
+                  .count() /
+              (double)iters;
+    auto allocs_per_op = (double)(allocs.load(std::memory_order_relaxed) - allocs_before) / (double)iters;
+    // bytes per ns is GB/s
+    fmt::print("{:<32} {:>12} {:>14.0f} {:>10.3f} {:>12.1f}\n", name, size, ns, (double)bytes / ns, allocs_per_op);
+}
+
+/**
+ * Dump obj to memory and back, the struct_pack half of what serialize_to_file and restore do with it. Walking the
+ * runtime's structs into obj and back is not timed, so the rows say pack only.
+ */
+template <typename T> static void run_struct(const std::string &group, size_t size, const T &obj) {
+    BufferWriteStream w;
+    struct_pack::serialize_to(w, obj);
+    auto bytes = w.buffer.size();
+    run(group + " dump (pack only)", size, bytes, [&] {
+        w.buffer.clear();
+        struct_pack::serialize_to(w, obj);
+    });
+    BufferReadStream r;
+    r.buffer = &w.buffer;
+    run(group + " restore (pack only)", size, bytes, [&] {
+        r.position = 0;
+        if (!struct_pack::deserialize<T>(r))
+            fail(group + " restore");
+    });
+}
+
+static uint8_t *map_pages(size_t size) {
+    auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        fail("mmap");
+    memset(p, 0xa5, size);
+    return (uint8_t *)p;
+}
+
+static void bench_memory() {
+    for (size_t size = 1 << 20; size <= max_size; size <<= 4) {
+        auto data = map_pages(size), dst = map_pages(size);
+        WASMMemoryInstance env{};
+        env.num_bytes_per_page = 65536;
+        env.cur_page_count = env.max_page_count = size / 65536;
+        env.memory_data = data;
+        env.memory_data_size = size;
+        env.heap_data = env.heap_data_end = data;
+        WAMRMemoryInstance mem{};
+        BufferWriteStream w;
+        // the struct and then the memory trailer, as serialize_to_file lays them out
+        auto dump_one = [&] {
+            w.buffer.clear();
+            dump(&mem, &env);
+            mem.hot_pages = soft_dirty_pages(data, size);
+            struct_pack::serialize_to(w, mem);
+            w.write((const char *)data, size);
+        };
+        dump_one();
+        auto bytes = w.buffer.size();
+        run("memory dump", size, bytes, dump_one);
+        BufferReadStream r;
+        r.buffer = &w.buffer;
+        run("memory restore", size, bytes, [&] {
+            r.position = 0;
+            auto m = struct_pack::deserialize<WAMRMemoryInstance>(r);
+            if (!m)
+                fail("memory restore");
+            for (auto [offset, len] : hot_first_ranges(m->hot_pages, m->memory_data_size).first)
+                if (!r.read((char *)dst + offset, len))
+                    fail("memory restore");
+        });
+        munmap(data, size);
+        munmap(dst, size);
+    }
+}
+
+static void bench_module() {
+    for (size_t size = 4096; size <= std::min<size_t>(max_size, 16 << 20); size <<= 4) {
+        WAMRModuleInstance inst{};
+        inst.global_data.assign(size, 0xa5);
+        inst.memories.resize(1);
+        run_struct("module", size, inst);
+    }
+}
+
+static void bench_exec_env() {
+    for (size_t depth = 16; depth <= 4096; depth <<= 4) {
+        WAMRExecEnv env{};
+        for (size_t i = 0; i < depth; i++) {
+            auto frame = std::make_unique<WAMRInterpFrame>();
+            frame->function_index = (int32)i;
+            frame->ip = (uint32)i * 16;
+            frame->stack_frame.assign(64, (uint32)i);
+            env.frames.push_back(std::move(frame));
+        }
+        run_struct("exec_env", depth, env);
+    }
+}
+
+static void bench_wasi_context() {
+    for (size_t count = 16; count <= 16384; count <<= 5) {
+        WAMRWASIContext ctx{};
+        for (int i = 0; i < (int)count; i++) {
+            ctx.fd_map[i + 3] = {fmt::format("/data/file-{}.bin", i),
+                                 {{O_RDWR, 0, MVVM_FOPEN}, {SEEK_SET, 4096, MVVM_FSEEK}}};
+            SocketMetaData sock{};
+            sock.domain = AF_INET;
+            sock.type = SOCK_STREAM;
+            sock.socketAddress.is_4 = true;
+            sock.socketAddress.port = (uint16)i;
+            sock.socketRecvFromDatas.push_back({.sock = (uint32)i, .ri_data = std::vector<uint8_t>(64, 0xa5)});
+            ctx.socket_fd_map[i + 3 + (int)count] = std::move(sock);
+        }
+        run_struct("wasi_context", count, ctx);
+    }
+}
+
+static void bench_file(const std::string &dir) {
+    auto path = fmt::format("{}/mvvm_bench_{}.bin", dir, getpid());
+    for (size_t size = 4096; size <= max_size; size <<= 4) {
+        std::vector<char> buf(size, (char)0xa5), dst(size);
+        {
+            FwriteStream w(path.c_str());
+            if (!w.file)
+                fail(path);
+            run("file write", size, size, [&] {
+                rewind(w.file);
+                if (!w.write(buf.data(), size) || fflush(w.file) != 0)
+                    fail("file write");
+            });
+        }
+        FreadStream r(path.c_str());
+        run("file read", size, size, [&] {
+            rewind(r.file);
+            if (!r.read(dst.data(), size))
+                fail("file read");
+        });
+    }
+    unlink(path.c_str());
+}
+
+static std::pair<int, int> tcp_pair() {
+    sockaddr_in addr{.sin_family = AF_INET};
+    socklen_t len = sizeof(addr);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1 || bind(listener, (sockaddr *)&addr, len) == -1 || listen(listener, 1) == -1 ||
+        getsockname(listener, (sockaddr *)&addr, &len) == -1)
+        fail("tcp listen");
+    int client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client == -1 || connect(client, (sockaddr *)&addr, len) == -1)
+        fail("tcp connect");
+    int server = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (server == -1)
+        fail("tcp accept");
+    close(listener);
+    return {client, server};
+}
+
+static std::pair<int, int> unix_pair() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+        fail("socketpair");
+    return {fds[0], fds[1]};
+}
+
+/** The socket streams over a connected pair, with a thread on the other end that drains or feeds as fast as it can. */
+static void bench_socket(const std::string &group, const std::function<std::pair<int, int>()> &connect_pair) {
+    for (size_t size = 4096; size <= max_size; size <<= 4) {
+        std::vector<char> buf(size, (char)0xa5), dst(size);
+        {
+            auto [wfd, rfd] = connect_pair();
+            std::jthread drain([rfd] {
+                std::vector<char> sink(1 << 20);
+                while (recv(rfd, sink.data(), sink.size(), 0) > 0)
+                    ;
+                close(rfd);
+            });
+            // closes wfd on the way out, which is what lets the drain finish
+            SocketWriteStream w;
+            w.sock_fd = wfd;
+            run(group + " write", size, size, [&] {
+                if (!w.write(buf.data(), size))
+                    fail(group + " write");
+            });
+        }
+        auto [wfd, rfd] = connect_pair();
+        std::jthread feed([wfd, &buf] {
+            while (send(wfd, buf.data(), buf.size(), MSG_NOSIGNAL) > 0)
+                ;
+            close(wfd);
+        });
+        SocketReadStream r;
+        r.sock_fd = -1;
+        r.client_fd = rfd;
+        run(group + " read", size, size, [&] {
+            if (!r.read(dst.data(), size))
+                fail(group + " read");
+        });
+        // the feeder is stopped by the peer going away
+        close(rfd);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    spdlog::cfg::load_env_levels();
+    cxxopts::Options options("MVVM_bench_ckpt",
+                             "Migratable Velocity Virtual Machine checkpoint/restore micro benchmark, the snapshot "
+                             "structs and the streams they are written to.");
+    options.add_options()("f,filter", "Only the groups whose name contains this, memory, module, exec_env, "
+                                      "wasi_context, file, tcp or unix",
+                          cxxopts::value<std::string>()->default_value(""))(
+        "b,bytes", "Roughly how many bytes each case moves", cxxopts::value<size_t>()->default_value("1073741824"))(
+        "s,max_size", "The largest memory and stream size in the sweep",
+        cxxopts::value<size_t>()->default_value("268435456"))(
+        "d,dir", "Where the file streams write", cxxopts::value<std::string>()->default_value("/tmp"))(
+        "h,help", "Print the options", cxxopts::value<bool>()->default_value("false"));
+    auto result = options.parse(argc, argv);
+    if (result["help"].as<bool>()) {
+        std::cout << options.help() << std::endl;
+        exit(EXIT_SUCCESS);
+    }
+    filter = result["filter"].as<std::string>();
+    target_bytes = result["bytes"].as<size_t>();
+    max_size = result["max_size"].as<size_t>();
+    // a peer that goes away mid send is how the socket cases end
+    signal(SIGPIPE, SIG_IGN);
+
+    fmt::print("{:<32} {:>12} {:>14} {:>10} {:>12}\n", "case", "size", "ns/op", "GB/s", "allocs/op");
+    if (enabled("memory"))
+        bench_memory();
+    if (enabled("module"))
+        bench_module();
+    if (enabled("exec_env"))
+        bench_exec_env();
+    if (enabled("wasi_context"))
+        bench_wasi_context();
+    if (enabled("file"))
+        bench_file(result["dir"].as<std::string>());
+    if (enabled("tcp"))
+        bench_socket("tcp", tcp_pair);
+    if (enabled("unix"))
+        bench_socket("unix", unix_pair);
+    return 0;
+}
@@ -25,6 +25,7 @@
 #endif
 
 WAMRInstance *wamr = nullptr;
+ReadStream *reader;
 std::ostringstream re{};
 WriteStream *writer;
 std::vector<std::unique_ptr<WAMRExecEnv>> as;
@@ -55,7 +56,22 @@ int main(int argc, char *argv[]) {
         "o,offload_addr", "The next hop to offload", cxxopts::value<std::string>()->default_value(""))(
         "s,offload_port", "The next hop port to offload", cxxopts::value<int>()->default_value("0"))(
         "c,count", "The step index to test execution", cxxopts::value<int>()->default_value("0"))(
-        "r,rdma", "Whether to use RDMA device", cxxopts::value<bool>()->default_value("0"));
+        "r,rdma", "Whether to use RDMA device", cxxopts::value<bool>()->default_value("0"))(
+        "T,max_threads", "The maximum number of wasm threads", cxxopts::value<uint32_t>()->default_value("16"))(
+        "J,journal_spill", "Spill in-flight network packets past the journal capacity to disk, =false fails the "
+                           "checkpoint once the journal is full",
+        cxxopts::value<bool>()->default_value("true"))(
+        "P,prepare", "Send a prepare frame to the restore side as soon as a checkpoint is requested",
+        cxxopts::value<bool>()->default_value("false"))(
+        "u,unix_path", "Migrate to a restore on this host through this unix socket, handing over memory and fds",
+        cxxopts::value<std::string>()->default_value(""))(
+        "R,tcp_repair", "Take established tcp connections along with TCP_REPAIR, needs CAP_NET_ADMIN on both sides",
+        cxxopts::value<bool>()->default_value("false"))(
+        "idle_timeout", "Seconds without network activity before hibernating to the snapshot file, 0 never does",
+        cxxopts::value<uint32_t>()->default_value("0"))(
+        "hot_window", "Milliseconds the guest runs on after a checkpoint is requested while the pages it writes are "
+                      "recorded, those go first in the snapshot, 0 records none",
+        cxxopts::value<uint32_t>()->default_value("0"));
 
     auto result = options.parse(argc, argv);
     if (result["help"].as<bool>()) {
@@ -73,6 +89,13 @@ int main(int argc, char *argv[]) {
     auto offload_port = result["offload_port"].as<int>();
     auto ns_pool = result["ns_pool"].as<std::vector<std::string>>();
     auto rdma = result["rdma"].as<bool>();
+    auto max_threads = result["max_threads"].as<uint32_t>();
+    auto journal_spill = result["journal_spill"].as<bool>();
+    auto prepare = result["prepare"].as<bool>();
+    auto unix_path = result["unix_path"].as<std::string>();
+    auto tcp_repair = result["tcp_repair"].as<bool>();
+    auto idle_timeout = result["idle_timeout"].as<uint32_t>();
+    auto hot_window = result["hot_window"].as<uint32_t>();
     snapshot_threshold = result["count"].as<int>();
     stop_func_threshold = result["function_count"].as<int>();
     is_debug = result["is_debug"].as<bool>();
@@ -82,6 +105,12 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // the gateway restores a hibernated instance from the snapshot file
+    if (idle_timeout && (!offload_addr.empty() || !unix_path.empty())) {
+        SPDLOG_ERROR("idle_timeout writes the snapshot file, it can't go with an offload target");
+        exit(EXIT_FAILURE);
+    }
+
     if (arg.size() == 1 && arg[0].empty())
         arg.clear();
     arg.insert(arg.begin(), target);
@@ -91,9 +120,11 @@ int main(int argc, char *argv[]) {
     }
     register_sigtrap();
     register_sigint();
-    if (offload_addr.empty())
+    if (offload_addr.empty() && unix_path.empty())
         writer = new FwriteStream((removeExtension(target) + ".bin").c_str());
 #ifndef _WIN32
+    else if (!unix_path.empty())
+        writer = new UnixWriteStream(unix_path.c_str());
 #if __linux__
     else if (rdma)
         writer = new RDMAWriteStream(offload_addr.c_str(), offload_port);
@@ -101,13 +132,25 @@ int main(int argc, char *argv[]) {
     else
         writer = new SocketWriteStream(offload_addr.c_str(), offload_port);
 #endif
-    wamr = new WAMRInstance(target.c_str(), is_jit);
+    wamr = new WAMRInstance(target.c_str(), is_jit, "compression", max_threads);
+    wamr->journal_spill = journal_spill;
+    wamr->send_prepare = prepare;
+    wamr->same_host = !unix_path.empty();
+    wamr->tcp_repair = tcp_repair;
     wamr->set_wasi_args(dir, map_dir, env, arg, addr, ns_pool);
     wamr->instantiate();
+    if (prepare)
+        wamr->start_preparer();
+    wamr->hot_window = hot_window;
+    if (hot_window)
+        wamr->start_hot_sampler();
     wamr->get_int3_addr();
     wamr->replace_int3_with_nop();
     wamr->replace_mfence_with_nop();
 
+    // what the gateway needs to wake a hibernated instance up again
+    wamr->idle.start(idle_timeout, target, max_threads);
+
     // get current time
     auto start = std::chrono::high_resolution_clock::now();
 
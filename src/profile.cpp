@@ -26,6 +26,7 @@
 #endif
 
 WAMRInstance *wamr = nullptr;
+ReadStream *reader;
 std::ostringstream re{};
 FwriteStream *writer;
 std::vector<std::unique_ptr<WAMRExecEnv>> as;
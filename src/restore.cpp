@@ -17,11 +17,16 @@
 #include "wamr_read_write.h"
 #include "wasm_runtime.h"
 #include <cxxopts.hpp>
+#include <future>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <string>
+#include <thread>
 #if !defined(_WIN32)
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
 
 ReadStream *reader;
@@ -29,6 +34,29 @@ WriteStream *writer;
 WAMRInstance *wamr = nullptr;
 std::vector<std::unique_ptr<WAMRExecEnv>> as;
 
+/** Map the restored linear memory, as large as restore would have mapped it, and fault in what the source reported
+ * in use. */
+static uint8 *prepare_memory(uint64_t bytes, uint64_t size) {
+#if !defined(_WIN32)
+    auto mem = (uint8 *)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        SPDLOG_ERROR("prepare mmap failed {}", errno);
+        return nullptr;
+    }
+    bytes = std::min<uint64_t>(bytes, size);
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(mem, bytes, MADV_POPULATE_WRITE) == 0)
+        return mem;
+#endif
+    auto page = sysconf(_SC_PAGESIZE);
+    for (uint64_t off = 0; off < bytes; off += page)
+        mem[off] = 0;
+    return mem;
+#else
+    return nullptr;
+#endif
+}
+
 int main(int argc, char **argv) {
     spdlog::cfg::load_env_levels();
     cxxopts::Options options("MVVM", "Migratable Velocity Virtual Machine, to ship the VM state to another machine");
@@ -41,7 +69,25 @@ int main(int argc, char **argv) {
         "o,offload_addr", "The next hop to offload", cxxopts::value<std::string>()->default_value(""))(
         "s,offload_port", "The next hop port to offload", cxxopts::value<int>()->default_value("0"))(
         "c,count", "The value for epoch value", cxxopts::value<size_t>()->default_value("0"))(
-        "r,rdma", "Whether to use RDMA device", cxxopts::value<bool>()->default_value("0"));
+        "r,rdma", "Whether to use RDMA device", cxxopts::value<bool>()->default_value("0"))(
+        "T,max_threads", "The maximum number of wasm threads, same as the checkpoint",
+        cxxopts::value<uint32_t>()->default_value("16"))(
+        "P,prepare", "Expect a prepare frame ahead of the snapshot, the checkpoint side must pass it too",
+        cxxopts::value<bool>()->default_value("false"))(
+        "D,demote", "What to do with cold linear memory after restore: none, cold or pageout",
+        cxxopts::value<std::string>()->default_value("none"))(
+        "demote_after", "Seconds to sample the working set after resume, 0 uses the one in the snapshot",
+        cxxopts::value<uint32_t>()->default_value("0"))(
+        "u,unix_path", "Restore from a checkpoint on this host through this unix socket, adopting its memory and fds",
+        cxxopts::value<std::string>()->default_value(""))(
+        "J,journal_spill", "Spill in-flight network packets past the journal capacity to disk when checkpointing "
+                           "again, =false fails that checkpoint once the journal is full",
+        cxxopts::value<bool>()->default_value("true"))(
+        "idle_timeout", "Seconds without network activity before hibernating to the snapshot file again, 0 never does",
+        cxxopts::value<uint32_t>()->default_value("0"))(
+        "hot_window", "Milliseconds the guest runs on after a checkpoint is requested while the pages it writes are "
+                      "recorded, those go first in the snapshot, 0 records none",
+        cxxopts::value<uint32_t>()->default_value("0"));
     // Can first discover from the wasi context.
 
     auto result = options.parse(argc, argv);
@@ -56,18 +102,50 @@ int main(int argc, char **argv) {
     auto offload_port = result["offload_port"].as<int>();
     auto count = result["count"].as<size_t>();
     auto rdma = result["rdma"].as<bool>();
+    auto max_threads = result["max_threads"].as<uint32_t>();
+    auto prepare = result["prepare"].as<bool>();
+    auto demote = result["demote"].as<std::string>();
+    auto demote_after = result["demote_after"].as<uint32_t>();
+    auto unix_path = result["unix_path"].as<std::string>();
+    auto idle_timeout = result["idle_timeout"].as<uint32_t>();
+    auto hot_window = result["hot_window"].as<uint32_t>();
+    auto journal_spill = result["journal_spill"].as<bool>();
+    int demote_advice = 0;
+#if defined(MADV_COLD) && defined(MADV_PAGEOUT)
+    if (demote == "cold")
+        demote_advice = MADV_COLD;
+    else if (demote == "pageout")
+        demote_advice = MADV_PAGEOUT;
+#endif
+    if (idle_timeout && !offload_addr.empty()) {
+        SPDLOG_ERROR("idle_timeout writes the snapshot file, it can't go with an offload target");
+        exit(EXIT_FAILURE);
+    }
+    if (demote != "none" && !demote_advice) {
+        SPDLOG_ERROR("unsupported demote policy {}", demote);
+        exit(EXIT_FAILURE);
+    }
 
     snapshot_threshold = count;
     register_sigtrap();
     register_sigint();
-    wamr = new WAMRInstance(target.c_str(), false);
-    wamr->instantiate();
-
-    wamr->get_int3_addr();
-    wamr->replace_int3_with_nop();
-    if (source_addr.empty())
+    // load and instantiate the module while the snapshot streams in
+    // memory is sized by the instance's heap_size, known as soon as it is constructed
+    std::promise<uint32> heap_size_promise;
+    auto heap_size = heap_size_promise.get_future().share();
+    std::thread loader([&] {
+        auto instance = new WAMRInstance(target.c_str(), false, "compression", max_threads);
+        heap_size_promise.set_value(instance->heap_size);
+        instance->instantiate_for_restore();
+        instance->get_int3_addr();
+        instance->replace_int3_with_nop();
+        wamr = instance;
+    });
+    if (source_addr.empty() && unix_path.empty())
         reader = new FreadStream((removeExtension(target) + ".bin").c_str()); // writer
 #if !defined(_WIN32)
+    else if (!unix_path.empty())
+        reader = new UnixReadStream(unix_path.c_str());
 #if __linux__
     else if(rdma)
         reader = new RDMAReadStream(source_addr.c_str(), source_port);
@@ -75,9 +153,85 @@ int main(int argc, char **argv) {
     else
         reader = new SocketReadStream(source_addr.c_str(), source_port);
 #endif
+    uint8 *prepared_memory = nullptr;
+    mvvm_prepare_frame frame{};
+    if (prepare && (!reader->read((char *)&frame, sizeof(frame)) || frame.magic != MVVM_PREPARE_MAGIC ||
+                    frame.version != MVVM_PREPARE_VERSION)) {
+        SPDLOG_ERROR("bad prepare frame");
+        exit(EXIT_FAILURE);
+    }
+    // fault the memory in while the snapshot streams in, on the same host it comes mapped already
+    std::thread preparer;
+    if (prepare && unix_path.empty())
+        preparer = std::thread([&] { prepared_memory = prepare_memory(frame.memory_bytes, heap_size.get()); });
+    int memory_fd = -1;
+    std::map<int, int> adopted_fds;
+#if !defined(_WIN32)
+    if (auto unix_reader = dynamic_cast<UnixReadStream *>(reader)) {
+        std::vector<std::pair<int32_t, int>> fds;
+        if (!unix_reader->recv_fds(fds)) {
+            SPDLOG_ERROR("failed to receive the fds {}", errno);
+            exit(EXIT_FAILURE);
+        }
+        for (auto [guest_fd, host_fd] : fds) {
+            if (guest_fd == MVVM_FD_MEMORY)
+                memory_fd = host_fd;
+            else
+                adopted_fds[guest_fd] = host_fd;
+        }
+        if (memory_fd != -1 && !(prepared_memory = map_memfd(memory_fd))) {
+            SPDLOG_ERROR("failed to map the memfd {}", errno);
+            exit(EXIT_FAILURE);
+        }
+        SPDLOG_DEBUG("adopted {} fds from the source", fds.size());
+    }
+#endif
+    mvvm_snapshot_header header{};
+    if (!reader->read((char *)&header, sizeof(header)) || header.magic != MVVM_SNAPSHOT_MAGIC ||
+        header.version != MVVM_SNAPSHOT_VERSION) {
+        SPDLOG_ERROR("not a snapshot of version {}, got {:#x} version {}", MVVM_SNAPSHOT_VERSION, header.magic,
+                     header.version);
+        exit(EXIT_FAILURE);
+    }
     auto a = struct_pack::deserialize<std::vector<std::unique_ptr<WAMRExecEnv>>>(*reader).value();
-    if (offload_addr.empty())
+    if (preparer.joinable())
+        preparer.join();
+    // the memory trailer is the bulk of the stream, read it into place while the module may still be instantiating
+    std::map<const WAMRMemoryInstance *, std::pair<uint8 *, uint8 *>> loaded_memory;
+    for (auto &env : a) {
+        for (auto &memory : env->module_inst.memories) {
+            bool adopted = memory_fd != -1 && prepared_memory;
+            loaded_memory[&memory] =
+                memory.load_data(std::exchange(prepared_memory, nullptr), adopted, heap_size.get(), a.size());
+        }
+    }
+    loader.join();
+    // the runtime was initialized on the loader thread
+    if (!wasm_runtime_thread_env_inited() && !wasm_runtime_init_thread_env()) {
+        SPDLOG_ERROR("failed to init the thread env");
+        exit(EXIT_FAILURE);
+    }
+    // so was the exec env, its handle and native stack bounds are the loader's, which is gone, and it runs here
+    wasm_exec_env_set_thread_info(wamr->exec_env);
+    wamr->prepared_memory = prepared_memory;
+    wamr->loaded_memory = std::move(loaded_memory);
+    wamr->memory_fd = memory_fd;
+    wamr->adopted_fds_ = std::move(adopted_fds);
+    wamr->demote_advice = demote_advice;
+    wamr->demote_after = demote_after;
+    wamr->journal_spill = journal_spill;
+    wamr->hot_window = hot_window;
+    if (hot_window)
+        wamr->start_hot_sampler();
+    if (offload_addr.empty()) {
+#if !defined(_WIN32)
+        // the memory trailer is still to be read from this file, so the next snapshot goes to a new one instead of
+        // truncating it, which is what restoring a hibernated instance that may hibernate again comes down to
+        if (dynamic_cast<FreadStream *>(reader))
+            unlink((removeExtension(target) + ".bin").c_str());
+#endif
         writer = new FwriteStream((removeExtension(target) + ".bin").c_str());
+    }
 #if !defined(_WIN32)
 #if __linux__
     else if(rdma)
@@ -85,54 +239,33 @@ int main(int argc, char **argv) {
 #endif
     else
         writer = new SocketWriteStream(offload_addr.c_str(), offload_port);
+    // the gateway knows the instance by the session it had before the checkpoint
+    wamr->gateway.session = a[a.size() - 1]->module_inst.wasi_ctx.gateway_session;
     // is server for all and the is server?
-    if (!a[a.size() - 1]
-             ->module_inst.wasi_ctx.socket_fd_map.empty()) { // new ip, old ip // only if tcp requires keepalive
+    // new ip, old ip // only if tcp requires keepalive, repaired connections need no gateway
+    if (std::ranges::any_of(a[a.size() - 1]->module_inst.wasi_ctx.socket_fd_map,
+                            [](auto &sock) { return !sock.second.tcp_repair.valid; })) {
         // tell gateway to stop keep alive the server
-        struct sockaddr_in addr {};
-        int fd = 0;
-        bool is_tcp_server;
+        bool is_tcp_server = false;
         SocketAddrPool src_addr = wamr->local_addr;
         SPDLOG_DEBUG("new ip {}.{}.{}.{}:{}", src_addr.ip4[0], src_addr.ip4[1], src_addr.ip4[2], src_addr.ip4[3],
                      src_addr.port);
         // got from wamr
         for (auto &[_, socketMetaData] : a[a.size() - 1]->module_inst.wasi_ctx.socket_fd_map) {
+            if (socketMetaData.tcp_repair.valid)
+                continue;
             wamr->op_data.is_tcp |= socketMetaData.type;
             is_tcp_server |= socketMetaData.is_server;
         }
         is_tcp_server &= wamr->op_data.is_tcp;
 
         wamr->op_data.op = is_tcp_server ? MVVM_SOCK_RESUME_TCP_SERVER : MVVM_SOCK_RESUME;
-        wamr->op_data.addr[0][0] = src_addr;
-
-        // Create a socket
-        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-            SPDLOG_ERROR("socket error");
-            throw std::runtime_error("socket error");
-        }
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(MVVM_SOCK_PORT);
-
-        // Convert IPv4 and IPv6 addresses from text to binary form
-        if (inet_pton(AF_INET, MVVM_SOCK_ADDR, &addr.sin_addr) <= 0) {
-            SPDLOG_ERROR("Invalid address/ Address not supported");
-            exit(EXIT_FAILURE);
-        }
-
-        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-            SPDLOG_ERROR("Connection Failed {}", errno);
+        if (!wamr->gateway.send(wamr->op_data.op, wamr->op_data.is_tcp, {{src_addr, {}}}))
             exit(EXIT_FAILURE);
-        }
-        // send the fd
-
-        if (send(fd, &wamr->op_data, sizeof(struct mvvm_op_data), 0) == -1) {
-            SPDLOG_ERROR("Send Error");
-            exit(EXIT_FAILURE);
-        }
-        close(fd);
-        SPDLOG_ERROR("sent the resume signal");
+        SPDLOG_INFO("sent the resume signal");
     }
 #endif
+    wamr->idle.start(idle_timeout, target, max_threads);
     // get current time
     auto start = std::chrono::high_resolution_clock::now();
     // do iptables here
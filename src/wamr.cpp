@@ -13,6 +13,8 @@
 #include "wamr.h"
 #include "platform_api_vmcore.h"
 #include "platform_common.h"
+#include "platform_wasi_types.h"
+#include "wamr_blocking.h"
 #include "wamr_export.h"
 #include "wamr_native.h"
 #include "wamr_read_write.h"
@@ -25,9 +27,17 @@
 #include <regex>
 #include <semaphore>
 #include <spdlog/spdlog.h>
+#include <unordered_set>
+#include <utility>
 #if WASM_ENABLE_LIB_PTHREAD != 0
 #include "thread_manager.h"
 #endif
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include "platform_wasi_types.h"
+// libc-wasi, installs a host fd at a given number
+extern "C" bool fd_table_insert_existing(struct fd_table *ft, __wasi_fd_t in, os_file_handle out, bool is_stdio);
+#endif
 #if defined(__linux__)
 #include <unistd.h>
 #elif defined(__APPLE__)
@@ -39,8 +49,6 @@
 #endif
 
 WAMRInstance::ThreadArgs **argptr;
-std::counting_semaphore<100> wakeup(0);
-std::counting_semaphore<100> thread_init(0);
 extern WriteStream *writer;
 extern std::vector<std::unique_ptr<WAMRExecEnv>> as;
 
@@ -65,7 +73,8 @@ static auto string_vec_to_cstr_array = [](const std::vector<std::string> &vecStr
     return cstrArray;
 };
 
-WAMRInstance::WAMRInstance(const char *wasm_path, bool is_jit, std::string policy) : is_jit(is_jit), policy(policy) {
+WAMRInstance::WAMRInstance(const char *wasm_path, bool is_jit, std::string policy, uint32 max_threads)
+    : is_jit(is_jit), policy(policy) {
     {
         std::string path(wasm_path);
 
@@ -90,7 +99,12 @@ WAMRInstance::WAMRInstance(const char *wasm_path, bool is_jit, std::string polic
     wasm_args.mem_alloc_option.allocator.malloc_func = ((void *)malloc);
     wasm_args.mem_alloc_option.allocator.realloc_func = ((void *)realloc);
     wasm_args.mem_alloc_option.allocator.free_func = ((void *)free);
-    wasm_args.max_thread_num = 16;
+    if (max_threads > MVVM_MAX_THREADS) {
+        SPDLOG_ERROR("max threads {} exceeds {}", max_threads, MVVM_MAX_THREADS);
+        throw;
+    }
+    // the aux stack is split by this, so restore has to use the value the checkpoint ran with
+    wasm_args.max_thread_num = max_threads;
     if (!is_jit)
         wasm_args.running_mode = RunningMode::Mode_Interp;
     else
@@ -105,6 +119,7 @@ WAMRInstance::WAMRInstance(const char *wasm_path, bool is_jit, std::string polic
         throw;
     }
     // initialiseWAMRNatives();
+    register_interruptible_wasi();
     char *buffer{};
     if (!load_wasm_binary(wasm_path, &buffer)) {
         SPDLOG_ERROR("Load wasm binary failed.\n");
@@ -190,30 +205,32 @@ WAMRInstance::~WAMRInstance() {
     wasm_runtime_destroy();
 }
 void WAMRInstance::find_func(const char *name) {
+    if (func_index_inst_ != module_inst) {
+        func_index_.clear();
+        func_index_inst_ = module_inst;
+    }
+    if (auto it = func_index_.find(name); it != func_index_.end()) {
+        func = it->second;
+        return;
+    }
     if (!(func = wasm_runtime_lookup_function(module_inst, name, nullptr))) {
-        SPDLOG_ERROR("The wasi\"{}\"function is not found.", name);
+        // not exported, index every function by name in one pass and look it up there
         auto target_module = get_module_instance()->e;
         for (int i = 0; i < target_module->function_count; i++) {
             auto cur_func = &target_module->functions[i];
-            if (cur_func->is_import_func) {
-                SPDLOG_DEBUG("{} {}", cur_func->u.func_import->field_name, i);
-
-                if (!strcmp(cur_func->u.func_import->field_name, name)) {
-
-                    func = ((WASMFunctionInstanceCommon *)cur_func);
-                    break;
-                }
-
-            } else {
-                SPDLOG_DEBUG("{} {}", cur_func->u.func->field_name, i);
-
-                if (!strcmp(cur_func->u.func->field_name, name)) {
-                    func = ((WASMFunctionInstanceCommon *)cur_func);
-                    break;
-                }
-            }
+            auto field_name =
+                cur_func->is_import_func ? cur_func->u.func_import->field_name : cur_func->u.func->field_name;
+            if (field_name)
+                func_index_.try_emplace(field_name, (WASMFunctionInstanceCommon *)cur_func);
+        }
+        if (auto it = func_index_.find(name); it != func_index_.end()) {
+            func = it->second;
+        } else {
+            SPDLOG_ERROR("The wasi\"{}\"function is not found.", name);
+            return;
         }
     }
+    func_index_[name] = func;
 }
 int WAMRInstance::invoke_main() {
     if (!(func = wasm_runtime_lookup_wasi_start_function(module_inst))) {
@@ -231,6 +248,152 @@ void WAMRInstance::invoke_init_c() {
         wasm_runtime_call_wasm(exec_env, func, 0, nullptr);
     }
 }
+#if !defined(_WIN32)
+/**
+ * A guest path as the host sees it, through the preopen it resolves under: a dir entry as it is or the host side of
+ * a "guest::host" map_dir entry, the longest one that is a whole path prefix. Relative paths resolve against the
+ * relative preopens, as wasi-libc does, not the process cwd. Empty if no preopen covers the path.
+ */
+static std::string map_host_path(const std::vector<const char *> &dir, const std::vector<const char *> &map_dir,
+                                 const std::string &path) {
+    // "./a" and "a" are the same guest path, and "." the preopen for either
+    auto normalize = [](std::string_view p) {
+        while (p.starts_with("./"))
+            p.remove_prefix(2);
+        if (p == ".")
+            p = {};
+        while (p.size() > 1 && p.ends_with('/'))
+            p.remove_suffix(1);
+        return p;
+    };
+    auto guest = normalize(path);
+    std::string_view best_guest, best_host;
+    bool found = false;
+    auto consider = [&](std::string_view preopen, std::string_view host) {
+        auto g = normalize(preopen);
+        if (g.starts_with('/') != guest.starts_with('/') || !guest.starts_with(g))
+            return;
+        // "/data" covers "/data/x" but not "/database"
+        if (!g.empty() && g != "/" && guest.size() > g.size() && guest[g.size()] != '/')
+            return;
+        if (!found || g.size() > best_guest.size()) {
+            best_guest = g;
+            best_host = host;
+            found = true;
+        }
+    };
+    for (auto d : dir)
+        consider(d, d);
+    for (auto mapping : map_dir) {
+        std::string_view map(mapping);
+        if (auto sep = map.find("::"); sep != std::string_view::npos)
+            consider(map.substr(0, sep), map.substr(sep + 2));
+    }
+    if (!found)
+        return {};
+    auto rest = guest.substr(best_guest.size());
+    while (rest.starts_with('/'))
+        rest.remove_prefix(1);
+    return rest.empty() ? std::string(best_host) : (std::filesystem::path(best_host) / rest).string();
+}
+#endif
+bool WAMRInstance::restore_fd(uint32 fd, const std::string &path, const WAMRFdTable::fd_ops &ops) {
+#if !defined(_WIN32)
+    auto wasi_ctx = wasm_runtime_get_wasi_ctx(module_inst);
+    if (!wasi_ctx || !wasi_ctx->curfds)
+        return false;
+    // only what a compacted snapshot holds, anything else is replayed through the guest
+    for (auto [flags, offset, op] : ops)
+        if (op != MVVM_FOPEN && op != MVVM_FSEEK)
+            return false;
+    auto host_path = map_host_path(dir_, map_dir_, path);
+    if (host_path.empty()) {
+        SPDLOG_DEBUG("no preopen covers {}", path);
+        return false;
+    }
+    // the oflags the guest opened with, less O_TRUNC and O_EXCL which would undo what it wrote or fail on the file
+    // it created, and a file that is gone is left to invoke_fopen
+    int oflags = 0;
+    for (auto [flags, offset, op] : ops) {
+        if (op != MVVM_FOPEN)
+            continue;
+        if (flags & __WASI_O_CREAT)
+            oflags |= O_CREAT;
+        if (flags & __WASI_O_DIRECTORY)
+            oflags |= O_DIRECTORY;
+    }
+    int host_fd = open(host_path.c_str(), O_RDWR | oflags, 0644);
+    if (host_fd == -1 && (errno == EACCES || errno == EISDIR || errno == EROFS))
+        host_fd = open(host_path.c_str(), O_RDONLY | oflags);
+    if (host_fd == -1) {
+        SPDLOG_DEBUG("native reopen of {} failed {}", host_path, errno);
+        return false;
+    }
+    for (auto [flags, offset, op] : ops) {
+        if (op == MVVM_FSEEK && lseek(host_fd, offset, flags) == -1) {
+            SPDLOG_DEBUG("native seek of {} failed {}", host_path, errno);
+            close(host_fd);
+            return false;
+        }
+    }
+    if (!fd_table_insert_existing(wasi_ctx->curfds, fd, host_fd, false)) {
+        close(host_fd);
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+bool WAMRInstance::adopt_fd(uint32 fd) {
+#if !defined(_WIN32)
+    auto it = adopted_fds_.find(fd);
+    if (it == adopted_fds_.end())
+        return false;
+    auto host_fd = it->second;
+    adopted_fds_.erase(it);
+    auto wasi_ctx = wasm_runtime_get_wasi_ctx(module_inst);
+    if (!wasi_ctx || !wasi_ctx->curfds || !fd_table_insert_existing(wasi_ctx->curfds, fd, host_fd, false)) {
+        close(host_fd);
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+std::vector<std::pair<int32_t, int>> WAMRInstance::live_fds() {
+    std::vector<std::pair<int32_t, int>> fds;
+#if __linux__
+    if (memory_fd != -1)
+        fds.emplace_back(MVVM_FD_MEMORY, memory_fd);
+    // libc-wasi keeps the guest to host mapping to itself, so go by what the host fds point at and leave anything
+    // ambiguous to be reopened
+    std::map<std::string, int> by_target;
+    for (auto &entry : std::filesystem::directory_iterator("/proc/self/fd")) {
+        std::error_code ec;
+        auto target = std::filesystem::read_symlink(entry.path(), ec);
+        if (ec)
+            continue;
+        auto [it, fresh] = by_target.emplace(target.string(), std::stoi(entry.path().filename().string()));
+        if (!fresh)
+            it->second = -1;
+    }
+    for (auto &[fd, res] : fd_table_.compact()) {
+        std::error_code ec;
+        auto host_path = map_host_path(dir_, map_dir_, std::get<0>(res));
+        if (host_path.empty())
+            continue;
+        auto target = std::filesystem::weakly_canonical(host_path, ec);
+        if (auto it = by_target.find(target.string()); !ec && it != by_target.end() && it->second != -1)
+            fds.emplace_back(fd, it->second);
+    }
+    for (auto &[fd, socketMetaData] : socket_fd_map_)
+        if (auto host_fd = host_sock_fd(socketMetaData, op_data.is_tcp); host_fd != -1)
+            fds.emplace_back(fd, host_fd);
+#endif
+    return fds;
+}
 int WAMRInstance::invoke_fopen(std::string &path, uint32 option) {
     char *buffer_ = nullptr;
     uint32_t buffer_for_wasm;
@@ -323,10 +486,11 @@ int WAMRInstance::invoke_sock_getsockname(uint32_t sockfd, struct sockaddr **soc
     }
     return -1;
 }
-int WAMRInstance::invoke_fseek(uint32 fd, uint32 flags, uint32 offset) {
+int WAMRInstance::invoke_fseek(uint32 fd, uint32 flags, int64 offset) {
     // return 0;
     find_func("__wasi_fd_seek");
-    uint32 argv[5] = {fd, offset, 0, flags, 0};
+    // the offset is an i64, low word first
+    uint32 argv[5] = {fd, (uint32)offset, (uint32)((uint64)offset >> 32), flags, 0};
     auto res = wasm_runtime_call_wasm(exec_env, func, 5, argv);
     return argv[0];
 }
@@ -425,37 +589,68 @@ void restart_execution(uint32 id) {
                                    targs->exec_env->cur_frame->function, targs->exec_env->cur_frame->prev_frame);
 }
 #if WASM_ENABLE_LIB_PTHREAD != 0
+// no longer used for replay, kept as the runtime still links against them
 extern "C" {
 korp_mutex syncop_mutex;
 korp_cond syncop_cv;
 }
 void WAMRInstance::replay_sync_ops(bool main, wasm_exec_env_t exec_env) {
     if (main) {
-        std::map<uint32, uint32> ref_map = {};
-        for (auto &i : sync_ops) {
+        sync_queue.clear();
+        sync_turn.clear();
+        sync_blocking.assign(sync_ops.size(), false);
+        std::unordered_map<uint32, uint64> owner;
+        for (auto [idx, i] : sync_ops | enumerate) {
             // remap to new tids so that if we reserialize it'll be correct
-            i.tid = tid_map[i.tid];
-            if (ref_map.find(i.ref) != ref_map.end()) {
-                pthread_mutex_init_wrapper(exec_env, &i.ref, nullptr);
-                ref_map[i.ref] = i.tid;
+            if (auto t = tid_map.find(i.tid); t != tid_map.end())
+                i.tid = t->second;
+            sync_queue[i.tid].push_back(idx);
+            if (!sync_turn.contains(i.tid))
+                sync_turn[i.tid] = std::make_unique<std::counting_semaphore<>>(0);
+            if (i.sync_op == SYNC_OP_MUTEX_LOCK) {
+                // a woken cond waiter goes after a mutex that is someone else's until they let go of it
+                auto [o, fresh] = owner.try_emplace(i.ref, i.tid);
+                sync_blocking[idx] = !fresh && o->second != i.tid;
+            } else {
+                sync_blocking[idx] = i.sync_op == SYNC_OP_COND_WAIT || i.sync_op == SYNC_OP_ATOMIC_WAIT;
             }
         }
-        // start from the beginning
-        sync_iter = sync_ops.begin();
-        thread_init.release(100);
+        sync_next = 0;
+        sync_done = sync_ops.empty();
+        sync_ready = true;
+        sync_ready.notify_all();
+        if (!sync_ops.empty() && sync_ops.front().tid != (uint64_t)exec_env->handle)
+            sync_turn[sync_ops.front().tid]->release();
     } else {
         // wait for remap to finish
-        thread_init.acquire();
-    }
-    // Actually replay
-    os_mutex_lock(&syncop_mutex);
-    while (sync_iter != sync_ops.end()) {
-        SPDLOG_INFO("test {} == {}, op {}\n", (uint64_t)exec_env->handle, (uint64_t)sync_iter->tid,
-                    ((int)sync_iter->sync_op));
-        if (((uint64_t)(*sync_iter).tid) == ((uint64_t)exec_env->handle)) {
-            SPDLOG_INFO("replay {}, op {}\n", sync_iter->tid, ((int)sync_iter->sync_op));
-            auto mysync = sync_iter;
-            ++sync_iter;
+        sync_ready.wait(false);
+    }
+    auto tid = (uint64_t)exec_env->handle;
+    // hand the list over to the owner of the next op, nobody polls, and nobody needs waking if it's ours
+    auto hand_off = [this, tid](size_t next) {
+        sync_next = next;
+        if (next == sync_ops.size()) {
+            sync_done = true;
+            sync_done.notify_all();
+        } else if (sync_ops[next].tid != tid) {
+            sync_turn[sync_ops[next].tid]->release();
+        }
+    };
+    if (auto q = sync_queue.find(tid); q != sync_queue.end()) {
+        auto &turn = *sync_turn[tid];
+        for (auto idx : q->second) {
+            while (sync_next.load() != idx)
+                turn.acquire();
+            auto mysync = &sync_ops[idx];
+            SPDLOG_DEBUG("replay {}, op {}", mysync->tid, ((int)mysync->sync_op));
+            // a wait only returns once somebody else has run, so pass the turn on before blocking, a cond waiter
+            // takes its mutex first and the next one to lock it gets it once the wait has let go of it
+            bool blocking = sync_blocking[idx];
+            uint32 cond_mutex = mysync->expected;
+            if (mysync->sync_op == SYNC_OP_COND_WAIT)
+                pthread_mutex_lock_wrapper(exec_env, &cond_mutex);
+            if (blocking)
+                hand_off(idx + 1);
             // do op
             switch (mysync->sync_op) {
             case SYNC_OP_MUTEX_LOCK:
@@ -465,7 +660,7 @@ void WAMRInstance::replay_sync_ops(bool main, wasm_exec_env_t exec_env) {
                 pthread_mutex_unlock_wrapper(exec_env, &(mysync->ref));
                 break;
             case SYNC_OP_COND_WAIT:
-                pthread_cond_wait_wrapper(exec_env, &(mysync->ref), nullptr);
+                pthread_cond_wait_wrapper(exec_env, &(mysync->ref), &cond_mutex);
                 break;
             case SYNC_OP_COND_SIGNAL:
                 pthread_cond_signal_wrapper(exec_env, &(mysync->ref));
@@ -482,17 +677,17 @@ void WAMRInstance::replay_sync_ops(bool main, wasm_exec_env_t exec_env) {
             case SYNC_OP_ATOMIC_NOTIFY:
                 break;
             }
-            // wakeup everyone
-            os_cond_signal(&syncop_cv);
-        } else {
-            os_cond_reltimedwait(&syncop_cv, &syncop_mutex, 10);
+            if (!blocking)
+                hand_off(idx + 1);
         }
     }
-    os_mutex_unlock(&syncop_mutex);
+    // nobody runs guest code before every lock is back with its owner
+    sync_done.wait(false);
 }
 // End Sync Op Specific Stuff
 #endif
-WAMRExecEnv *child_env;
+// the child the calling thread is spawning, restore_env runs on the spawner's thread
+static thread_local WAMRExecEnv *child_env;
 // will call pthread create wrapper if needed?
 void WAMRInstance::recover(std::vector<std::unique_ptr<WAMRExecEnv>> *e_) {
     execEnv.reserve(e_->size());
@@ -504,7 +699,11 @@ void WAMRInstance::recover(std::vector<std::unique_ptr<WAMRExecEnv>> *e_) {
         return a->frames.back()->function_index < b->frames.back()->function_index;
     });
 
+    // a slot per thread, indexed like execEnv, so that concurrent spawners never share one
+    thread_args.assign(execEnv.size(), ThreadArgs{});
     argptr = (ThreadArgs **)malloc(sizeof(void *) * execEnv.size());
+    for (size_t i = 0; i < execEnv.size(); i++)
+        argptr[i] = &thread_args[i];
     set_wasi_args(execEnv.front()->module_inst.wasi_ctx);
 
     this->time = std::chrono::high_resolution_clock::now();
@@ -535,7 +734,8 @@ void WAMRInstance::recover(std::vector<std::unique_ptr<WAMRExecEnv>> *e_) {
 
         fprintf(stderr, "invoke_init_c\n");
         fprintf(stderr, "wakeup.release\n");
-        wakeup.release(100);
+        restore_go = true;
+        restore_go.notify_all();
 
 #if WASM_ENABLE_LIB_PTHREAD != 0
         SPDLOG_ERROR("no impl");
@@ -560,24 +760,16 @@ void WAMRInstance::recover(std::vector<std::unique_ptr<WAMRExecEnv>> *e_) {
 
 #if WASM_ENABLE_LIB_PTHREAD != 0
 void WAMRInstance::spawn_child(WASMExecEnv *cur_env, bool main) {
-    static std::vector<WAMRExecEnv *>::iterator iter;
-    static uint64 parent;
+    uint64 self = 0;
     if (main) {
-        iter = ++(execEnv.begin());
-        parent = 0;
-    }
-    //  Each thread needs it's own thread arg
-    auto thread_arg = ThreadArgs{cur_env};
-    static std::mutex mtx;
-    static std::condition_variable cv;
-    std::unique_lock ul(mtx);
-
-    while (iter != execEnv.end()) {
-        // Get parent's virtual TID from child's OS TID
-        if (parent == 0) {
-            child_env = *iter;
-            parent = child_env->cur_count;
-            if (tid_start_arg_map.find(child_env->cur_count) != tid_start_arg_map.end()) {
+        // work out every child's parent once, keyed by the tid it had at checkpoint
+        std::unordered_set<uint64> known;
+        for (auto e : execEnv)
+            known.insert(e->cur_count);
+        restore_children.clear();
+        for (auto it = ++(execEnv.begin()); it != execEnv.end(); ++it) {
+            uint64 parent = (*it)->cur_count;
+            if (tid_start_arg_map.find(parent) != tid_start_arg_map.end()) {
                 parent = tid_start_arg_map[parent].second;
             }
             parent = child_tid_map[parent];
@@ -587,42 +779,52 @@ void WAMRInstance::spawn_child(WASMExecEnv *cur_env, bool main) {
                     break;
                 }
             }
-            SPDLOG_ERROR("{} {}", parent, child_env->cur_count);
-        } // calculate parent TID once
-        if (parent != ((uint64_t)cur_env->handle) && (parent != !main)) {
-            cv.wait(ul);
-            continue;
+            // anything we cannot place is the main thread's
+            if (!known.contains(parent) || parent == execEnv.front()->cur_count || parent == (*it)->cur_count)
+                parent = 0;
+            SPDLOG_DEBUG("parent {} child {}", parent, (*it)->cur_count);
+            restore_children[parent].push_back(*it);
         }
-        // requires to record the args and callback for the pthread.
-        argptr[id] = &thread_arg;
-        // restart thread execution
-        SPDLOG_DEBUG("pthread_create_wrapper, func {}\n", child_env->cur_count);
-        // module_inst = wasm_runtime_instantiate(module, stack_size, heap_size, error_buf, sizeof(error_buf));
-        if (tid_start_arg_map.find(child_env->cur_count) != tid_start_arg_map.end()) {
-            SPDLOG_ERROR("no impl");
-            exit(-1);
-            // find the parent env
-            auto saved_call_chain_size = cur_env->call_chain_size;
-            auto saved_stack_size = cur_env->wasm_stack.top_boundary - cur_env->wasm_stack.bottom;
-            auto saved_stack = (char *)malloc(saved_stack_size);
-            memcpy(saved_stack, cur_env->wasm_stack.bottom, saved_stack_size);
-            exec_env->is_restore = true;
-            // main thread
-            thread_spawn_wrapper(cur_env, tid_start_arg_map[child_env->cur_count].first);
-            cur_env->call_chain_size = saved_call_chain_size;
-            memcpy(cur_env->wasm_stack.bottom, saved_stack, saved_stack_size);
-            free(saved_stack);
-        } else {
-            exec_env->is_restore = true;
-            pthread_create_wrapper(cur_env, nullptr, nullptr, id, id); // tid_map
+        restore_latch = std::make_unique<std::latch>(execEnv.size() - 1);
+    } else {
+        std::shared_lock sl(tid_mtx);
+        self = restored_envs.at(cur_env)->cur_count;
+    }
+    // spawn all of our children back to back, they restore their own subtrees concurrently
+    if (auto c = restore_children.find(self); c != restore_children.end()) {
+        for (auto child : c->second) {
+            child_env = child;
+            // requires to record the args and callback for the pthread, in the child's own slot as other threads
+            // spawn at the same time and we don't wait for the child to pick them up
+            auto slot = (uint32)(std::find(execEnv.begin(), execEnv.end(), child) - execEnv.begin());
+            thread_args[slot] = ThreadArgs{cur_env};
+            // restart thread execution
+            SPDLOG_DEBUG("pthread_create_wrapper, func {}", child_env->cur_count);
+            if (tid_start_arg_map.find(child_env->cur_count) != tid_start_arg_map.end()) {
+                SPDLOG_ERROR("no impl");
+                exit(-1);
+                // find the parent env
+                auto saved_call_chain_size = cur_env->call_chain_size;
+                auto saved_stack_size = cur_env->wasm_stack.top_boundary - cur_env->wasm_stack.bottom;
+                auto saved_stack = (char *)malloc(saved_stack_size);
+                memcpy(saved_stack, cur_env->wasm_stack.bottom, saved_stack_size);
+                cur_env->is_restore = true;
+                // main thread
+                thread_spawn_wrapper(cur_env, tid_start_arg_map[child_env->cur_count].first);
+                cur_env->call_chain_size = saved_call_chain_size;
+                memcpy(cur_env->wasm_stack.bottom, saved_stack, saved_stack_size);
+                free(saved_stack);
+            } else {
+                // our own env, the shared one is written by every spawner at once
+                cur_env->is_restore = true;
+                pthread_create_wrapper(cur_env, nullptr, nullptr, id, slot); // tid_map
+            }
+            SPDLOG_DEBUG("child spawned {} {}", fmt::ptr(cur_env), fmt::ptr(child_env));
         }
-        fprintf(stderr, "child spawned %p %p\n\n", cur_env, child_env);
-        // sleep(1);
-        thread_init.acquire();
-        // advance ptr
-        ++iter;
-        parent = 0;
-        cv.notify_all();
+    }
+    if (main) {
+        // every thread has counted down once its own subtree is on the way
+        restore_latch->wait();
     }
 }
 #endif
@@ -655,10 +857,12 @@ extern WAMRInstance *wamr;
 extern "C" { // stop name mangling so it can be linked externally
 void wamr_wait(wasm_exec_env_t exec_env) {
     SPDLOG_DEBUG("child getting ready to wait {}", fmt::ptr(exec_env));
-    thread_init.release(1);
+#if WASM_ENABLE_LIB_PTHREAD != 0
     wamr->spawn_child(exec_env, false);
+    wamr->restore_latch->count_down();
+#endif
     SPDLOG_DEBUG("finish child restore");
-    wakeup.acquire();
+    wamr->restore_go.wait(false);
 #if WASM_ENABLE_LIB_PTHREAD != 0
     SPDLOG_DEBUG("go child!! {}", ((uint64_t)exec_env->handle));
     wamr->replay_sync_ops(false, exec_env);
@@ -680,6 +884,10 @@ void wamr_wait(wasm_exec_env_t exec_env) {
 WASMExecEnv *restore_env(WASMModuleInstanceCommon *module_inst) {
     auto exec_env = wasm_exec_env_create_internal(module_inst, wamr->stack_size);
     restore(child_env, exec_env);
+    {
+        std::unique_lock ul(wamr->tid_mtx);
+        wamr->restored_envs[exec_env] = child_env;
+    }
 
     wamr->cur_thread = ((uint64_t)exec_env->handle);
     exec_env->is_restore = true;
@@ -695,6 +903,153 @@ void WAMRInstance::instantiate() {
         throw;
     }
     cur_env = exec_env = wasm_runtime_create_exec_env(module_inst, stack_size);
+    if (same_host) {
+        auto inst = get_module_instance();
+        if (inst->memory_count) {
+            auto mem = inst->memories[0];
+            // memory.grow would commit pages outside the memfd or realloc the memory away from it, only memory that
+            // is allocated at its max from the start (shared memory) stays where the restore side maps it
+            if (mem->memory_data_size < (uint64)mem->max_page_count * mem->num_bytes_per_page) {
+                SPDLOG_ERROR("same host migration needs memory that can't grow, {} of {} pages allocated",
+                             mem->memory_data_size / mem->num_bytes_per_page, mem->max_page_count);
+                exit(EXIT_FAILURE);
+            }
+            memory_fd = memfd_back_memory(mem->memory_data, mem->memory_data_size);
+            if (memory_fd == -1) {
+                SPDLOG_ERROR("same host migration needs linear memory on a memfd");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+void WAMRInstance::prepare_destination() {
+    std::lock_guard lock(prepare_mtx);
+    if (!send_prepare || std::exchange(prepare_sent, true))
+        return;
+    mvvm_prepare_frame frame{.magic = MVVM_PREPARE_MAGIC, .version = MVVM_PREPARE_VERSION, .memory_bytes = 0};
+    auto inst = get_module_instance();
+    if (inst->memory_count)
+        frame.memory_bytes = (uint64)inst->memories[0]->cur_page_count * inst->memories[0]->num_bytes_per_page;
+    if (!writer->write((const char *)&frame, sizeof(frame)))
+        SPDLOG_ERROR("failed to send the prepare frame");
+    SPDLOG_DEBUG("sent prepare frame, {} bytes of memory", frame.memory_bytes);
+}
+void WAMRInstance::start_preparer() {
+#if !defined(_WIN32)
+    if (sem_init(&prepare_sem, 0, 0) != 0) {
+        SPDLOG_ERROR("prepare sem_init failed {}", errno);
+        exit(EXIT_FAILURE);
+    }
+    std::thread([this] {
+        while (sem_wait(&prepare_sem) == -1 && errno == EINTR)
+            ;
+        prepare_destination();
+    }).detach();
+#endif
+}
+void WAMRInstance::demote_cold_memory(uint8 *memory, size_t size, std::vector<uint32> hot_pages) {
+    if (!demote_advice)
+        return;
+    auto demote = [advice = demote_advice, memory, size](const std::vector<uint32> &hot) {
+        auto advised = demote_cold(memory, size, hot, advice);
+        SPDLOG_INFO("demoted {} MB cold, resident {} MB of {} MB virtual", advised >> 20,
+                    resident_bytes(memory, size) >> 20, size >> 20);
+    };
+    if (!demote_after) {
+        // without a recorded working set everything looks cold, leave it alone
+        if (hot_pages.empty())
+            SPDLOG_DEBUG("no hot pages in the snapshot, not demoting");
+        else
+            demote(hot_pages);
+        return;
+    }
+    // one window from resume, what gets written before the delay is up is the working set
+    clear_soft_dirty();
+    std::thread([demote, memory, size, delay = demote_after] {
+        std::this_thread::sleep_for(std::chrono::seconds(delay));
+        auto hot = soft_dirty_pages(memory, size);
+        if (hot.empty())
+            SPDLOG_DEBUG("no soft-dirty pages after {} s, not demoting", delay);
+        else
+            demote(hot);
+    }).detach();
+}
+void WAMRInstance::start_hot_sampler() {
+#if !defined(_WIN32)
+    if (sem_init(&hot_sem, 0, 0) != 0) {
+        SPDLOG_ERROR("hot sem_init failed {}", errno);
+        exit(EXIT_FAILURE);
+    }
+    std::thread([this] {
+        while (sem_wait(&hot_sem) == -1 && errno == EINTR)
+            ;
+        // clear_refs touches no guest state, and the bits are read once the guest is stopped to dump its memories
+        clear_soft_dirty();
+        hot_sampled = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(hot_window));
+        arm_checkpoint();
+    }).detach();
+#endif
+}
+void WAMRInstance::instantiate_for_restore() {
+    // memories come from the snapshot, so don't copy the active data segments in only to throw them away. Table
+    // elements and passive segments are not in the snapshot, those are still initialized. A start function may read
+    // what the active segments put in memory though, keep them for such modules.
+    std::vector<std::pair<uint32, bool *>> skipped;
+#if WASM_ENABLE_BULK_MEMORY != 0
+    // an active segment instantiates like a passive one, which is left alone until memory.init
+#if WASM_ENABLE_AOT != 0
+    if (is_aot) {
+        auto aot_module = (AOTModule *)module;
+        if (!aot_module->start_function)
+            for (uint32 i = 0; i < aot_module->mem_init_data_count; i++)
+                if (!aot_module->mem_init_data_list[i]->is_passive)
+                    skipped.emplace_back(i, &aot_module->mem_init_data_list[i]->is_passive);
+    } else
+#endif
+    {
+        auto wasm_module = (WASMModule *)module;
+        if (wasm_module->start_function == (uint32)-1)
+            for (uint32 i = 0; i < wasm_module->data_seg_count; i++)
+                if (!wasm_module->data_segments[i]->is_passive)
+                    skipped.emplace_back(i, &wasm_module->data_segments[i]->is_passive);
+    }
+    for (auto [i, is_passive] : skipped)
+        *is_passive = true;
+#else
+    // no passive segments nor a dropped bitmap to keep, so none need instantiating at all
+    uint32 *data_count = nullptr, saved_data_count = 0;
+#if WASM_ENABLE_AOT != 0
+    if (is_aot) {
+        if (!((AOTModule *)module)->start_function)
+            data_count = &((AOTModule *)module)->mem_init_data_count;
+    } else
+#endif
+    {
+        if (((WASMModule *)module)->start_function == (uint32)-1)
+            data_count = &((WASMModule *)module)->data_seg_count;
+    }
+    if (data_count)
+        saved_data_count = std::exchange(*data_count, 0);
+#endif
+    // the app heap is restored from the snapshot too, this one only serves the invoke_* calls during restore
+    auto saved_heap_size = std::exchange(heap_size, MVVM_RESTORE_HEAP_SIZE);
+    instantiate();
+    heap_size = saved_heap_size;
+#if WASM_ENABLE_BULK_MEMORY != 0
+    // back to active, and dropped as instantiation leaves an active segment that it did copy
+    auto data_dropped = ((WASMModuleInstance *)module_inst)->e->common.data_dropped;
+    for (auto [i, is_passive] : skipped) {
+        *is_passive = false;
+        if (data_dropped)
+            bh_bitmap_set_bit(data_dropped, i);
+    }
+    SPDLOG_DEBUG("instantiated for restore, skipped {} active data segments", skipped.size());
+#else
+    if (data_count)
+        *data_count = saved_data_count;
+    SPDLOG_DEBUG("instantiated for restore, skipped {} data segments", saved_data_count);
+#endif
 }
 
 bool is_ip_in_cidr(const char *base_ip, int subnet_mask_len, uint32_t ip) {
@@ -806,28 +1161,42 @@ long get_rss() {
 void serialize_to_file(WASMExecEnv *instance) {
     // gateway
     auto start = std::chrono::high_resolution_clock::now();
+    // a count triggered checkpoint never went through SIGINT, and either way the frame has to go ahead of the snapshot
+    wamr->prepare_destination();
 
 #if WASM_ENABLE_LIB_PTHREAD != 0
     auto cluster = wasm_exec_env_get_cluster(instance);
     auto all_count = bh_list_length(&cluster->exec_env_list);
     // fill vector
 
+    // push the lwcp hooks onto their slow path before we look at the counters
+    wamr->lwcp_pending = true;
     std::unique_lock as_ul(wamr->as_mtx);
     SPDLOG_DEBUG("get lock");
-    wamr->ready++;
-    wamr->lwcp_list[((uint64_t)instance->handle)]++;
-    if (wamr->ready == all_count) {
+    wamr->threads.local((uint64_t)instance->handle)->lwcp_depth.fetch_add(1);
+    auto ready = wamr->threads.lwcp_ready();
+    if (ready == all_count) {
         wamr->should_snapshot = true;
     }
     // If we're not all ready
-    SPDLOG_DEBUG("thread {}, with {} ready out of {} total", ((uint64_t)instance->handle), wamr->ready, all_count);
+    SPDLOG_DEBUG("thread {}, with {} ready out of {} total", ((uint64_t)instance->handle), ready, all_count);
+#endif
+#if __linux__
+    if (wamr->tcp_repair && wamr->should_snapshot) {
+        for (auto &[tmp_fd, sock_data] : wamr->socket_fd_map_) {
+            if (!sock_data.type) // udp
+                continue;
+            if (auto host_fd = host_sock_fd(sock_data, true);
+                host_fd == -1 || !tcp_repair_dump(host_fd, sock_data.tcp_repair))
+                SPDLOG_DEBUG("socket {} can't be repaired, it goes through the gateway", tmp_fd);
+        }
+    }
 #endif
 #if !defined(_WIN32)
-    if (!wamr->socket_fd_map_.empty() && wamr->should_snapshot) {
+    if (std::ranges::any_of(wamr->socket_fd_map_, [](auto &sock) { return !sock.second.tcp_repair.valid; }) &&
+        wamr->should_snapshot) {
         // tell gateway to keep alive the server
-        struct sockaddr_in addr {};
-        int fd = 0;
-        ssize_t rc;
+        std::vector<std::array<SocketAddrPool, 2>> addr;
         SocketAddrPool src_addr{};
         bool is_server = false;
         for (auto [tmp_fd, sock_data] : wamr->socket_fd_map_) {
@@ -837,9 +1206,15 @@ void serialize_to_file(WASMExecEnv *instance) {
             }
         }
         wamr->op_data.op = is_server ? MVVM_SOCK_SUSPEND_TCP_SERVER : MVVM_SOCK_SUSPEND;
+        // only a listening socket gives the gateway something to wake the instance up on
+        bool hibernate = wamr->idle.fired() && is_server && wamr->op_data.is_tcp;
+        if (wamr->idle.fired() && !hibernate)
+            SPDLOG_ERROR("not a tcp server, hibernating without the gateway waking it up");
 
         for (auto [tmp_fd, sock_data] : wamr->socket_fd_map_) {
-            int idx = wamr->op_data.size;
+            if (sock_data.tcp_repair.valid)
+                continue;
+            auto &pair = addr.emplace_back();
             src_addr = sock_data.socketAddress;
             auto tmp_ip4 =
                 fmt::format("{}.{}.{}.{}", src_addr.ip4[0], src_addr.ip4[1], src_addr.ip4[2], src_addr.ip4[3]);
@@ -852,6 +1227,7 @@ void serialize_to_file(WASMExecEnv *instance) {
             }
             SPDLOG_INFO("addr: {} {}.{}.{}.{}  port: {}", tmp_fd, src_addr.ip4[0], src_addr.ip4[1], src_addr.ip4[2],
                         src_addr.ip4[3], src_addr.port);
+            pair[0] = src_addr;
             // make the rest coroutine?
             tmp_ip4 = fmt::format("{}.{}.{}.{}", sock_data.socketSentToData.dest_addr.ip.ip4[0],
                                   sock_data.socketSentToData.dest_addr.ip.ip4[1],
@@ -867,19 +1243,17 @@ void serialize_to_file(WASMExecEnv *instance) {
                 if (!wamr->op_data.is_tcp) {
                     if (sock_data.socketSentToData.dest_addr.ip.is_4 && tmp_ip4 == "0.0.0.0" ||
                         !sock_data.socketSentToData.dest_addr.ip.is_4 && tmp_ip6 == "0:0:0:0:0:0:0:0") {
-                        wamr->op_data.addr[idx][1].is_4 = sock_data.socketRecvFromDatas[0].src_addr.ip.is_4;
-                        std::memcpy(wamr->op_data.addr[idx][1].ip4, sock_data.socketRecvFromDatas[0].src_addr.ip.ip4,
-                                    sizeof(sock_data.socketRecvFromDatas[0].src_addr.ip.ip4));
-                        std::memcpy(wamr->op_data.addr[idx][1].ip6, sock_data.socketRecvFromDatas[0].src_addr.ip.ip6,
-                                    sizeof(sock_data.socketRecvFromDatas[0].src_addr.ip.ip6));
-                        wamr->op_data.addr[idx][1].port = sock_data.socketRecvFromDatas[0].src_addr.port;
+                        pair[1].is_4 = sock_data.peer_addr.ip.is_4;
+                        std::memcpy(pair[1].ip4, sock_data.peer_addr.ip.ip4, sizeof(sock_data.peer_addr.ip.ip4));
+                        std::memcpy(pair[1].ip6, sock_data.peer_addr.ip.ip6, sizeof(sock_data.peer_addr.ip.ip6));
+                        pair[1].port = sock_data.peer_addr.port;
                     } else {
-                        wamr->op_data.addr[idx][1].is_4 = sock_data.socketSentToData.dest_addr.ip.is_4;
-                        std::memcpy(wamr->op_data.addr[idx][1].ip4, sock_data.socketSentToData.dest_addr.ip.ip4,
+                        pair[1].is_4 = sock_data.socketSentToData.dest_addr.ip.is_4;
+                        std::memcpy(pair[1].ip4, sock_data.socketSentToData.dest_addr.ip.ip4,
                                     sizeof(sock_data.socketSentToData.dest_addr.ip.ip4));
-                        std::memcpy(wamr->op_data.addr[idx][1].ip6, sock_data.socketSentToData.dest_addr.ip.ip6,
+                        std::memcpy(pair[1].ip6, sock_data.socketSentToData.dest_addr.ip.ip6,
                                     sizeof(sock_data.socketSentToData.dest_addr.ip.ip6));
-                        wamr->op_data.addr[idx][1].port = sock_data.socketSentToData.dest_addr.port;
+                        pair[1].port = sock_data.socketSentToData.dest_addr.port;
                     }
                 } else {
                     // if it's not socket
@@ -891,65 +1265,38 @@ void serialize_to_file(WASMExecEnv *instance) {
                         if (ss->sin_family == AF_INET) {
                             auto *ipv4 = (struct sockaddr_in *)ss;
                             uint32_t ip = ntohl(ipv4->sin_addr.s_addr);
-                            wamr->op_data.addr[idx][1].is_4 = true;
-                            wamr->op_data.addr[idx][1].ip4[0] = (ip >> 24) & 0xFF;
-                            wamr->op_data.addr[idx][1].ip4[1] = (ip >> 16) & 0xFF;
-                            wamr->op_data.addr[idx][1].ip4[2] = (ip >> 8) & 0xFF;
-                            wamr->op_data.addr[idx][1].ip4[3] = ip & 0xFF;
-                            wamr->op_data.addr[idx][1].port = ntohs(ipv4->sin_port);
+                            pair[1].is_4 = true;
+                            pair[1].ip4[0] = (ip >> 24) & 0xFF;
+                            pair[1].ip4[1] = (ip >> 16) & 0xFF;
+                            pair[1].ip4[2] = (ip >> 8) & 0xFF;
+                            pair[1].ip4[3] = ip & 0xFF;
+                            pair[1].port = ntohs(ipv4->sin_port);
                         } else {
                             auto *ipv6 = (struct sockaddr_in6 *)ss;
-                            wamr->op_data.addr[idx][1].is_4 = false;
+                            pair[1].is_4 = false;
                             const auto *bytes = (const uint8_t *)ipv6->sin6_addr.s6_addr;
                             for (int i = 0; i < 16; i += 2) {
-                                wamr->op_data.addr[idx][1].ip6[i / 2] = (bytes[i] << 8) + bytes[i + 1];
+                                pair[1].ip6[i / 2] = (bytes[i] << 8) + bytes[i + 1];
                             }
-                            wamr->op_data.addr[idx][1].port = ntohs(ipv6->sin6_port);
+                            pair[1].port = ntohs(ipv6->sin6_port);
                         }
                         free(ss);
                     } else if (sock_data.is_server) {
-                        wamr->op_data.size--;
+                        addr.pop_back();
+                        continue;
                     }
                 }
             }
-            SPDLOG_DEBUG("dest_addr: {}.{}.{}.{}:{}", wamr->op_data.addr[idx][1].ip4[0],
-                         wamr->op_data.addr[idx][1].ip4[1], wamr->op_data.addr[idx][1].ip4[2],
-                         wamr->op_data.addr[idx][1].ip4[3], wamr->op_data.addr[idx][1].port);
-            wamr->op_data.size += 1;
-        }
-        // Create a socket
-        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-            SPDLOG_ERROR("socket error");
-            throw std::runtime_error("socket error");
-        }
-
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(MVVM_SOCK_PORT);
-
-        // Convert IPv4 and IPv6 addresses from text to binary form
-        if (inet_pton(AF_INET, MVVM_SOCK_ADDR, &addr.sin_addr) <= 0) {
-            SPDLOG_ERROR("AF_INET not supported");
-            exit(EXIT_FAILURE);
+            SPDLOG_DEBUG("dest_addr: {}.{}.{}.{}:{}", pair[1].ip4[0], pair[1].ip4[1], pair[1].ip4[2], pair[1].ip4[3],
+                         pair[1].port);
         }
-        // Connect to the server
-        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-            SPDLOG_ERROR("Connection Failed {}", errno);
+        if (!(hibernate ? wamr->gateway.send(MVVM_SOCK_HIBERNATE, true, addr, wamr->idle.restore_data())
+                        : wamr->gateway.send(wamr->op_data.op, wamr->op_data.is_tcp, addr)))
             exit(EXIT_FAILURE);
-        }
-
-        SPDLOG_DEBUG("Connected successfully");
-        rc = send(fd, &wamr->op_data, sizeof(struct mvvm_op_data), 0);
-        if (rc == -1) {
-            SPDLOG_ERROR("send error");
-            exit(EXIT_FAILURE);
-        }
-
-        // Clean up
-        close(fd);
     }
 #endif
 #if WASM_ENABLE_LIB_PTHREAD != 0
-    if (wamr->ready < all_count) {
+    if (ready < all_count) {
         // Then wait for someone else to get here and finish the job
         std::condition_variable as_cv;
         as_cv.wait(as_ul);
@@ -973,7 +1320,11 @@ void serialize_to_file(WASMExecEnv *instance) {
     SPDLOG_INFO("Snapshot Overhead: {} s", dur1.count() / 1000000.0);
 #if __linux__
     if (dynamic_cast<RDMAWriteStream *>(writer)) {
-        auto buffer = struct_pack::serialize(as);
+        mvvm_snapshot_header header{.magic = MVVM_SNAPSHOT_MAGIC, .version = MVVM_SNAPSHOT_VERSION};
+        std::vector<char> buffer((const char *)&header, (const char *)&header + sizeof(header));
+        struct_pack::serialize_to(buffer, as);
+        for (auto [data, size] : wamr->snapshot_trailer)
+            buffer.insert(buffer.end(), (const char *)data, (const char *)data + size);
         ((RDMAWriteStream *)writer)->buffer = buffer;
         ((RDMAWriteStream *)writer)->position = buffer.size();
         SPDLOG_DEBUG("Snapshot size: {}\n", buffer.size());
@@ -981,7 +1332,28 @@ void serialize_to_file(WASMExecEnv *instance) {
 
     } else
 #endif
+    {
+#if !defined(_WIN32)
+        // same host, memory and the guest's fds go as they are ahead of the envs
+        if (auto unix_writer = dynamic_cast<UnixWriteStream *>(writer);
+            unix_writer && !unix_writer->send_fds(wamr->live_fds())) {
+            SPDLOG_ERROR("failed to hand over the fds {}", errno);
+            exit(EXIT_FAILURE);
+        }
+#endif
+        mvvm_snapshot_header header{.magic = MVVM_SNAPSHOT_MAGIC, .version = MVVM_SNAPSHOT_VERSION};
+        if (!writer->write((const char *)&header, sizeof(header))) {
+            SPDLOG_ERROR("failed to write the snapshot header");
+            exit(EXIT_FAILURE);
+        }
         struct_pack::serialize_to(*writer, as);
+        for (auto [data, size] : wamr->snapshot_trailer) {
+            if (!writer->write((const char *)data, size)) {
+                SPDLOG_ERROR("failed to write memory of {} bytes", size);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
 
     auto end = std::chrono::high_resolution_clock::now();
     // get duration in us
@@ -989,4 +1361,4 @@ void serialize_to_file(WASMExecEnv *instance) {
     SPDLOG_INFO("Snapshot time: {} s", dur.count() / 1000000.0);
     SPDLOG_INFO("Memory usage: {} MB", get_rss() / 1024 / 1024);
     exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+}
@@ -0,0 +1,160 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "wamr_blocking.h"
+#include "wamr.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <spdlog/spdlog.h>
+#include <string_view>
+#include <thread>
+#if !defined(_WIN32)
+#include "platform_wasi_types.h"
+#include <pthread.h>
+#include <semaphore.h>
+// libc-wasi, its table of wasi_snapshot_preview1 natives
+extern "C" uint32 get_libc_wasi_export_apis(NativeSymbol **p_libc_wasi_apis);
+#endif
+
+extern WAMRInstance *wamr;
+
+#if !defined(_WIN32)
+typedef __wasi_errno_t (*poll_oneoff_t)(wasm_exec_env_t, const void *, void *, uint32, uint32 *);
+typedef __wasi_errno_t (*sock_accept_t)(wasm_exec_env_t, __wasi_fd_t, __wasi_fdflags_t, __wasi_fd_t *);
+typedef __wasi_errno_t (*sock_recv_t)(wasm_exec_env_t, __wasi_fd_t, void *, uint32, __wasi_riflags_t, uint32 *,
+                                      __wasi_roflags_t *);
+static poll_oneoff_t libc_poll_oneoff;
+static sock_accept_t libc_sock_accept;
+static sock_recv_t libc_sock_recv;
+// posted from the SIGINT handler, where no thread can be started, for the waker to knock
+static sem_t wake_sem;
+static std::atomic<bool> waker_started;
+
+/** Join the pending checkpoint like a thread reaching an int3, ends the process. */
+[[noreturn]] static void park(wasm_exec_env_t exec_env, WAMRThreadState *state) {
+    SPDLOG_DEBUG("thread {} checkpoints from a blocking call", (uint64)exec_env->handle);
+    // serialize_to_file counts us in itself, on top of the lightweight checkpoint taken around the call
+    state->lwcp_depth.store(0);
+    state->blocking.store(false);
+    serialize_to_file(exec_env);
+    exit(-1);
+}
+
+/** Issue call until it returns for a reason of the guest's, parking if a checkpoint was asked for meanwhile. */
+template <typename F> static __wasi_errno_t interruptible(wasm_exec_env_t exec_env, F &&call) {
+    auto state = wamr->threads.local((uint64)exec_env->handle);
+    state->host_thread.store((uint64)pthread_self(), std::memory_order_relaxed);
+    while (true) {
+        // seq_cst pairs with the lwcp_pending store in sigint_handler, either it sees us blocking or we see the flag
+        state->blocking.store(true);
+        if (wamr->lwcp_pending.load())
+            park(exec_env, state);
+        auto err = call();
+        state->blocking.store(false);
+        if (err != __WASI_EINTR)
+            return err;
+        if (wamr->lwcp_pending.load())
+            park(exec_env, state);
+        // not ours, the guest never asked to be interrupted
+    }
+}
+
+static __wasi_errno_t poll_oneoff_wrapper(wasm_exec_env_t exec_env, const void *in, void *out, uint32 nsubscriptions,
+                                          uint32 *nevents) {
+    return interruptible(exec_env, [&] { return libc_poll_oneoff(exec_env, in, out, nsubscriptions, nevents); });
+}
+static __wasi_errno_t sock_accept_wrapper(wasm_exec_env_t exec_env, __wasi_fd_t fd, __wasi_fdflags_t flags,
+                                          __wasi_fd_t *fd_new) {
+    return interruptible(exec_env, [&] { return libc_sock_accept(exec_env, fd, flags, fd_new); });
+}
+static __wasi_errno_t sock_recv_wrapper(wasm_exec_env_t exec_env, __wasi_fd_t sock, void *ri_data, uint32 ri_data_len,
+                                        __wasi_riflags_t ri_flags, uint32 *ro_data_len, __wasi_roflags_t *ro_flags) {
+    return interruptible(exec_env, [&] {
+        return libc_sock_recv(exec_env, sock, ri_data, ri_data_len, ri_flags, ro_data_len, ro_flags);
+    });
+}
+
+static void wake_handler(int sig) {}
+
+/** Started up front, wakes the threads in the wrapped calls every time wake_sem is posted. */
+static void start_waker() {
+    if (sem_init(&wake_sem, 0, 0) != 0) {
+        SPDLOG_ERROR("wake sem_init failed {}, blocking calls hold up checkpoints", errno);
+        return;
+    }
+    std::thread([] {
+        while (true) {
+            while (sem_wait(&wake_sem) == -1 && errno == EINTR)
+                ;
+            // a thread may have looked at the flag just before it blocked, so knock until no one is left inside
+            while (true) {
+                bool any = false;
+                wamr->threads.for_each([&](WAMRThreadState &s) {
+                    if (!s.blocking.load())
+                        return;
+                    any = true;
+                    pthread_kill((pthread_t)s.host_thread.load(std::memory_order_relaxed), MVVM_WAKE_SIGNAL);
+                });
+                if (!any)
+                    break;
+                std::this_thread::sleep_for(MVVM_WAKE_INTERVAL);
+            }
+        }
+    }).detach();
+    waker_started = true;
+}
+
+void register_interruptible_wasi() {
+    static NativeSymbol wrappers[] = {
+        {"poll_oneoff", (void *)poll_oneoff_wrapper, nullptr, nullptr},
+        {"sock_accept", (void *)sock_accept_wrapper, nullptr, nullptr},
+        {"sock_recv", (void *)sock_recv_wrapper, nullptr, nullptr},
+    };
+    void **libc[] = {(void **)&libc_poll_oneoff, (void **)&libc_sock_accept, (void **)&libc_sock_recv};
+    NativeSymbol *apis;
+    auto count = get_libc_wasi_export_apis(&apis);
+    for (size_t i = 0; i < std::size(wrappers); i++) {
+        auto api = std::find_if(apis, apis + count,
+                                [&](auto &api) { return std::string_view(api.symbol) == wrappers[i].symbol; });
+        if (api == apis + count) {
+            SPDLOG_ERROR("libc-wasi has no {}, blocking calls hold up checkpoints", wrappers[i].symbol);
+            return;
+        }
+        *libc[i] = api->func_ptr;
+        wrappers[i].signature = api->signature;
+    }
+    // no SA_RESTART, the point is to have the call return
+    struct sigaction sa {};
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = wake_handler;
+    if (sigaction(MVVM_WAKE_SIGNAL, &sa, nullptr) == -1) {
+        SPDLOG_ERROR("Error: cannot handle the wake signal");
+        return;
+    }
+    start_waker();
+    // registered later, found first
+    if (!wasm_runtime_register_natives("wasi_snapshot_preview1", wrappers, std::size(wrappers)))
+        SPDLOG_ERROR("failed to register the interruptible wasi calls");
+}
+
+void wake_blocking_calls() {
+    // sem_post is async-signal-safe, starting a thread is not
+    if (waker_started.load())
+        sem_post(&wake_sem);
+}
+#else
+void register_interruptible_wasi() {}
+void wake_blocking_calls() {}
+#endif
@@ -11,6 +11,7 @@
  */
 
 #include "wamr.h"
+#include "wamr_blocking.h"
 #include "wamr_wasi_context.h"
 #include <condition_variable>
 #include <cstdlib>
@@ -37,6 +38,7 @@ void insert_sock_open_data(uint32_t poolfd, int af, int socktype, uint32_t sockf
 #if !defined(_WIN32)
 void insert_sock_send_to_data(uint32_t sock, uint8 *si_data, uint32 si_data_len, uint16_t si_flags,
                               __wasi_addr_t *dest_addr) {
+    wamr->idle.touch();
     if (wamr->socket_fd_map_.find(sock) != wamr->socket_fd_map_.end()) {
         wamr->socket_fd_map_[sock].socketSentToData.sock = sock;
         wamr->socket_fd_map_[sock].socketSentToData.si_data = std::vector<uint8_t>(si_data, si_data + si_data_len);
@@ -68,25 +70,24 @@ void insert_sock_send_to_data(uint32_t sock, uint8 *si_data, uint32 si_data_len,
 
 void insert_sock_recv_from_data(uint32_t sock, uint8 *ri_data, uint32 ri_data_len, uint16_t ri_flags,
                                 __wasi_addr_t *src_addr) {
-
-    if (wamr->time != std::chrono::high_resolution_clock::time_point())
-        wamr->latencies.emplace_back(
+    wamr->idle.touch();
+    if (wamr->time != std::chrono::high_resolution_clock::time_point()) {
+        wamr->recv_latency_sum +=
             std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - wamr->time)
-                .count());
-    wamr->time = std::chrono::high_resolution_clock::now();
-    if (wamr->latencies.size() % 1000 == 0) {
-        long long sum = std::accumulate(wamr->latencies.begin(), wamr->latencies.end(), 0LL);
-        double average_latency = static_cast<double>(sum) / wamr->latencies.size();
-        fprintf(stderr, "average latency %f\n", average_latency);
+                .count();
+        if (++wamr->recv_count % 1000 == 0)
+            fprintf(stderr, "average latency %f\n", static_cast<double>(wamr->recv_latency_sum) / wamr->recv_count);
     }
-    if (wamr->socket_fd_map_.find(sock) != wamr->socket_fd_map_.end()) {
+    wamr->time = std::chrono::high_resolution_clock::now();
+    auto it = wamr->socket_fd_map_.find(sock);
+    if (it != wamr->socket_fd_map_.end()) {
+        auto &metaData = it->second;
+        // outside of the checkpoint drain the guest consumes the data itself, only remember who talks to us
+        if (!metaData.is_collection && metaData.has_peer)
+            return;
         WasiSockRecvFromData recvFromData{};
         recvFromData.sock = sock;
-        recvFromData.ri_data = std::vector<uint8_t>(ri_data, ri_data + ri_data_len);
         recvFromData.ri_flags = ri_flags;
-        if (wamr->socket_fd_map_[sock].is_collection) {
-            wamr->socket_fd_map_[sock].replay_start_index += 1;
-        }
         if (src_addr->kind == IPv4) {
             recvFromData.src_addr.ip.is_4 = true;
             recvFromData.src_addr.ip.ip4[0] = src_addr->addr.ip4.addr.n0;
@@ -106,12 +107,20 @@ void insert_sock_recv_from_data(uint32_t sock, uint8 *ri_data, uint32 ri_data_le
             recvFromData.src_addr.ip.ip6[7] = src_addr->addr.ip6.addr.h3;
             recvFromData.src_addr.port = src_addr->addr.ip6.port;
         }
-        SPDLOG_ERROR("insert_sock_recv_from_data {} {}", sock, ((int)((struct mvvm_op_data *)ri_data)->op));
-        if (((struct mvvm_op_data *)ri_data)->op == MVVM_SOCK_FIN) {
-            wamr->socket_fd_map_[sock].is_collection = false;
+        if (!metaData.has_peer) {
+            metaData.peer_addr = recvFromData.src_addr;
+            metaData.has_peer = true;
+        }
+        if (!metaData.is_collection)
+            return;
+        SPDLOG_DEBUG("insert_sock_recv_from_data {} {}", sock, ri_data_len);
+        if (ri_data_len >= sizeof(struct mvvm_op_data) && ((struct mvvm_op_data *)ri_data)->op == MVVM_SOCK_FIN) {
+            metaData.is_collection = false;
             return;
         }
-        wamr->socket_fd_map_[sock].socketRecvFromDatas.emplace_back(recvFromData);
+        recvFromData.ri_data = std::vector<uint8_t>(ri_data, ri_data + ri_data_len);
+        wamr->recv_journal_.try_emplace(sock, MVVM_JOURNAL_CAPACITY, wamr->journal_spill)
+            .first->second.push(std::move(recvFromData));
     } else {
         SPDLOG_ERROR("socket_fd", sock, " not found");
     }
@@ -130,7 +139,7 @@ void replay_sock_recv_from_data(uint32_t sock, uint8 **ri_data, unsigned long *r
         *recv_size = 0;
         return;
     }
-    auto recvFromData = wamr->socket_fd_map_[sock].socketRecvFromDatas[wamr->socket_fd_map_[sock].replay_start_index];
+    auto &recvFromData = wamr->socket_fd_map_[sock].socketRecvFromDatas[wamr->socket_fd_map_[sock].replay_start_index];
     wamr->socket_fd_map_[sock].replay_start_index++;
     std::memcpy(*ri_data, recvFromData.ri_data.data(), recvFromData.ri_data.size());
     *recv_size = recvFromData.ri_data.size();
@@ -163,38 +172,11 @@ int get_sock_fd(int fd) {
 };
 
 /** fopen, fseek, fwrite, fread */
-void insert_fd(int fd, const char *path, int flags, int offset, enum fd_op op) {
+void insert_fd(int fd, const char *path, int flags, int64 offset, enum fd_op op) {
     if (fd > 2) {
         SPDLOG_DEBUG("insert_fd(fd,filename,flags, offset) fd: {} flags: {} offset: {}, op: {}", fd, flags, offset,
                      ((int)op));
-        std::string path_;
-        std::vector<std::tuple<int, int, enum fd_op>> ops_;
-        std::tie(path_, ops_) = wamr->fd_map_[fd];
-        if (wamr->policy == "replay") {
-            ops_.emplace_back(flags, offset, op);
-            // policy is replay
-            if (strcmp(path, "") != 0)
-                wamr->fd_map_[fd] = std::make_tuple(std::string(path), ops_);
-            else
-                wamr->fd_map_[fd] = std::make_tuple(path_, ops_);
-        } else {
-            // policy is compression
-            if (strcmp(path, "") != 0) {
-                ops_.emplace_back(flags, offset, op);
-                wamr->fd_map_[fd] = std::make_tuple(std::string(path), ops_);
-            } else {
-                if (ops_.size() == 1) {
-                    ops_.emplace_back(flags, offset, MVVM_FSEEK);
-                } else {
-                    // SPDLOG_ERROR("insert_seek{} {}", std::get<1>(ops_[1]), flags);
-                    // if ((flags == 2 || flags == 0) && op == MVVM_FSEEK) {
-                    //     ops_.back() = std::make_tuple(flags, offset, MVVM_FSEEK);
-                    // } else
-                    ops_.back() = std::make_tuple(1, offset, MVVM_FSEEK);
-                }
-                wamr->fd_map_[fd] = std::make_tuple(path_, ops_);
-            }
-        }
+        wamr->fd_table_.insert(fd, path, flags, offset, op);
     }
 }
 
@@ -203,24 +185,12 @@ void rename_fd(int old_fd, char const *old_path, int new_fd, char const *new_pat
     SPDLOG_DEBUG("rename_fd(int old_fd, char const *old_path, int new_fd, char const *new_path) old:{} "
                  "old_fd:{} new_fd:{}, new_path:{}",
                  old_fd, old_path, new_fd, new_path);
-    if (wamr->fd_map_.find(old_fd) != wamr->fd_map_.end()) {
-        auto new_fd_ = wamr->fd_map_[old_fd];
-        std::string path_;
-        std::vector<std::tuple<int, int, enum fd_op>> ops_;
-        std::tie(path_, ops_) = new_fd_;
-        if (strcmp(old_path, "") == 0)
-            wamr->fd_map_[new_fd] = std::make_tuple(std::string(new_path), ops_);
-        else
-            wamr->fd_map_[new_fd] = std::make_tuple(path_, ops_);
-        wamr->fd_map_.erase(old_fd);
-    }
+    wamr->fd_table_.rename(old_fd, old_path, new_fd, new_path);
 };
 /** fclose */
 void remove_fd(int fd) {
     SPDLOG_DEBUG("remove_fd(fd) fd{}", fd);
-    if (wamr->fd_map_.find(fd) != wamr->fd_map_.end())
-        wamr->fd_map_.erase(fd);
-    else {
+    if (!wamr->fd_table_.remove(fd)) {
         if (wamr->socket_fd_map_.find(fd) != wamr->socket_fd_map_.end())
             wamr->socket_fd_map_.erase(fd);
         else
@@ -236,6 +206,8 @@ void insert_socket(int fd, int domain, int type, int protocol) {
     // if protocol == 1, is the remote protocol, we need to getsockname?
 
     SPDLOG_DEBUG("insert_socket(fd, domain, type, protocol) {} {} {} {}", fd, domain, type, protocol);
+    // an accepted connection counts as activity too
+    wamr->idle.touch();
 
     if (wamr->socket_fd_map_.find(fd) != wamr->socket_fd_map_.end()) {
         SPDLOG_ERROR("socket_fd already exist", fd);
@@ -279,42 +251,9 @@ void update_socket_fd_address(int fd, SocketAddrPool *address) {
 void init_gateway(SocketAddrPool *address) {
     // tell gateway to keep alive the server
     if (wamr->op_data.op != MVVM_SOCK_RESUME && wamr->op_data.op != MVVM_SOCK_RESUME_TCP_SERVER) {
-        struct sockaddr_in addr {};
-        int fd = 0;
-        ssize_t rc;
         wamr->op_data.op = MVVM_SOCK_INIT;
-        wamr->op_data.addr[0][0] = wamr->local_addr;
-        std::memcpy(&wamr->op_data.addr[0][1], address, sizeof(SocketAddrPool));
-
-        // Create a socket
-        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-            SPDLOG_ERROR("socket error");
-            exit(EXIT_FAILURE);
-        }
-
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(MVVM_SOCK_PORT);
-
-        // Convert IPv4 and IPv6 addresses from text to binary form
-        if (inet_pton(AF_INET, MVVM_SOCK_ADDR, &addr.sin_addr) <= 0) {
-            SPDLOG_ERROR("AF_INET not supported");
-            exit(EXIT_FAILURE);
-        }
-        // Connect to the server
-        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-            SPDLOG_ERROR("Connection Failed ", errno);
-            exit(EXIT_FAILURE);
-        }
-
-        SPDLOG_INFO("Connected successfully");
-        rc = send(fd, &wamr->op_data, sizeof(struct mvvm_op_data), 0);
-        if (rc == -1) {
-            SPDLOG_ERROR("send error");
+        if (!wamr->gateway.send(MVVM_SOCK_INIT, wamr->op_data.is_tcp, {{wamr->local_addr, *address}}))
             exit(EXIT_FAILURE);
-        }
-
-        // Clean up
-        close(fd);
     }
 }
 #endif
@@ -323,37 +262,20 @@ void insert_sync_op(wasm_exec_env_t exec_env, const uint32 *mutex, enum sync_op
     SPDLOG_DEBUG("insert sync on offset {}, as op: {} ",
                  (uint32)(((uint8 *)mutex) - ((WASMModuleInstance *)exec_env->module_inst)->memories[0]->memory_data),
                  ((int)locking));
-    struct sync_op_t sync_op = {.tid = ((uint64_t)exec_env->handle), .ref = *mutex, .sync_op = locking};
-
-    wamr->sync_ops.push_back(sync_op);
+    wamr->threads.on_sync_op((uint64_t)exec_env->handle, *mutex, locking);
 }
 void insert_sync_op_atomic_wait(wasm_exec_env_t exec_env, const uint32 *mutex, uint64 expected, bool wait64) {
-    struct sync_op_t sync_op = {
-        .tid = ((uint64_t)exec_env->handle),
-        .ref = (uint32)(((uint8 *)mutex) - ((WASMModuleInstance *)exec_env->module_inst)->memories[0]->memory_data),
-        .sync_op = SYNC_OP_ATOMIC_WAIT,
-        .expected = expected,
-        .wait64 = wait64};
-    wamr->sync_ops.push_back(sync_op);
+    auto ref = (uint32)(((uint8 *)mutex) - ((WASMModuleInstance *)exec_env->module_inst)->memories[0]->memory_data);
+    wamr->threads.on_sync_op((uint64_t)exec_env->handle, ref, SYNC_OP_ATOMIC_WAIT, expected, wait64);
 }
 void insert_sync_op_atomic_wake(wasm_exec_env_t exec_env, const uint32 *mutex) {
     // Calculate the ref value for the given mutex, similar to insert_sync_op_atomic_wait
     uint32 ref = (uint32)(((uint8 *)mutex) - ((WASMModuleInstance *)exec_env->module_inst)->memories[0]->memory_data);
-
-    // Remove elements from wamr->sync_ops where the ref matches the given mutex's ref
-    auto new_end = std::remove_if(wamr->sync_ops.begin(), wamr->sync_ops.end(), [ref](const sync_op_t &op) {
-        // SPDLOG_DEBUG("remove_if {} {}", op.ref, ref);
-        return op.ref == ref;
-    });
-    wamr->sync_ops.erase(new_end, wamr->sync_ops.end());
+    wamr->threads.on_atomic_wake(ref);
 }
 void insert_sync_op_atomic_notify(wasm_exec_env_t exec_env, const uint32 *mutex, uint32 count) {
-    struct sync_op_t sync_op = {
-        .tid = ((uint64_t)exec_env->handle),
-        .ref = (uint32)(((uint8 *)mutex) - ((WASMModuleInstance *)exec_env->module_inst)->memories[0]->memory_data),
-        .sync_op = SYNC_OP_ATOMIC_NOTIFY,
-        .expected = count};
-    wamr->sync_ops.push_back(sync_op);
+    auto ref = (uint32)(((uint8 *)mutex) - ((WASMModuleInstance *)exec_env->module_inst)->memories[0]->memory_data);
+    wamr->threads.on_sync_op((uint64_t)exec_env->handle, ref, SYNC_OP_ATOMIC_NOTIFY, count);
 }
 void insert_tid_start_arg(uint64_t tid, size_t start_arg, size_t vtid) {
     SPDLOG_DEBUG("insert_tid_start_arg {} {} {}", tid, start_arg, vtid);
@@ -361,19 +283,22 @@ void insert_tid_start_arg(uint64_t tid, size_t start_arg, size_t vtid) {
 };
 
 void wamr_handle_map(uint64_t old_tid, uint64_t tid) {
-    SPDLOG_ERROR("wamr_handle_map old:< {} > new:< {} >", old_tid, tid);
+    SPDLOG_DEBUG("wamr_handle_map old:< {} > new:< {} >", old_tid, tid);
+    std::unique_lock ul(wamr->tid_mtx);
     wamr->tid_map[old_tid] = tid;
+    wamr->rev_tid_map[tid] = old_tid;
 };
 
-korp_tid wamr_get_new_korp_tid(korp_tid new_tid) { return ((korp_tid)wamr->tid_map[((uint64_t)new_tid)]); }
+korp_tid wamr_get_new_korp_tid(korp_tid new_tid) {
+    std::shared_lock sl(wamr->tid_mtx);
+    auto it = wamr->tid_map.find((uint64_t)new_tid);
+    return it != wamr->tid_map.end() ? ((korp_tid)it->second) : 0;
+}
 
 korp_tid wamr_get_korp_tid(korp_tid new_tid) {
-    for (auto &[old_tid, new_tid_v] : wamr->tid_map) {
-        if (((uint64_t)new_tid) == new_tid_v) {
-            return ((korp_tid)old_tid);
-        }
-    }
-    return 0;
+    std::shared_lock sl(wamr->tid_mtx);
+    auto it = wamr->rev_tid_map.find((uint64_t)new_tid);
+    return it != wamr->rev_tid_map.end() ? ((korp_tid)it->second) : 0;
 }
 
 void insert_parent_child(uint64_t tid, uint64_t child_tid) {
@@ -394,10 +319,8 @@ void lightweight_checkpoint(WASMExecEnv *exec_env) {
         SPDLOG_DEBUG("skip checkpoint");
         return;
     }
-
-    std::unique_lock as_ul(wamr->as_mtx);
-    wamr->lwcp_list[((uint64_t)exec_env->handle)]++;
-    wamr->ready++;
+    // seq_cst pairs with the lwcp_pending store in serialize_to_file, either it sees our count or we see the flag
+    wamr->threads.local((uint64_t)exec_env->handle)->lwcp_depth.fetch_add(1);
 }
 
 void lightweight_uncheckpoint(WASMExecEnv *exec_env) {
@@ -413,16 +336,24 @@ void lightweight_uncheckpoint(WASMExecEnv *exec_env) {
         SPDLOG_DEBUG("skip uncheckpoint");
         return;
     }
+    auto state = wamr->threads.local((uint64_t)exec_env->handle);
+    // give the count back before looking at the flag, serialize_to_file sets the flag before it sums, so either it
+    // doesn't count us or we see the flag, checking first would let it count us as parked while we run on
+    state->lwcp_depth.fetch_sub(1);
+    WAMRThreadRegistry::on_return(state);
+    if (!wamr->lwcp_pending.load()) [[likely]]
+        return;
+    // slow path, a checkpoint is on its way so take the count back and synchronize with serialize_to_file
+    state->lwcp_depth.fetch_add(1);
     std::unique_lock as_ul(wamr->as_mtx);
-    if (wamr->lwcp_list[((uint64_t)exec_env->handle)] == 0) {
+    if (state->lwcp_depth.load() == 0) {
         // someone has reset our counter
         // which means we've been serialized
         // so we shouldn't return back to the wasm state
         std::condition_variable cv;
         cv.wait(as_ul);
     }
-    wamr->lwcp_list[((uint64_t)exec_env->handle)]--;
-    wamr->ready--;
+    state->lwcp_depth.fetch_sub(1);
 }
 
 void print_stack(AOTFrame *frame) {
@@ -562,6 +493,26 @@ void sigint_handler(int sig) {
     }
     fprintf(stderr, "Caught signal %d, performing custom logic...\n", sig);
     checkpoint = true;
+    wamr->lwcp_pending = true;
+    wake_blocking_calls();
+    if (wamr->send_prepare) {
+#if !defined(_WIN32)
+        // no stream I/O in a signal handler, the preparer thread sends it
+        sem_post(&wamr->prepare_sem);
+#else
+        wamr->prepare_destination();
+#endif
+    }
+#if !defined(_WIN32)
+    // the guest runs on for the hot window before it traps, the sampler arms the checkpoint after it
+    if (wamr->hot_window) {
+        sem_post(&wamr->hot_sem);
+        return;
+    }
+#endif
+    arm_checkpoint();
+}
+void arm_checkpoint() {
     wamr->int3_ul = std::unique_lock(wamr->int3_mtx);
     wamr->replace_nop_with_int3();
     wamr->int3_cv.notify_all();
@@ -0,0 +1,84 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "wamr_fd_table.h"
+#include <cstdio>
+#include <cstring>
+#include <spdlog/spdlog.h>
+
+int32 WAMRFdTable::intern(const std::string &path) {
+    auto [it, inserted] = path_ids_.try_emplace(path, (int32)paths_.size());
+    if (inserted)
+        paths_.push_back(path);
+    return it->second;
+}
+
+void WAMRFdTable::insert(int fd, const char *path, int flags, int64 offset, fd_op op) {
+    if (fd < 0)
+        return;
+    if (path && path[0] != '\0') {
+        // fopen, the only call that can allocate
+        if (fd >= (int)fds_.size())
+            fds_.resize(fd + 1);
+        fds_[fd] = {.path_id = intern(path), .flags = flags, .whence = SEEK_SET, .offset = 0, .moved = false};
+        return;
+    }
+    if (!contains(fd)) {
+        SPDLOG_DEBUG("untracked fd {} op {}", fd, (int)op);
+        return;
+    }
+    // fread/fwrite/fseek, all we need is where the file position ended up
+    auto &s = fds_[fd];
+    if (op == MVVM_FSEEK && flags != SEEK_CUR) {
+        // a new base, SEEK_END stays relative as the file may be another size by the time we restore
+        s.whence = flags;
+        s.offset = offset;
+    } else {
+        // SEEK_CUR, or the bytes fread/fwrite moved past
+        s.offset += offset;
+    }
+    s.moved = true;
+}
+
+void WAMRFdTable::rename(int old_fd, const char *old_path, int new_fd, const char *new_path) {
+    if (!contains(old_fd) || new_fd < 0)
+        return;
+    auto state = fds_[old_fd];
+    if (strcmp(old_path, "") == 0)
+        state.path_id = intern(new_path);
+    fds_[old_fd] = {};
+    if (new_fd >= (int)fds_.size())
+        fds_.resize(new_fd + 1);
+    fds_[new_fd] = state;
+}
+
+bool WAMRFdTable::remove(int fd) {
+    if (!contains(fd))
+        return false;
+    fds_[fd] = {};
+    return true;
+}
+
+std::map<int, std::tuple<std::string, WAMRFdTable::fd_ops>> WAMRFdTable::compact() const {
+    std::map<int, std::tuple<std::string, fd_ops>> res;
+    for (int fd = 0; fd < (int)fds_.size(); fd++) {
+        auto &s = fds_[fd];
+        if (s.path_id < 0)
+            continue;
+        fd_ops ops{{s.flags, 0, MVVM_FOPEN}};
+        // one seek from the base we last saw, which both restore policies understand
+        if (s.moved)
+            ops.emplace_back(s.whence, s.offset, MVVM_FSEEK);
+        res[fd] = std::make_tuple(paths_[s.path_id], std::move(ops));
+    }
+    return res;
+}
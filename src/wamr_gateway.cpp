@@ -0,0 +1,208 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "wamr_gateway.h"
+#include "wamr.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <spdlog/spdlog.h>
+#include <thread>
+#if !defined(_WIN32)
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// 0 is what the requests of older runtimes are filed under. The restored instance keeps the session and starts its
+// own seq, from a random point so the gateway doesn't take its first request for a resend of the last one before
+GatewayClient::GatewayClient() {
+    std::random_device rd;
+    session = ((uint64_t)rd() << 32 | rd()) | 1;
+    seq_ = rd();
+}
+
+#if !defined(_WIN32)
+static bool send_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt) {
+        struct msghdr msg {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        auto n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        while (iovcnt && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void *buf, size_t len) {
+    for (size_t off = 0; off < len;) {
+        auto n = recv(fd, (uint8_t *)buf + off, len - off, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        off += n;
+    }
+    return true;
+}
+
+/** Whether the ack of seq comes back in time, a gateway that restarted closes the connection instead. */
+static bool recv_ack(int fd, uint32_t seq) {
+    struct pollfd pfd {.fd = fd, .events = POLLIN, .revents = 0};
+    struct mvvm_gateway_ack ack {};
+    int n;
+    while ((n = poll(&pfd, 1, MVVM_GATEWAY_ACK_TIMEOUT_MS)) == -1 && errno == EINTR)
+        ;
+    if (n != 1 || !recv_all(fd, &ack, sizeof(ack)))
+        return false;
+    return ack.magic == MVVM_GATEWAY_ACK_MAGIC && ack.seq == seq;
+}
+
+GatewayClient::~GatewayClient() {
+    if (fd_ != -1)
+        close(fd_);
+}
+
+bool GatewayClient::connect() {
+    struct sockaddr_in addr {};
+    int one = 1;
+    if ((fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        SPDLOG_ERROR("socket error");
+        return false;
+    }
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(MVVM_SOCK_PORT);
+    if (inet_pton(AF_INET, MVVM_SOCK_ADDR, &addr.sin_addr) <= 0 ||
+        ::connect(fd_, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        SPDLOG_ERROR("Connection Failed {}", errno);
+        close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    // requests are small and go out one after another, don't hold them back to coalesce
+    setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    SPDLOG_DEBUG("Connected successfully");
+    return true;
+}
+
+bool GatewayClient::send(enum opcode op, bool is_tcp, const std::vector<std::array<SocketAddrPool, 2>> &addr,
+                         const std::string &data) {
+    if (data.size() > UINT16_MAX) {
+        SPDLOG_ERROR("{} bytes of data don't fit a frame", data.size());
+        return false;
+    }
+    std::lock_guard lock(mtx_);
+    struct mvvm_gateway_frame frame {};
+    frame.magic = MVVM_GATEWAY_MAGIC;
+    frame.version = MVVM_GATEWAY_VERSION;
+    frame.op = op;
+    frame.session = session;
+    frame.seq = seq_++;
+    frame.is_tcp = is_tcp;
+    frame.data_len = data.size();
+    frame.addr_count = addr.size();
+    // a send() into a connection the gateway dropped can still succeed, only the ack tells the request got through.
+    // a resend of one the gateway did read carries the same seq, and the gateway handles it once
+    for (int attempt = 0; attempt < MVVM_GATEWAY_SEND_ATTEMPTS; attempt++) {
+        if (fd_ == -1 && !connect()) {
+            // a restarting gateway may not listen yet
+            std::this_thread::sleep_for(std::chrono::milliseconds(MVVM_GATEWAY_ACK_TIMEOUT_MS));
+            continue;
+        }
+        struct iovec iov[3] = {{&frame, sizeof(frame)},
+                               {(void *)addr.data(), addr.size() * sizeof(addr[0])},
+                               {(void *)data.data(), data.size()}};
+        if (send_all(fd_, iov, 3) && recv_ack(fd_, frame.seq)) {
+            SPDLOG_DEBUG("gateway op {} seq {} with {} pairs", (int)op, frame.seq, addr.size());
+            return true;
+        }
+        SPDLOG_DEBUG("gateway op {} seq {} not acked, reconnecting", (int)op, frame.seq);
+        close(fd_);
+        fd_ = -1;
+    }
+    SPDLOG_ERROR("gateway op {} seq {} not delivered", (int)op, frame.seq);
+    return false;
+}
+
+bool gateway_read_request(int fd, GatewayRequest &req, bool &legacy) {
+    struct mvvm_gateway_frame frame {};
+    if (!recv_all(fd, &frame.magic, sizeof(frame.magic)))
+        return false;
+    if (frame.magic != MVVM_GATEWAY_MAGIC) {
+        // an older runtime, its op is where the magic would be
+        struct mvvm_op_data op_data {};
+        memcpy(&op_data, &frame.magic, sizeof(frame.magic));
+        if (!recv_all(fd, (uint8_t *)&op_data + sizeof(frame.magic), sizeof(op_data) - sizeof(frame.magic)))
+            return false;
+        legacy = true;
+        req.op = op_data.op;
+        req.is_tcp = op_data.is_tcp;
+        req.session = 0;
+        req.seq = 0;
+        req.data.clear();
+        // only suspend fills in size, the rest always carry their one pair
+        int count = op_data.op == MVVM_SOCK_SUSPEND || op_data.op == MVVM_SOCK_SUSPEND_TCP_SERVER
+                        ? std::clamp(op_data.size, 0, MVVM_MAX_ADDR)
+                        : 1;
+        req.addr.clear();
+        for (int i = 0; i < count; i++)
+            req.addr.push_back({op_data.addr[i][0], op_data.addr[i][1]});
+        return true;
+    }
+    legacy = false;
+    if (!recv_all(fd, (uint8_t *)&frame + sizeof(frame.magic), sizeof(frame) - sizeof(frame.magic)))
+        return false;
+    if (frame.version != MVVM_GATEWAY_VERSION || frame.addr_count > MVVM_GATEWAY_MAX_PAIRS) {
+        SPDLOG_ERROR("bad control frame, version {} with {} pairs", frame.version, frame.addr_count);
+        return false;
+    }
+    req.op = (enum opcode)frame.op;
+    req.is_tcp = frame.is_tcp;
+    req.session = frame.session;
+    req.seq = frame.seq;
+    req.addr.resize(frame.addr_count);
+    req.data.resize(frame.data_len);
+    return recv_all(fd, req.addr.data(), req.addr.size() * sizeof(req.addr[0])) &&
+           recv_all(fd, req.data.data(), req.data.size());
+}
+
+bool gateway_ack(int fd, const GatewayRequest &req) {
+    struct mvvm_gateway_ack ack {.magic = MVVM_GATEWAY_ACK_MAGIC, .seq = req.seq};
+    return send(fd, &ack, sizeof(ack), MSG_NOSIGNAL) == sizeof(ack);
+}
+#else
+GatewayClient::~GatewayClient() = default;
+bool GatewayClient::connect() { return false; }
+bool GatewayClient::send(enum opcode op, bool is_tcp, const std::vector<std::array<SocketAddrPool, 2>> &addr,
+                         const std::string &data) {
+    return false;
+}
+bool gateway_read_request(int fd, GatewayRequest &req, bool &legacy) { return false; }
+bool gateway_ack(int fd, const GatewayRequest &req) { return false; }
+#endif
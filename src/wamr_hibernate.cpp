@@ -0,0 +1,60 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "wamr_hibernate.h"
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <filesystem>
+#include <mutex>
+#include <spdlog/spdlog.h>
+
+int64_t WAMRIdleWatchdog::now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void WAMRIdleWatchdog::start(uint32_t timeout, const std::string &target, uint32_t max_threads) {
+    if (!timeout)
+        return;
+    if (std::filesystem::path(target).has_parent_path())
+        SPDLOG_WARN("{} is not right in the working directory, the gateway won't find its snapshot", target);
+    target_ = std::filesystem::path(target).filename().string();
+    max_threads_ = max_threads;
+    touch();
+    thread_ = std::jthread([this, timeout](const std::stop_token &stop) {
+        std::mutex mtx;
+        std::condition_variable_any cv;
+        std::unique_lock lock(mtx);
+        while (!stop.stop_requested()) {
+            auto idle = now() - last_active_.load(std::memory_order_relaxed);
+            if (idle < timeout) {
+                // woken early only to stop
+                cv.wait_for(lock, stop, std::chrono::seconds(timeout - idle), [] { return false; });
+                continue;
+            }
+            SPDLOG_INFO("idle for {} s, hibernating", idle);
+            fired_ = true;
+            // the same checkpoint as an operator's SIGINT, it ends in exit once the snapshot is written
+            raise(SIGINT);
+            return;
+        }
+    });
+}
+
+std::string WAMRIdleWatchdog::restore_data() const {
+    std::string data = target_;
+    data.push_back('\0');
+    data += std::to_string(max_threads_);
+    data.push_back('\0');
+    return data;
+}
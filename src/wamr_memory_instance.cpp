@@ -13,6 +13,38 @@
 #include "wamr.h"
 #include "wamr_memory_instance.h"
 extern WAMRInstance *wamr;
+extern ReadStream *reader;
+std::pair<uint8 *, uint8 *> WAMRMemoryInstance::load_data(uint8 *prepared, bool adopted, uint64 reserve,
+                                                           size_t guest_threads) {
+#if !defined(_WIN32)
+    // shared memory
+    auto memory_data =
+        prepared ? prepared : (uint8 *)mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#else
+    auto memory_data = (uint8 *)malloc(memory_data_size);
+#endif
+    auto heap_data = (uint8 *)malloc(heap_data_size);
+    if (!adopted) {
+        // straight from the stream into its final place, the trailer follows the order of the dump
+        place_memory(memory_data, memory_data_size, placement_for(guest_threads));
+        auto [ranges, hot_count] = hot_first_ranges(hot_pages, memory_data_size);
+        // one populate call per hot run instead of a fault per page
+        for (size_t i = 0; i < hot_count; i++)
+            prefault_memory(memory_data + ranges[i].first, ranges[i].second);
+        for (auto [offset, size] : ranges) {
+            if (!reader->read((char *)memory_data + offset, size)) {
+                SPDLOG_ERROR("failed to read memory at {} of {} bytes", offset, memory_data_size);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (!reader->read((char *)heap_data, heap_data_size)) {
+        SPDLOG_ERROR("failed to read heap of {} bytes", heap_data_size);
+        exit(EXIT_FAILURE);
+    }
+    SPDLOG_DEBUG("read {} bytes of memory, {} hot pages first", adopted ? 0 : memory_data_size, hot_pages.size());
+    return {memory_data, heap_data};
+}
 void WAMRMemoryInstance::restore_impl(WASMMemoryInstance *env) {
     env->module_type = module_type;
     env->ref_count = ref_count + 1;
@@ -21,17 +53,17 @@ void WAMRMemoryInstance::restore_impl(WASMMemoryInstance *env) {
     env->num_bytes_per_page = num_bytes_per_page;
     env->cur_page_count = cur_page_count;
     env->max_page_count = max_page_count;
-    env->memory_data_size = memory_data.size();
-    #if !defined(_WIN32)
-        if (env->ref_count > 0) // shared memory
-            env->memory_data =
-                (uint8 *)mmap(NULL, wamr->heap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        else
-    #endif
-        env->memory_data = (uint8 *)malloc(env->memory_data_size);
-    memcpy(env->memory_data, memory_data.data(), env->memory_data_size);
-    env->memory_data_end = env->memory_data + (memory_data.size());
-    env->heap_data = (uint8 *)malloc(heap_data.size());
-    memcpy(env->heap_data, heap_data.data(), heap_data.size());
-    env->heap_data_end = env->heap_data + heap_data.size();
-};
\ No newline at end of file
+    env->memory_data_size = memory_data_size;
+    // restore reads the trailer ahead of time, while the module loads
+    if (auto loaded = wamr->loaded_memory.extract(this)) {
+        std::tie(env->memory_data, env->heap_data) = loaded.mapped();
+    } else {
+        // the memfd of a source on this host, the pages are already in place
+        bool adopted = wamr->memory_fd != -1 && wamr->prepared_memory;
+        std::tie(env->memory_data, env->heap_data) = load_data(std::exchange(wamr->prepared_memory, nullptr), adopted,
+                                                               wamr->heap_size, wamr->execEnv.size());
+    }
+    wamr->demote_cold_memory(env->memory_data, env->memory_data_size, hot_pages);
+    env->memory_data_end = env->memory_data + env->memory_data_size;
+    env->heap_data_end = env->heap_data + heap_data_size;
+};
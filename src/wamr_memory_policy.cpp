@@ -0,0 +1,304 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "wamr_memory_policy.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <spdlog/spdlog.h>
+#include <thread>
+#include <vector>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+WAMRPlacement placement_for(size_t guest_threads) {
+    return guest_threads > 1 ? WAMRPlacement::Interleave : WAMRPlacement::FirstTouch;
+}
+
+// only affects pages faulted from now on, which is all of them for a fresh mapping
+void place_memory(uint8_t *dst, size_t len, WAMRPlacement placement) {
+#if defined(__linux__)
+    auto page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    auto begin = ((uintptr_t)dst + page - 1) & ~(page - 1);
+    auto end = ((uintptr_t)dst + len) & ~(page - 1);
+    if (end <= begin)
+        return;
+    unsigned long mask = ~0ul;
+    int mode = MPOL_INTERLEAVE;
+    if (placement == WAMRPlacement::FirstTouch) {
+        // the workers touch the pages, so pin the policy to the node the guest resumes on
+        unsigned cpu = 0, node = 0;
+        if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0 || node >= sizeof(mask) * 8)
+            return;
+        mask = 1ul << node;
+        mode = MPOL_PREFERRED;
+    }
+    // the kernel masks out nodes without memory, the error just means no NUMA
+    if (syscall(SYS_mbind, begin, end - begin, mode, &mask, sizeof(mask) * 8, 0) != 0)
+        SPDLOG_DEBUG("mbind {} failed {}", mode, errno);
+#endif
+}
+
+static void copy_chunk(uint8_t *dst, const uint8_t *src, size_t len, bool non_temporal) {
+#if defined(__x86_64__)
+    if (non_temporal) {
+        // align the destination for the streaming stores
+        size_t head = std::min(len, (16 - ((uintptr_t)dst & 15)) & 15);
+        memcpy(dst, src, head);
+        size_t i = head;
+        for (; i + 64 <= len; i += 64) {
+            auto s = (const __m128i *)(src + i);
+            auto d = (__m128i *)(dst + i);
+            _mm_stream_si128(d, _mm_loadu_si128(s));
+            _mm_stream_si128(d + 1, _mm_loadu_si128(s + 1));
+            _mm_stream_si128(d + 2, _mm_loadu_si128(s + 2));
+            _mm_stream_si128(d + 3, _mm_loadu_si128(s + 3));
+        }
+        memcpy(dst + i, src + i, len - i);
+        _mm_sfence();
+        return;
+    }
+#endif
+    memcpy(dst, src, len);
+}
+
+/** Page multiple slices so no two workers fault the same page, one per core but at least a chunk each. */
+template <typename F> static void for_each_slice(size_t len, F &&f) {
+    size_t workers = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, len / MVVM_POPULATE_CHUNK);
+    size_t slice = (len / workers + 4095) & ~(size_t)4095;
+    std::vector<std::thread> threads;
+    threads.reserve(workers);
+    for (size_t off = 0; off < len; off += slice)
+        threads.emplace_back(f, off, std::min(slice, len - off));
+    for (auto &t : threads)
+        t.join();
+    SPDLOG_DEBUG("populated {} bytes with {} workers", len, threads.size());
+}
+
+static void copy_slices(uint8_t *dst, const uint8_t *src, size_t len, bool non_temporal) {
+    if (len < 2 * MVVM_POPULATE_CHUNK) {
+        copy_chunk(dst, src, len, non_temporal);
+        return;
+    }
+    for_each_slice(len, [&](size_t off, size_t n) { copy_chunk(dst + off, src + off, n, non_temporal); });
+}
+
+void populate_memory(uint8_t *dst, const uint8_t *src, size_t len) {
+    copy_slices(dst, src, len, len >= MVVM_NT_THRESHOLD);
+}
+
+bool pread_memory(int fd, off_t offset, uint8_t *dst, size_t len) {
+#if !defined(_WIN32)
+    std::atomic<bool> ok = true;
+    auto read_slice = [&](size_t off, size_t n) {
+        while (n > 0) {
+            auto r = pread(fd, dst + off, n, offset + (off_t)off);
+            if (r <= 0) {
+                if (r == -1 && errno == EINTR)
+                    continue;
+                SPDLOG_ERROR("pread failed at {} {}", offset + off, errno);
+                ok = false;
+                return;
+            }
+            off += r;
+            n -= r;
+        }
+    };
+    if (len < 2 * MVVM_POPULATE_CHUNK)
+        read_slice(0, len);
+    else
+        for_each_slice(len, read_slice);
+    return ok;
+#else
+    return false;
+#endif
+}
+
+bool stream_memory(uint8_t *dst, size_t len, const std::function<bool(uint8_t *, size_t)> &read) {
+    if (len < 2 * MVVM_POPULATE_CHUNK)
+        return read(dst, len);
+    // the whole image decides, a window alone never passes the threshold
+    bool non_temporal = len >= MVVM_NT_THRESHOLD;
+    size_t window = std::min(len, MVVM_STREAM_WINDOW);
+    std::unique_ptr<uint8_t[]> buffers[2] = {std::make_unique_for_overwrite<uint8_t[]>(window),
+                                             std::make_unique_for_overwrite<uint8_t[]>(window)};
+    size_t off = 0, n = window;
+    if (!read(buffers[0].get(), n))
+        return false;
+    for (int cur = 0;; cur ^= 1) {
+        std::thread copier(copy_slices, dst + off, buffers[cur].get(), n, non_temporal);
+        size_t next = std::min(window, len - off - n);
+        bool ok = next == 0 || read(buffers[cur ^ 1].get(), next);
+        copier.join();
+        if (!ok || next == 0)
+            return ok;
+        off += n;
+        n = next;
+    }
+}
+
+void clear_soft_dirty() {
+#if defined(__linux__)
+    // 4 clears the soft-dirty bits of every pte of the process
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd == -1 || write(fd, "4", 1) != 1)
+        SPDLOG_DEBUG("soft-dirty tracking unavailable {}", errno);
+    if (fd != -1)
+        close(fd);
+#endif
+}
+
+std::vector<uint32_t> soft_dirty_pages(const uint8_t *base, size_t len) {
+    std::vector<uint32_t> res;
+#if defined(__linux__)
+    auto page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    if (page != MVVM_PAGE_SIZE || (uintptr_t)base % page)
+        return res;
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    if (fd == -1)
+        return res;
+    std::vector<uint64_t> entries((len + page - 1) / page);
+    auto bytes = (ssize_t)(entries.size() * sizeof(uint64_t));
+    if (pread(fd, entries.data(), bytes, (off_t)((uintptr_t)base / page * sizeof(uint64_t))) != bytes) {
+        SPDLOG_DEBUG("pagemap read failed {}", errno);
+        close(fd);
+        return res;
+    }
+    close(fd);
+    for (uint32_t i = 0; i < entries.size(); i++) {
+        // present or swapped, and soft-dirty
+        if ((entries[i] & (3ull << 62)) && (entries[i] & (1ull << 55)))
+            res.push_back(i);
+    }
+#endif
+    return res;
+}
+
+std::pair<std::vector<std::pair<size_t, size_t>>, size_t> hot_first_ranges(const std::vector<uint32_t> &hot_pages,
+                                                                          size_t len) {
+    std::vector<std::pair<size_t, size_t>> hot, cold;
+    size_t cur = 0;
+    for (size_t i = 0; i < hot_pages.size();) {
+        size_t j = i + 1;
+        while (j < hot_pages.size() && hot_pages[j] == hot_pages[j - 1] + 1)
+            j++;
+        size_t begin = std::min((size_t)hot_pages[i] * MVVM_PAGE_SIZE, len);
+        size_t end = std::min((size_t)(hot_pages[j - 1] + 1) * MVVM_PAGE_SIZE, len);
+        if (begin > cur)
+            cold.emplace_back(cur, begin - cur);
+        if (end > begin)
+            hot.emplace_back(begin, end - begin);
+        cur = std::max(cur, end);
+        i = j;
+    }
+    if (cur < len)
+        cold.emplace_back(cur, len - cur);
+    auto hot_count = hot.size();
+    hot.insert(hot.end(), cold.begin(), cold.end());
+    return {std::move(hot), hot_count};
+}
+
+void prefault_memory(uint8_t *dst, size_t len) {
+#if defined(__linux__)
+    auto page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    auto begin = (uintptr_t)dst & ~(page - 1);
+    len += (uintptr_t)dst - begin;
+#ifdef MADV_POPULATE_WRITE
+    if (madvise((void *)begin, len, MADV_POPULATE_WRITE) == 0)
+        return;
+#endif
+    madvise((void *)begin, len, MADV_WILLNEED);
+#endif
+}
+
+size_t demote_cold(uint8_t *base, size_t len, const std::vector<uint32_t> &hot_pages, int advice) {
+    size_t advised = 0;
+#if defined(__linux__)
+    if ((uintptr_t)base % MVVM_PAGE_SIZE)
+        return 0;
+    auto [ranges, hot_count] = hot_first_ranges(hot_pages, len);
+    for (size_t i = hot_count; i < ranges.size(); i++) {
+        // a partial last page may still be in use
+        auto size = ranges[i].second & ~(size_t)(MVVM_PAGE_SIZE - 1);
+        if (size && madvise(base + ranges[i].first, size, advice) == 0)
+            advised += size;
+    }
+#endif
+    return advised;
+}
+
+size_t resident_bytes(const uint8_t *base, size_t len) {
+    size_t resident = 0;
+#if !defined(_WIN32)
+    auto page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    auto begin = (uintptr_t)base & ~(page - 1);
+    len += (uintptr_t)base - begin;
+    std::vector<unsigned char> vec((len + page - 1) / page);
+    if (mincore((void *)begin, len, vec.data()) != 0)
+        return 0;
+    for (auto v : vec)
+        resident += (v & 1) * page;
+#endif
+    return resident;
+}
+
+int memfd_back_memory(uint8_t *base, size_t used) {
+#if defined(__linux__)
+    auto page = (size_t)sysconf(_SC_PAGESIZE);
+    if ((uintptr_t)base % page) {
+        SPDLOG_ERROR("memory at {} is not page aligned, it can't go on a memfd", (void *)base);
+        return -1;
+    }
+    int fd = memfd_create("mvvm-memory", MFD_CLOEXEC);
+    if (fd == -1) {
+        SPDLOG_ERROR("memfd_create failed {}", errno);
+        return -1;
+    }
+    // only the pages the memory is in, MAP_FIXED would replace whatever else is mapped past them
+    auto len = (used + page - 1) & ~(page - 1);
+    if (ftruncate(fd, (off_t)len) != 0 || pwrite(fd, base, used, 0) != (ssize_t)used ||
+        mmap(base, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        SPDLOG_ERROR("failed to move memory onto a memfd {}", errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+uint8_t *map_memfd(int fd) {
+#if !defined(_WIN32)
+    struct stat st {};
+    if (fstat(fd, &st) != 0)
+        return nullptr;
+    auto mem = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return mem == MAP_FAILED ? nullptr : (uint8_t *)mem;
+#else
+    return nullptr;
+#endif
+}
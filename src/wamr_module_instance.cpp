@@ -22,7 +22,15 @@ void WAMRModuleInstance::dump_impl(WASMModuleInstance *env) {
         for (int i = 0; i < env->memory_count; i++) {
             auto local_mem = WAMRMemoryInstance();
             dump(&local_mem, env->memories[i]);
+            // what the guest wrote since SIGINT, this is the only thread that dumps the memories
+            if (wamr->hot_sampled)
+                local_mem.hot_pages = soft_dirty_pages(env->memories[i]->memory_data, local_mem.memory_data_size);
             memories.push_back(local_mem);
+            // hot pages go out first so they are the first to arrive, on the same host the memfd carries them
+            if (i != 0 || !wamr->same_host)
+                for (auto [offset, size] : hot_first_ranges(local_mem.hot_pages, local_mem.memory_data_size).first)
+                    wamr->snapshot_trailer.emplace_back(env->memories[i]->memory_data + offset, size);
+            wamr->snapshot_trailer.emplace_back(env->memories[i]->heap_data, local_mem.heap_data_size);
         }
         for (int i = 0; i < env->table_count; i++) {
             SPDLOG_DEBUG("Dumping table {}", env->tables[i]->cur_size);
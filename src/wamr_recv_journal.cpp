@@ -0,0 +1,93 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "wamr_recv_journal.h"
+#include <spdlog/spdlog.h>
+#include <utility>
+
+WAMRRecvJournal::WAMRRecvJournal(size_t capacity, bool spill)
+    : ring_(capacity ? capacity : 1), spill_enabled_(spill) {}
+
+WAMRRecvJournal::WAMRRecvJournal(WAMRRecvJournal &&other) noexcept
+    : ring_(std::move(other.ring_)), head_(other.head_), size_(other.size_), spill_enabled_(other.spill_enabled_),
+      spill_(std::exchange(other.spill_, nullptr)), spilled_(other.spilled_) {}
+
+WAMRRecvJournal::~WAMRRecvJournal() {
+    if (spill_)
+        fclose(spill_);
+}
+
+void WAMRRecvJournal::push(WasiSockRecvFromData &&data) {
+    if (size_ == ring_.size()) {
+        if (!spill_enabled_) {
+            SPDLOG_ERROR("journal of {} is full at {} packets and --journal_spill is off, failing the checkpoint",
+                         data.sock, ring_.size());
+            exit(EXIT_FAILURE);
+        }
+        spill(ring_[head_]);
+        head_ = (head_ + 1) % ring_.size();
+        size_--;
+    }
+    ring_[(head_ + size_) % ring_.size()] = std::move(data);
+    size_++;
+}
+
+// sock, flags, source address and the payload length, then the payload
+void WAMRRecvJournal::spill(const WasiSockRecvFromData &data) {
+    if (!spill_ && !(spill_ = tmpfile())) {
+        SPDLOG_ERROR("journal spill file error {}", errno);
+        exit(EXIT_FAILURE);
+    }
+    uint32 len = data.ri_data.size();
+    if (fwrite(&data.sock, sizeof(data.sock), 1, spill_) != 1 ||
+        fwrite(&data.ri_flags, sizeof(data.ri_flags), 1, spill_) != 1 ||
+        fwrite(&data.src_addr, sizeof(data.src_addr), 1, spill_) != 1 || fwrite(&len, sizeof(len), 1, spill_) != 1 ||
+        fwrite(data.ri_data.data(), 1, len, spill_) != len) {
+        SPDLOG_ERROR("journal spill write error {}", errno);
+        exit(EXIT_FAILURE);
+    }
+    spilled_++;
+}
+
+bool WAMRRecvJournal::unspill(WasiSockRecvFromData &data) {
+    uint32 len;
+    if (fread(&data.sock, sizeof(data.sock), 1, spill_) != 1 ||
+        fread(&data.ri_flags, sizeof(data.ri_flags), 1, spill_) != 1 ||
+        fread(&data.src_addr, sizeof(data.src_addr), 1, spill_) != 1 || fread(&len, sizeof(len), 1, spill_) != 1)
+        return false;
+    data.ri_data.resize(len);
+    return fread(data.ri_data.data(), 1, len, spill_) == len;
+}
+
+std::vector<WasiSockRecvFromData> WAMRRecvJournal::drain() {
+    std::vector<WasiSockRecvFromData> res;
+    res.reserve(size());
+    if (spill_) {
+        rewind(spill_);
+        for (size_t i = 0; i < spilled_; i++) {
+            WasiSockRecvFromData data{};
+            if (!unspill(data)) {
+                SPDLOG_ERROR("journal spill read error after {} of {}", i, spilled_);
+                exit(EXIT_FAILURE);
+            }
+            res.emplace_back(std::move(data));
+        }
+        fclose(spill_);
+        spill_ = nullptr;
+        spilled_ = 0;
+    }
+    for (size_t i = 0; i < size_; i++)
+        res.emplace_back(std::move(ring_[(head_ + i) % ring_.size()]));
+    head_ = size_ = 0;
+    SPDLOG_DEBUG("drained {} journaled packets", res.size());
+    return res;
+}
@@ -0,0 +1,173 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "wamr_tcp_repair.h"
+#include <cerrno>
+#include <spdlog/spdlog.h>
+#if __linux__
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static bool set_opt(int fd, int opt, int val) { return setsockopt(fd, SOL_TCP, opt, &val, sizeof(val)) == 0; }
+
+/** Peek the whole of the repair queue selected with TCP_REPAIR_QUEUE, seq is the one past its end. */
+static bool peek_queue(int fd, int queue, int size_ioctl, uint32_t &seq, std::vector<uint8_t> &data) {
+    socklen_t len = sizeof(seq);
+    int size = 0;
+    if (!set_opt(fd, TCP_REPAIR_QUEUE, queue) || getsockopt(fd, SOL_TCP, TCP_QUEUE_SEQ, &seq, &len) != 0 ||
+        ioctl(fd, size_ioctl, &size) != 0)
+        return false;
+    data.resize(size);
+    return size == 0 || recv(fd, data.data(), size, MSG_PEEK | MSG_DONTWAIT) == size;
+}
+
+/** Write data into the repair queue selected with TCP_REPAIR_QUEUE, the kernel takes it without sending. */
+static bool fill_queue(int fd, int queue, const uint8_t *data, size_t len) {
+    if (!set_opt(fd, TCP_REPAIR_QUEUE, queue))
+        return false;
+    for (size_t off = 0; off < len;) {
+        auto n = send(fd, data + off, len - off, 0);
+        if (n <= 0)
+            return false;
+        off += n;
+    }
+    return true;
+}
+
+bool tcp_repair_dump(int host_fd, WAMRTcpRepair &state) {
+    state = {};
+    struct sockaddr_storage addr {};
+    socklen_t addr_len = sizeof(addr);
+    if (!set_opt(host_fd, TCP_REPAIR, TCP_REPAIR_ON)) {
+        SPDLOG_ERROR("TCP_REPAIR failed {}, it needs CAP_NET_ADMIN", errno);
+        return false;
+    }
+    // on any way out but success the socket goes through the gateway instead and must work again, on success it
+    // stays in repair so that closing it with the source sends nothing to the peer
+    struct repair_guard {
+        int fd;
+        bool armed = true;
+        ~repair_guard() {
+            if (armed && !set_opt(fd, TCP_REPAIR, TCP_REPAIR_OFF))
+                SPDLOG_ERROR("failed to leave TCP_REPAIR {}", errno);
+        }
+    } guard{host_fd};
+    if (getsockname(host_fd, (struct sockaddr *)&addr, &addr_len) != 0)
+        return false;
+    state.family = addr.ss_family;
+    state.local_addr.assign((uint8_t *)&addr, (uint8_t *)&addr + addr_len);
+    addr_len = sizeof(addr);
+    if (getpeername(host_fd, (struct sockaddr *)&addr, &addr_len) != 0)
+        return false;
+    state.remote_addr.assign((uint8_t *)&addr, (uint8_t *)&addr + addr_len);
+
+    int unsent = 0;
+    if (!peek_queue(host_fd, TCP_RECV_QUEUE, SIOCINQ, state.recv_seq, state.recv_queue) ||
+        !peek_queue(host_fd, TCP_SEND_QUEUE, SIOCOUTQ, state.send_seq, state.send_queue) ||
+        ioctl(host_fd, SIOCOUTQNSD, &unsent) != 0) {
+        SPDLOG_ERROR("failed to read the tcp queues {}", errno);
+        return false;
+    }
+    state.unsent_len = unsent;
+
+    struct tcp_info info {};
+    struct tcp_repair_window window {};
+    socklen_t len = sizeof(info);
+    if (getsockopt(host_fd, SOL_TCP, TCP_INFO, &info, &len) != 0)
+        return false;
+    state.wscale = info.tcpi_options & TCPI_OPT_WSCALE;
+    state.sack = info.tcpi_options & TCPI_OPT_SACK;
+    state.timestamps = info.tcpi_options & TCPI_OPT_TIMESTAMPS;
+    state.snd_wscale = info.tcpi_snd_wscale;
+    state.rcv_wscale = info.tcpi_rcv_wscale;
+    len = sizeof(state.mss);
+    if (getsockopt(host_fd, SOL_TCP, TCP_MAXSEG, &state.mss, &len) != 0)
+        return false;
+    len = sizeof(state.timestamp);
+    if (state.timestamps && getsockopt(host_fd, SOL_TCP, TCP_TIMESTAMP, &state.timestamp, &len) != 0)
+        return false;
+    len = sizeof(window);
+    if (getsockopt(host_fd, SOL_TCP, TCP_REPAIR_WINDOW, &window, &len) != 0)
+        return false;
+    state.snd_wl1 = window.snd_wl1;
+    state.snd_wnd = window.snd_wnd;
+    state.max_window = window.max_window;
+    state.rcv_wnd = window.rcv_wnd;
+    state.rcv_wup = window.rcv_wup;
+    state.valid = true;
+    guard.armed = false;
+    SPDLOG_DEBUG("repair dump seq {}/{}, {} bytes to send ({} unsent), {} received", state.send_seq, state.recv_seq,
+                 state.send_queue.size(), state.unsent_len, state.recv_queue.size());
+    return true;
+}
+
+int tcp_repair_restore(const WAMRTcpRepair &state) {
+    if (!state.valid)
+        return -1;
+    int fd = socket(state.family, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    int one = 1;
+    std::vector<struct tcp_repair_opt> opts;
+    opts.push_back({TCPOPT_MAXSEG, state.mss});
+    if (state.wscale)
+        opts.push_back({TCPOPT_WINDOW, state.snd_wscale + ((uint32_t)state.rcv_wscale << 16)});
+    if (state.sack)
+        opts.push_back({TCPOPT_SACK_PERMITTED, 0});
+    if (state.timestamps)
+        opts.push_back({TCPOPT_TIMESTAMP, 0});
+    struct tcp_repair_window window {
+        .snd_wl1 = state.snd_wl1, .snd_wnd = state.snd_wnd, .max_window = state.max_window,
+        .rcv_wnd = state.rcv_wnd, .rcv_wup = state.rcv_wup
+    };
+    auto sent_len = state.send_queue.size() - state.unsent_len;
+    // in repair mode connect() skips the handshake and the queues are filled without anything going out, the dumped
+    // sequence numbers are past the queues so start where they begin
+    bool ok = set_opt(fd, TCP_REPAIR, TCP_REPAIR_ON) &&
+              setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == 0 &&
+              set_opt(fd, TCP_REPAIR_QUEUE, TCP_SEND_QUEUE) &&
+              set_opt(fd, TCP_QUEUE_SEQ, state.send_seq - (uint32_t)state.send_queue.size()) &&
+              set_opt(fd, TCP_REPAIR_QUEUE, TCP_RECV_QUEUE) &&
+              set_opt(fd, TCP_QUEUE_SEQ, state.recv_seq - (uint32_t)state.recv_queue.size()) &&
+              bind(fd, (const struct sockaddr *)state.local_addr.data(), state.local_addr.size()) == 0 &&
+              connect(fd, (const struct sockaddr *)state.remote_addr.data(), state.remote_addr.size()) == 0 &&
+              setsockopt(fd, SOL_TCP, TCP_REPAIR_OPTIONS, opts.data(), opts.size() * sizeof(opts[0])) == 0 &&
+              (!state.timestamps || set_opt(fd, TCP_TIMESTAMP, state.timestamp)) &&
+              fill_queue(fd, TCP_RECV_QUEUE, state.recv_queue.data(), state.recv_queue.size()) &&
+              fill_queue(fd, TCP_SEND_QUEUE, state.send_queue.data(), sent_len) &&
+              setsockopt(fd, SOL_TCP, TCP_REPAIR_WINDOW, &window, sizeof(window)) == 0 &&
+              set_opt(fd, TCP_REPAIR, TCP_REPAIR_OFF);
+    if (!ok) {
+        SPDLOG_ERROR("tcp repair restore failed {}", errno);
+        close(fd);
+        return -1;
+    }
+    // what the source never sent goes out the normal way
+    for (size_t off = sent_len; off < state.send_queue.size();) {
+        auto n = send(fd, state.send_queue.data() + off, state.send_queue.size() - off, 0);
+        if (n <= 0) {
+            SPDLOG_ERROR("failed to send the unsent tail {}", errno);
+            close(fd);
+            return -1;
+        }
+        off += n;
+    }
+    return fd;
+}
+#else
+bool tcp_repair_dump(int host_fd, WAMRTcpRepair &state) { return false; }
+int tcp_repair_restore(const WAMRTcpRepair &state) { return -1; }
+#endif
@@ -0,0 +1,213 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "wamr_thread_state.h"
+#include <cstdlib>
+#include <mutex>
+#include <spdlog/spdlog.h>
+#include <unordered_set>
+
+// registries that still exist, a thread giving its slots back on exit must leave alone the ones that are gone
+static std::mutex live_mtx;
+static std::unordered_set<uint64> live_registries;
+static std::atomic<uint64> next_registry_id{1};
+
+static void release(WAMRThreadState *s) {
+    s->held.clear();
+    s->wait_seq.store(0);
+    s->lwcp_depth.store(0);
+    s->reacquire = false;
+    s->blocking.store(false);
+    s->host_thread.store(0);
+    s->tid.store(0);
+    s->used.store(false, std::memory_order_release);
+}
+
+// keyed by registry, a thread that already has a slot in one instance's registry needs another in the next, and by
+// id rather than address since a registry may be freed and another allocated in its place
+static thread_local struct {
+    uint64 owner;
+    WAMRThreadState *state;
+} local_cache{};
+/* every slot the thread holds, only touched off the fast path */
+static thread_local struct LocalSlots {
+    std::vector<std::pair<uint64, WAMRThreadState *>> slots;
+    ~LocalSlots() {
+        std::lock_guard lock(live_mtx);
+        for (auto [id, s] : slots)
+            if (live_registries.contains(id))
+                release(s);
+    }
+} local_slots;
+
+WAMRThreadRegistry::WAMRThreadRegistry()
+    : slots_(std::make_unique<WAMRThreadState[]>(MVVM_MAX_THREADS)), id_(next_registry_id.fetch_add(1)) {
+    std::lock_guard lock(live_mtx);
+    live_registries.insert(id_);
+}
+
+WAMRThreadRegistry::~WAMRThreadRegistry() {
+    std::lock_guard lock(live_mtx);
+    live_registries.erase(id_);
+}
+
+WAMRThreadState *WAMRThreadRegistry::claim() {
+    while (true) {
+        // one given back by a thread that has exited before a fresh one
+        auto n = std::min(count_.load(std::memory_order_acquire), (size_t)MVVM_MAX_THREADS);
+        for (size_t i = 0; i < n; i++)
+            if (!slots_[i].used.load(std::memory_order_relaxed) && !slots_[i].used.exchange(true))
+                return &slots_[i];
+        auto i = count_.fetch_add(1);
+        if (i >= MVVM_MAX_THREADS) {
+            SPDLOG_ERROR("more than {} threads alive", MVVM_MAX_THREADS);
+            exit(EXIT_FAILURE);
+        }
+        // somebody scanning may have taken it as soon as the count went up
+        if (!slots_[i].used.exchange(true))
+            return &slots_[i];
+    }
+}
+
+WAMRThreadState *WAMRThreadRegistry::local(uint64 tid) {
+    if (local_cache.owner == id_) [[likely]]
+        return local_cache.state;
+    // back from another registry, the slot we had here is still ours
+    for (auto [id, s] : local_slots.slots) {
+        if (id == id_) {
+            local_cache = {id_, s};
+            return s;
+        }
+    }
+    auto state = claim();
+    state->held.reserve(8);
+    state->tid = tid;
+    local_slots.slots.emplace_back(id_, state);
+    local_cache = {id_, state};
+    SPDLOG_DEBUG("register thread state {}", tid);
+    return state;
+}
+
+size_t WAMRThreadRegistry::lwcp_ready() {
+    size_t ready = 0;
+    for_each([&](WAMRThreadState &s) { ready += s.lwcp_depth.load(); });
+    return ready;
+}
+
+void WAMRThreadRegistry::on_sync_op(uint64 tid, uint32 ref, enum sync_op op, uint64 expected, bool wait64) {
+    auto s = local(tid);
+    // we are running again, so whatever we waited on has returned
+    s->wait_seq.store(0, std::memory_order_release);
+    on_return(s);
+    switch (op) {
+    case SYNC_OP_MUTEX_LOCK:
+        s->held.push_back(ref);
+        break;
+    case SYNC_OP_MUTEX_UNLOCK: {
+        // locks are almost always released in reverse order
+        auto it = std::find(s->held.rbegin(), s->held.rend(), ref);
+        if (it != s->held.rend())
+            s->held.erase(std::next(it).base());
+        break;
+    }
+    case SYNC_OP_COND_WAIT:
+        // the hook only tells the cond, the mutex given with it is the innermost one held, which the wait lets go of
+        if (!s->held.empty()) {
+            s->wait_mutex = s->held.back();
+            s->held.pop_back();
+            s->reacquire = true;
+        }
+        expected = s->wait_mutex;
+        [[fallthrough]];
+    case SYNC_OP_ATOMIC_WAIT:
+        s->wait_expected = expected;
+        s->wait64 = wait64;
+        s->wait_op.store(op, std::memory_order_relaxed);
+        s->wait_ref.store(ref, std::memory_order_relaxed);
+        s->wait_seq.store(wait_seq_.fetch_add(1) + 1, std::memory_order_release);
+        break;
+    case SYNC_OP_COND_SIGNAL:
+        wake(ref, SYNC_OP_COND_WAIT, false);
+        break;
+    case SYNC_OP_COND_BROADCAST:
+        wake(ref, SYNC_OP_COND_WAIT, true);
+        break;
+    case SYNC_OP_ATOMIC_NOTIFY:
+        // the woken side reports itself through on_atomic_wake
+        break;
+    }
+}
+
+void WAMRThreadRegistry::on_atomic_wake(uint32 ref) { wake(ref, SYNC_OP_ATOMIC_WAIT, true); }
+
+void WAMRThreadRegistry::wake(uint32 ref, enum sync_op op, bool all) {
+    while (true) {
+        WAMRThreadState *oldest = nullptr;
+        uint64 oldest_seq = 0;
+        for_each([&](WAMRThreadState &s) {
+            auto seq = s.wait_seq.load(std::memory_order_acquire);
+            if (seq == 0 || s.wait_ref.load(std::memory_order_relaxed) != ref ||
+                s.wait_op.load(std::memory_order_relaxed) != op)
+                return;
+            if (all)
+                s.wait_seq.compare_exchange_strong(seq, 0);
+            else if (!oldest || seq < oldest_seq) {
+                oldest = &s;
+                oldest_seq = seq;
+            }
+        });
+        // a signal wakes the longest waiter, retry if it woke up by itself meanwhile
+        if (!oldest || oldest->wait_seq.compare_exchange_strong(oldest_seq, 0))
+            return;
+    }
+}
+
+std::vector<struct sync_op_t> WAMRThreadRegistry::live_sync_ops() {
+    std::vector<struct sync_op_t> res, reacquired;
+    std::vector<std::pair<uint64, struct sync_op_t>> cond_waits, atomic_waits;
+    for_each([&](WAMRThreadState &s) {
+        if (!s.used.load())
+            return;
+        auto seq = s.wait_seq.load();
+        // a cond waiter carries its mutex in expected, a woken one that isn't back yet is after it again
+        if (seq && s.wait_op == SYNC_OP_COND_WAIT)
+            cond_waits.emplace_back(seq, sync_op_t{.tid = s.tid,
+                                                   .ref = s.wait_ref,
+                                                   .sync_op = SYNC_OP_COND_WAIT,
+                                                   .expected = s.wait_expected});
+        else if (seq)
+            atomic_waits.emplace_back(seq, sync_op_t{.tid = s.tid,
+                                                     .ref = s.wait_ref,
+                                                     .sync_op = s.wait_op,
+                                                     .expected = s.wait_expected,
+                                                     .wait64 = s.wait64});
+        else if (s.reacquire)
+            reacquired.push_back({.tid = s.tid, .ref = s.wait_mutex, .sync_op = SYNC_OP_MUTEX_LOCK});
+        for (auto ref : s.held)
+            res.push_back({.tid = s.tid, .ref = ref, .sync_op = SYNC_OP_MUTEX_LOCK});
+    });
+    // cond waiters first, each takes its mutex and lets go of it again in the wait, then ownership, then the woken
+    // waiters that have to wait for their mutex, and the atomic waits last, waits in the order they went to sleep
+    auto by_seq = [](const auto &a, const auto &b) { return a.first < b.first; };
+    std::sort(cond_waits.begin(), cond_waits.end(), by_seq);
+    std::sort(atomic_waits.begin(), atomic_waits.end(), by_seq);
+    std::vector<struct sync_op_t> ops;
+    ops.reserve(cond_waits.size() + res.size() + reacquired.size() + atomic_waits.size());
+    for (auto &[seq, op] : cond_waits)
+        ops.push_back(op);
+    ops.insert(ops.end(), res.begin(), res.end());
+    ops.insert(ops.end(), reacquired.begin(), reacquired.end());
+    for (auto &[seq, op] : atomic_waits)
+        ops.push_back(op);
+    SPDLOG_DEBUG("{} live sync ops", ops.size());
+    return ops;
+}
@@ -15,6 +15,7 @@
 #include "wamr.h"
 #include <chrono>
 #include <fmt/core.h>
+#include <set>
 #include <string>
 #include <sys/types.h>
 extern WAMRInstance *wamr;
@@ -23,7 +24,9 @@ using namespace std::chrono_literals;
 #if !defined(_WIN32)
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 struct sockaddr_in sockaddr_from_ip4(const SocketAddrPool &addr) {
     struct sockaddr_in sockaddr4 {};
     memset(&sockaddr4, 0, sizeof(sockaddr4));
@@ -47,6 +50,172 @@ struct sockaddr_in6 sockaddr_from_ip6(const SocketAddrPool &addr) {
 
     return sockaddr6;
 }
+
+#if __linux__
+#define MVVM_DRAIN_BATCH 32
+#define MVVM_DRAIN_BUF 65536
+/* how long the gateway's fin may take to show up once the queue runs dry */
+#define MVVM_DRAIN_TIMEOUT_MS 5000
+
+static WAMRWasiAddr wasi_addr_from_sockaddr(const struct sockaddr_storage &addr) {
+    WAMRWasiAddr res{};
+    if (addr.ss_family == AF_INET) {
+        auto addr4 = (const struct sockaddr_in *)&addr;
+        auto ip = ntohl(addr4->sin_addr.s_addr);
+        res.ip.is_4 = true;
+        res.ip.ip4[0] = ip >> 24;
+        res.ip.ip4[1] = ip >> 16;
+        res.ip.ip4[2] = ip >> 8;
+        res.ip.ip4[3] = ip;
+        res.port = ntohs(addr4->sin_port);
+    } else if (addr.ss_family == AF_INET6) {
+        auto addr6 = (const struct sockaddr_in6 *)&addr;
+        for (int i = 0; i < 8; i++)
+            res.ip.ip6[i] = (addr6->sin6_addr.s6_addr[2 * i] << 8) | addr6->sin6_addr.s6_addr[2 * i + 1];
+        res.port = ntohs(addr6->sin6_port);
+    }
+    return res;
+}
+
+/** The host socket behind a guest socket, matched by its bound port (or the peer's, for a connected tcp socket) as
+ * libc-wasi keeps its fd table private. */
+int host_sock_fd(const SocketMetaData &metaData, bool is_tcp) {
+    int found = -1;
+    if (metaData.socketAddress.port == 0)
+        return -1;
+    for (auto &entry : std::filesystem::directory_iterator("/proc/self/fd")) {
+        int host_fd = std::stoi(entry.path().filename().string());
+        struct stat st {};
+        int type = 0, listening = 0;
+        socklen_t len = sizeof(int);
+        if (fstat(host_fd, &st) != 0 || !S_ISSOCK(st.st_mode))
+            continue;
+        if (getsockopt(host_fd, SOL_SOCKET, SO_TYPE, &type, &len) != 0 || type != (is_tcp ? SOCK_STREAM : SOCK_DGRAM))
+            continue;
+        len = sizeof(int);
+        if (getsockopt(host_fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0 || listening)
+            continue;
+        struct sockaddr_storage addr {};
+        socklen_t addr_len = sizeof(addr);
+        if (getsockname(host_fd, (struct sockaddr *)&addr, &addr_len) != 0)
+            continue;
+        // wasi addresses carry the port in host order
+        auto port_of = [](const struct sockaddr_storage &addr) {
+            return ntohs(addr.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&addr)->sin6_port
+                                                    : ((struct sockaddr_in *)&addr)->sin_port);
+        };
+        if (port_of(addr) != metaData.socketAddress.port) {
+            addr_len = sizeof(addr);
+            if (!is_tcp || getpeername(host_fd, (struct sockaddr *)&addr, &addr_len) != 0 ||
+                port_of(addr) != metaData.socketAddress.port)
+                continue;
+        }
+        // accepted connections share the port, leave those to the guest
+        if (found != -1)
+            return -1;
+        found = host_fd;
+    }
+    return found;
+}
+
+static bool is_fin(const uint8_t *data) {
+    struct mvvm_op_data op_data {};
+    memcpy(&op_data, data, sizeof(op_data));
+    return op_data.op == MVVM_SOCK_FIN;
+}
+
+/**
+ * Pull everything queued on the host socket up to the gateway's FIN straight into the journal. The FIN is a
+ * datagram of its own over udp, over tcp it ends the stream and may straddle reads, so the last sizeof(mvvm_op_data)
+ * bytes are held back until more data shows they are not it. False if the FIN doesn't come, what was journaled
+ * until then stays.
+ */
+static bool drain_host_sock(int host_fd, int fd, bool is_tcp, const SocketMetaData &metaData,
+                            WAMRRecvJournal &journal) {
+    std::vector<uint8_t> bufs(MVVM_DRAIN_BATCH * MVVM_DRAIN_BUF);
+    struct mmsghdr msgs[MVVM_DRAIN_BATCH];
+    struct iovec iovs[MVVM_DRAIN_BATCH];
+    struct sockaddr_storage addrs[MVVM_DRAIN_BATCH];
+    std::vector<uint8_t> tail;
+    size_t total = 0;
+    auto journal_data = [&](const uint8_t *data, size_t len, const WAMRWasiAddr &src_addr) {
+        WasiSockRecvFromData recvFromData{};
+        recvFromData.sock = fd;
+        recvFromData.ri_data = std::vector<uint8_t>(data, data + len);
+        recvFromData.src_addr = src_addr;
+        journal.push(std::move(recvFromData));
+        total += len;
+    };
+    // bytes held back in case they were the fin, on the way out without one
+    auto flush_tail = [&] {
+        if (!tail.empty())
+            journal_data(tail.data(), tail.size(), metaData.peer_addr);
+    };
+    while (true) {
+        for (int i = 0; i < MVVM_DRAIN_BATCH; i++) {
+            iovs[i] = {.iov_base = bufs.data() + i * MVVM_DRAIN_BUF, .iov_len = MVVM_DRAIN_BUF};
+            msgs[i] = {};
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(host_fd, msgs, MVVM_DRAIN_BATCH, MSG_DONTWAIT, nullptr);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                SPDLOG_ERROR("recvmmsg error {}", errno);
+                flush_tail();
+                return false;
+            }
+            // queue is empty, the fin is still on its way
+            struct pollfd pfd {
+                .fd = host_fd, .events = POLLIN
+            };
+            int r;
+            while ((r = poll(&pfd, 1, MVVM_DRAIN_TIMEOUT_MS)) == -1 && errno == EINTR)
+                ;
+            if (r <= 0) {
+                SPDLOG_ERROR("no fin on {} after {} bytes {}", fd, total, r == 0 ? ETIMEDOUT : errno);
+                flush_tail();
+                return false;
+            }
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            auto data = bufs.data() + i * MVVM_DRAIN_BUF;
+            size_t len = msgs[i].msg_len;
+            if (!is_tcp) {
+                if (len >= sizeof(struct mvvm_op_data) && is_fin(data)) {
+                    SPDLOG_DEBUG("drained {} bytes from host socket {} for {}", total, host_fd, fd);
+                    return true;
+                }
+                if (len)
+                    journal_data(data, len, wasi_addr_from_sockaddr(addrs[i]));
+                continue;
+            }
+            if (len == 0) {
+                SPDLOG_ERROR("peer closed {} before the fin", fd);
+                flush_tail();
+                return true;
+            }
+            tail.insert(tail.end(), data, data + len);
+            if (tail.size() < sizeof(struct mvvm_op_data))
+                continue;
+            auto body = tail.size() - sizeof(struct mvvm_op_data);
+            bool fin = is_fin(tail.data() + body);
+            if (body)
+                journal_data(tail.data(), body, metaData.peer_addr);
+            if (fin) {
+                SPDLOG_DEBUG("drained {} bytes from host socket {} for {}", total, host_fd, fd);
+                return true;
+            }
+            tail.erase(tail.begin(), tail.begin() + body);
+        }
+    }
+}
+#endif
 #endif
 
 void WAMRWASIContext::dump_impl(WASIArguments *env) {
@@ -75,24 +244,41 @@ void WAMRWASIContext::dump_impl(WASIArguments *env) {
         child_tid_map[k] = v;
         SPDLOG_DEBUG("child_tid_map: {} {}", k, v);
     }
+    gateway_session = wamr->gateway.session;
     // only one thread has fd_map
     if (wamr->should_snapshot)
-        for (auto [fd, res] : wamr->fd_map_) {
-            auto [path, op] = res;
-            auto dumped_res = std::make_tuple(path, op);
-            this->fd_map[fd] = dumped_res;
-        }
+        this->fd_map = wamr->fd_table_.compact();
 #if !defined(_WIN32)
     auto buf = (uint8 *)malloc(1024);
     // only one thread has socket_map
     if (wamr->should_snapshot)
-        for (auto [fd, socketMetaData] : wamr->socket_fd_map_) {
+        for (auto &[fd, socketMetaData] : wamr->socket_fd_map_) {
             ssize_t rc;
-            if (wamr->socket_fd_map_[fd].socketRecvFromDatas.empty()) {
+            // nothing was ever received, so nothing can be in flight either, and a repaired socket keeps its queues
+            if (!socketMetaData.has_peer || socketMetaData.tcp_repair.valid) {
                 this->socket_fd_map[fd] = socketMetaData;
                 continue;
             }
-            wamr->socket_fd_map_[fd].is_collection = true;
+            if (wamr->op_data.is_tcp && socketMetaData.is_server) {
+                this->socket_fd_map[fd] = socketMetaData;
+                continue;
+            }
+            auto &journal =
+                wamr->recv_journal_.try_emplace(fd, MVVM_JOURNAL_CAPACITY, wamr->journal_spill).first->second;
+            bool drained = false;
+#if __linux__
+            // batch the queue on the host instead of one guest recv per packet, on error what it got is kept like the
+            // guest side loops do, so every socket and the sync ops still make it into the snapshot
+            if (auto host_fd = host_sock_fd(socketMetaData, wamr->op_data.is_tcp); host_fd != -1) {
+                if (!drain_host_sock(host_fd, fd, wamr->op_data.is_tcp, socketMetaData, journal))
+                    SPDLOG_ERROR("host drain of {} stopped short, {} packets journaled", fd, journal.size());
+                drained = true;
+            } else {
+                SPDLOG_DEBUG("no unique host socket for {}, drain through the guest", fd);
+            }
+#endif
+            // the guest side loops below only run when the host could not drain
+            wamr->socket_fd_map_[fd].is_collection = !drained;
 
             if (!wamr->op_data.is_tcp) {
                 while (wamr->socket_fd_map_[fd].is_collection) { // drain udp socket
@@ -109,27 +295,27 @@ void WAMRWASIContext::dump_impl(WASIArguments *env) {
                     }
                     if (rc == -1) {
                         SPDLOG_ERROR("recvfrom error");
-                        return;
+                        wamr->socket_fd_map_[fd].is_collection = false;
                     }
                 }
             } else {
-                if (wamr->socket_fd_map_[fd].is_server) {
-                    this->socket_fd_map[fd] = socketMetaData;
-                    continue;
-                }
                 while (wamr->socket_fd_map_[fd].is_collection) { // drain tcp socket
                     rc = wamr->invoke_recv(fd, &buf, 1024, 0);
                     if (rc == -1) {
                         SPDLOG_ERROR("recv error");
-                        return;
+                        wamr->socket_fd_map_[fd].is_collection = false;
                     }
                 }
             }
 
+            // the restored guest reads the drained packets first
+            socketMetaData.socketRecvFromDatas = journal.drain();
+            socketMetaData.replay_start_index = 0;
             this->socket_fd_map[fd] = socketMetaData;
         }
+    free(buf);
 
-    this->sync_ops.assign(wamr->sync_ops.begin(), wamr->sync_ops.end());
+    this->sync_ops = wamr->threads.live_sync_ops();
 #endif
 }
 void WAMRWASIContext::restore_impl(WASIArguments *env) {
@@ -151,6 +337,11 @@ void WAMRWASIContext::restore_impl(WASIArguments *env) {
             // differ from path from file
             auto path = std::get<0>(res);
             SPDLOG_INFO("fd: {} path: {}", fd, path);
+            if (wamr->adopt_fd(fd) || wamr->restore_fd(fd, path, std::get<1>(res))) {
+                for (auto [flags, offset, op] : std::get<1>(res))
+                    wamr->fd_table_.insert(fd, op == MVVM_FOPEN ? path.c_str() : "", flags, offset, op);
+                continue;
+            }
             for (auto [flags, offset, op] : std::get<1>(res)) {
                 // differ from path from file
                 if (wamr->policy == "replay") {
@@ -159,13 +350,14 @@ void WAMRWASIContext::restore_impl(WASIArguments *env) {
                         r = wamr->invoke_fopen(path, fd);
                         if (r != fd)
                             wamr->invoke_frenumber(r, fd);
-                        wamr->fd_map_[fd] = res;
+                        wamr->fd_table_.insert(fd, path.c_str(), flags, offset, op);
                         break;
                     case MVVM_FWRITE:
                     case MVVM_FREAD:
                         wamr->invoke_fseek(fd, 1, offset);
                     case MVVM_FSEEK:
                         wamr->invoke_fseek(fd, flags, offset);
+                        wamr->fd_table_.insert(fd, "", flags, offset, op);
                         break;
                     default:
                         break;
@@ -175,10 +367,11 @@ void WAMRWASIContext::restore_impl(WASIArguments *env) {
                         r = wamr->invoke_fopen(path, fd);
                         if (r != fd)
                             wamr->invoke_frenumber(r, fd);
-                        wamr->fd_map_[fd] = res;
+                        wamr->fd_table_.insert(fd, path.c_str(), flags, offset, op);
                     } else {
-                        // wamr->invoke_fseek(fd, 2, 15);
-                        wamr->invoke_fseek(fd, 0, offset);
+                        // SEEK_SET or SEEK_END, whichever the position was last based on
+                        wamr->invoke_fseek(fd, flags, offset);
+                        wamr->fd_table_.insert(fd, "", flags, offset, op);
                     }
                 }
             }
@@ -192,6 +385,7 @@ void WAMRWASIContext::restore_impl(WASIArguments *env) {
         int old_fd = 0;
         int res;
         bool is_4 = false;
+        std::set<int> adopted;
         for (auto [fd, socketMetaData] : this->socket_fd_map) {
             wamr->op_data.is_tcp |= socketMetaData.type;
             is_tcp_server |= socketMetaData.is_server;
@@ -203,6 +397,18 @@ void WAMRWASIContext::restore_impl(WASIArguments *env) {
         is_tcp_server &= wamr->op_data.is_tcp;
 
         for (auto [fd, socketMetaData] : this->socket_fd_map) {
+            if (socketMetaData.tcp_repair.valid && !wamr->adopted_fds_.contains(fd)) {
+                if (auto host_fd = tcp_repair_restore(socketMetaData.tcp_repair); host_fd != -1)
+                    wamr->adopted_fds_[fd] = host_fd;
+                else
+                    SPDLOG_ERROR("failed to repair the connection of {}, reconnecting", fd);
+            }
+            // handed over live from a process on this host, or repaired
+            if (wamr->adopt_fd(fd)) {
+                adopted.insert(fd);
+                wamr->socket_fd_map_[fd] = socketMetaData;
+                continue;
+            }
             if (!socketMetaData.is_server) {
                 if (!wamr->op_data.is_tcp) { // udp
                     res =
@@ -228,7 +434,7 @@ void WAMRWASIContext::restore_impl(WASIArguments *env) {
             }
         }
         for (auto [fd, socketMetaData] : this->socket_fd_map) {
-            if (socketMetaData.is_server) {
+            if (socketMetaData.is_server && !adopted.contains(fd)) {
                 if (!wamr->op_data.is_tcp) { // udp
                     res =
                         wamr->invoke_sock_open(socketMetaData.domain, socketMetaData.type, socketMetaData.protocol, fd);
@@ -0,0 +1,112 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "checksum.h"
+#include "unit_test.h"
+#include <cstring>
+#include <netinet/udp.h>
+#include <random>
+#include <utility>
+#include <vector>
+
+// an ip header without options and a udp datagram, laid out as captured
+struct packet {
+    std::vector<uint8_t> buf;
+    struct ip *iphdr() { return (struct ip *)buf.data(); }
+    struct udphdr *udphdr() { return (struct udphdr *)(buf.data() + sizeof(struct ip)); }
+};
+
+static uint16_t ip_sum(packet &p) {
+    auto saved = std::exchange(p.iphdr()->ip_sum, 0);
+    auto sum = in_cksum((unsigned short *)p.iphdr(), sizeof(struct ip));
+    p.iphdr()->ip_sum = saved;
+    return sum;
+}
+
+static uint16_t udp_sum(packet &p) {
+    auto udp_len = p.buf.size() - sizeof(struct ip);
+    std::vector<uint8_t> pseudo(12 + udp_len);
+    memcpy(pseudo.data(), &p.iphdr()->ip_src, 4);
+    memcpy(pseudo.data() + 4, &p.iphdr()->ip_dst, 4);
+    pseudo[9] = IPPROTO_UDP;
+    pseudo[10] = udp_len >> 8;
+    pseudo[11] = udp_len & 0xff;
+    memcpy(pseudo.data() + 12, p.udphdr(), udp_len);
+    ((struct udphdr *)(pseudo.data() + 12))->uh_sum = 0;
+    auto sum = in_cksum((unsigned short *)pseudo.data(), (int)pseudo.size());
+    // a computed 0 goes out as all ones, 0 means no checksum
+    return sum ? sum : 0xffff;
+}
+
+static packet make_packet(std::mt19937 &rng, size_t payload) {
+    packet p{std::vector<uint8_t>(sizeof(struct ip) + sizeof(struct udphdr) + payload)};
+    for (auto &b : p.buf)
+        b = rng();
+    auto iphdr = p.iphdr();
+    iphdr->ip_v = 4;
+    iphdr->ip_hl = sizeof(struct ip) / 4;
+    iphdr->ip_len = htons(p.buf.size());
+    iphdr->ip_off = 0;
+    iphdr->ip_p = IPPROTO_UDP;
+    p.udphdr()->uh_ulen = htons(p.buf.size() - sizeof(struct ip));
+    iphdr->ip_sum = ip_sum(p);
+    p.udphdr()->uh_sum = udp_sum(p);
+    return p;
+}
+
+int main() {
+    // the worked example of RFC 1624 section 4, where eqn. 2 would give 0xffff
+    MVVM_CHECK(cksum_adjust(0xdd2f, 0x5555, 0x3285) == 0x0000);
+
+    std::mt19937 rng(1624);
+    for (int i = 0; i < 10000; i++) {
+        // odd payloads too, their last byte is padded in the sum
+        auto p = make_packet(rng, rng() % 64);
+        in_addr_t now = rng();
+        auto &addr = i % 2 ? p.iphdr()->ip_src : p.iphdr()->ip_dst;
+        rewrite_addr(p.iphdr(), addr, now, p.buf.size());
+        MVVM_CHECK(addr.s_addr == now);
+        MVVM_CHECK(p.iphdr()->ip_sum == ip_sum(p));
+        MVVM_CHECK(p.udphdr()->uh_sum == udp_sum(p));
+    }
+
+    // every address word, including the ones that take the sum through 0
+    for (uint32_t word : {0x00000000u, 0xffffffffu, 0x0000ffffu, 0xffff0000u}) {
+        auto p = make_packet(rng, 16);
+        rewrite_addr(p.iphdr(), p.iphdr()->ip_dst, word, p.buf.size());
+        MVVM_CHECK(p.iphdr()->ip_sum == ip_sum(p));
+        MVVM_CHECK(p.udphdr()->uh_sum == udp_sum(p));
+    }
+
+    // a sender that skipped the udp checksum keeps it skipped
+    auto unsummed = make_packet(rng, 16);
+    unsummed.udphdr()->uh_sum = 0;
+    rewrite_addr(unsummed.iphdr(), unsummed.iphdr()->ip_src, rng(), unsummed.buf.size());
+    MVVM_CHECK(unsummed.udphdr()->uh_sum == 0);
+    MVVM_CHECK(unsummed.iphdr()->ip_sum == ip_sum(unsummed));
+
+    // past the first fragment the bytes after the ip header are payload, not a udp header
+    auto fragment = make_packet(rng, 16);
+    fragment.iphdr()->ip_off = htons(8);
+    fragment.iphdr()->ip_sum = ip_sum(fragment);
+    auto payload = fragment.buf;
+    rewrite_addr(fragment.iphdr(), fragment.iphdr()->ip_src, rng(), fragment.buf.size());
+    MVVM_CHECK(fragment.iphdr()->ip_sum == ip_sum(fragment));
+    MVVM_CHECK(!memcmp(fragment.buf.data() + sizeof(struct ip), payload.data() + sizeof(struct ip),
+                       payload.size() - sizeof(struct ip)));
+
+    // captured short of the udp header
+    auto truncated = make_packet(rng, 0);
+    rewrite_addr(truncated.iphdr(), truncated.iphdr()->ip_src, rng(), sizeof(struct ip) + 4);
+    MVVM_CHECK(truncated.iphdr()->ip_sum == ip_sum(truncated));
+    return 0;
+}
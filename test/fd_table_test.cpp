@@ -0,0 +1,74 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "unit_test.h"
+#include "wamr_fd_table.h"
+#include <fcntl.h>
+
+using fd_ops = WAMRFdTable::fd_ops;
+
+static fd_ops ops_of(const WAMRFdTable &table, int fd) {
+    auto compacted = table.compact();
+    auto it = compacted.find(fd);
+    MVVM_CHECK(it != compacted.end());
+    return std::get<1>(it->second);
+}
+
+int main() {
+    constexpr int64 GiB = 1ll << 30;
+    WAMRFdTable table;
+
+    // an fd that never moved reopens without a seek
+    table.insert(3, "data.bin", O_RDWR, 0, MVVM_FOPEN);
+    MVVM_CHECK((ops_of(table, 3) == fd_ops{{O_RDWR, 0, MVVM_FOPEN}}));
+
+    // fread/fwrite are deltas from the start of the file
+    table.insert(3, "", 0, 100, MVVM_FREAD);
+    table.insert(3, "", 0, 50, MVVM_FWRITE);
+    MVVM_CHECK((ops_of(table, 3) == fd_ops{{O_RDWR, 0, MVVM_FOPEN}, {SEEK_SET, 150, MVVM_FSEEK}}));
+
+    // an absolute seek is a new base, what follows adds to it
+    table.insert(3, "", SEEK_SET, 10, MVVM_FSEEK);
+    table.insert(3, "", 0, 5, MVVM_FREAD);
+    table.insert(3, "", SEEK_CUR, -3, MVVM_FSEEK);
+    MVVM_CHECK((ops_of(table, 3) == fd_ops{{O_RDWR, 0, MVVM_FOPEN}, {SEEK_SET, 12, MVVM_FSEEK}}));
+
+    // SEEK_END stays relative to the end, the file may have another size on restore
+    table.insert(3, "", SEEK_END, -4, MVVM_FSEEK);
+    table.insert(3, "", SEEK_CUR, 2, MVVM_FSEEK);
+    MVVM_CHECK((ops_of(table, 3) == fd_ops{{O_RDWR, 0, MVVM_FOPEN}, {SEEK_END, -2, MVVM_FSEEK}}));
+
+    // past 2 GiB
+    table.insert(4, "big.bin", O_RDONLY, 0, MVVM_FOPEN);
+    table.insert(4, "", 0, 3 * GiB, MVVM_FREAD);
+    table.insert(4, "", 0, 3 * GiB, MVVM_FREAD);
+    MVVM_CHECK((ops_of(table, 4) == fd_ops{{O_RDONLY, 0, MVVM_FOPEN}, {SEEK_SET, 6 * GiB, MVVM_FSEEK}}));
+
+    // reopening the fd starts over
+    table.insert(4, "other.bin", O_WRONLY, 0, MVVM_FOPEN);
+    MVVM_CHECK((ops_of(table, 4) == fd_ops{{O_WRONLY, 0, MVVM_FOPEN}}));
+    MVVM_CHECK(std::get<0>(table.compact().at(4)) == "other.bin");
+
+    // renumbering carries the position along, and the old fd is gone
+    table.rename(3, "data.bin", 7, "data.bin");
+    MVVM_CHECK(!table.contains(3));
+    MVVM_CHECK((ops_of(table, 7) == fd_ops{{O_RDWR, 0, MVVM_FOPEN}, {SEEK_END, -2, MVVM_FSEEK}}));
+    MVVM_CHECK(std::get<0>(table.compact().at(7)) == "data.bin");
+
+    // ops on fds that were never opened or are closed are ignored
+    table.insert(9, "", 0, 10, MVVM_FREAD);
+    MVVM_CHECK(!table.contains(9));
+    MVVM_CHECK(table.remove(7));
+    MVVM_CHECK(!table.remove(7));
+    MVVM_CHECK(table.compact().size() == 1);
+    return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "unit_test.h"
+#include "wamr_recv_journal.h"
+#include <sys/wait.h>
+#include <unistd.h>
+
+static WasiSockRecvFromData packet(uint32 sock, uint8_t seq, size_t len) {
+    WasiSockRecvFromData data{};
+    data.sock = sock;
+    data.ri_flags = seq;
+    data.src_addr.port = 1000 + seq;
+    data.ri_data.assign(len, seq);
+    return data;
+}
+
+static void check_in_order(const std::vector<WasiSockRecvFromData> &drained, size_t count) {
+    MVVM_CHECK(drained.size() == count);
+    for (size_t i = 0; i < count; i++) {
+        auto seq = (uint8_t)i;
+        MVVM_CHECK(drained[i].sock == 5);
+        MVVM_CHECK(drained[i].ri_flags == seq);
+        MVVM_CHECK(drained[i].src_addr.port == 1000 + seq);
+        MVVM_CHECK(drained[i].ri_data == std::vector<uint8_t>(1 + i * 37, seq));
+    }
+}
+
+int main() {
+    // within the ring
+    WAMRRecvJournal small(8);
+    for (size_t i = 0; i < 5; i++)
+        small.push(packet(5, i, 1 + i * 37));
+    MVVM_CHECK(small.size() == 5);
+    check_in_order(small.drain(), 5);
+    MVVM_CHECK(small.size() == 0);
+
+    // past it, the spilled packets come back first and in order, and the journal is usable again after a drain
+    WAMRRecvJournal spilling(4, true);
+    for (int round = 0; round < 2; round++) {
+        for (size_t i = 0; i < 100; i++)
+            spilling.push(packet(5, i, 1 + i * 37));
+        MVVM_CHECK(spilling.size() == 100);
+        check_in_order(spilling.drain(), 100);
+    }
+
+    // moved into the per socket map while spilled
+    WAMRRecvJournal moved_from(2, true);
+    for (size_t i = 0; i < 10; i++)
+        moved_from.push(packet(5, i, 1 + i * 37));
+    WAMRRecvJournal moved(std::move(moved_from));
+    check_in_order(moved.drain(), 10);
+
+    // without spilling a full journal fails the checkpoint instead of dropping what comes next
+    auto pid = fork();
+    if (pid == 0) {
+        WAMRRecvJournal bounded(4, false);
+        for (size_t i = 0; i < 5; i++)
+            bounded.push(packet(5, i, 1 + i * 37));
+        _exit(0);
+    }
+    int status;
+    MVVM_CHECK(waitpid(pid, &status, 0) == pid);
+    MVVM_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE);
+    return 0;
+}
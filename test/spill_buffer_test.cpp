@@ -0,0 +1,107 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#include "spill_buffer.h"
+#include "unit_test.h"
+#include <algorithm>
+#include <utility>
+
+static uint8_t next_in, next_out;
+
+static bool push(SpillBuffer &buffer, size_t len) {
+    std::vector<uint8_t> data(len);
+    for (auto &b : data)
+        b = next_in++;
+    auto pushed = buffer.push(data.data(), len);
+    if (!pushed)
+        next_in -= len;
+    return pushed;
+}
+
+// peek, check the bytes are the next ones in push order, then consume them
+static void pop(SpillBuffer &buffer, size_t len) {
+    std::vector<uint8_t> out(len);
+    MVVM_CHECK(buffer.peek(out.data(), len) == len);
+    // peeking does not consume
+    MVVM_CHECK(buffer.peek(out.data(), len) == len);
+    for (auto b : out)
+        MVVM_CHECK(b == next_out++);
+    auto before = buffer.size();
+    buffer.consume(len);
+    MVVM_CHECK(buffer.size() == before - len);
+}
+
+int main() {
+    constexpr size_t budget = 64, limit = 256;
+    SpillBuffer buffer(budget, limit);
+    MVVM_CHECK(buffer.empty() && buffer.room() == limit && !buffer.full());
+
+    // within the budget nothing goes to disk
+    MVVM_CHECK(push(buffer, 40));
+    MVVM_CHECK(buffer.size() == 40 && buffer.room() == limit);
+
+    // past it, the rest spills
+    MVVM_CHECK(push(buffer, 40));
+    MVVM_CHECK(buffer.size() == 80 && buffer.room() == limit - 40);
+
+    // with something on disk, even what would fit in memory has to go after it
+    pop(buffer, 30);
+    MVVM_CHECK(push(buffer, 5));
+    MVVM_CHECK(buffer.room() == limit - 45);
+
+    // a peek across the memory and file boundary
+    pop(buffer, 20);
+    pop(buffer, 35);
+    MVVM_CHECK(buffer.empty());
+    MVVM_CHECK(buffer.room() == limit);
+
+    // drained it is usable again, in memory first
+    MVVM_CHECK(push(buffer, budget));
+    MVVM_CHECK(buffer.room() == limit);
+
+    // all or nothing at the limit, and full once the file is at it
+    MVVM_CHECK(push(buffer, limit - 1));
+    MVVM_CHECK(!push(buffer, 2));
+    MVVM_CHECK(buffer.size() == budget + limit - 1);
+    MVVM_CHECK(push(buffer, 1));
+    MVVM_CHECK(buffer.full() && !push(buffer, 1));
+
+    // a peek past the end returns what there is
+    std::vector<uint8_t> out(budget + limit + 10);
+    MVVM_CHECK(buffer.peek(out.data(), out.size()) == budget + limit);
+
+    // moved into the per flow map while spilled
+    SpillBuffer moved(std::move(buffer));
+    MVVM_CHECK(buffer.empty());
+    MVVM_CHECK(moved.size() == budget + limit);
+    for (size_t left = budget + limit; left;) {
+        auto len = std::min<size_t>(left, 7);
+        pop(moved, len);
+        left -= len;
+    }
+    MVVM_CHECK(moved.empty() && moved.room() == limit);
+
+    // many rounds through both, in odd sizes
+    for (int round = 0; round < 50; round++) {
+        size_t queued = 0;
+        for (size_t len = 1 + round % 13; push(moved, len); len = 1 + (len * 7) % 31)
+            queued += len;
+        MVVM_CHECK(moved.size() == queued);
+        while (queued) {
+            auto len = std::min<size_t>(queued, 1 + (queued * 5) % 23);
+            pop(moved, len);
+            queued -= len;
+        }
+        MVVM_CHECK(moved.empty());
+    }
+    return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+// Threads pass a turn around in a fixed order through one mutex and one condition variable, so a checkpoint nearly
+// always finds some in a cond wait and one holding the mutex. The restored replay has to hand every lock back to its
+// owner and wake the waiters in the recorded order, or the log below comes out of order.
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define NUM_THREADS 4
+#define ROUNDS 2000
+
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+int turn = 0;
+int order[NUM_THREADS * ROUNDS];
+
+static void *thread_func(void *arg) {
+    long id = (long)arg;
+    for (int i = 0; i < ROUNDS; i++) {
+        pthread_mutex_lock(&mutex);
+        while (turn % NUM_THREADS != id)
+            pthread_cond_wait(&cond, &mutex);
+        order[turn++] = (int)id;
+        pthread_cond_broadcast(&cond);
+        // keep the mutex across a slow step now and then, for a checkpoint to land on
+        if (i % 100 == 0)
+            usleep(1000);
+        pthread_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+int main() {
+    pthread_t threads[NUM_THREADS];
+    for (long i = 0; i < NUM_THREADS; i++)
+        pthread_create(&threads[i], NULL, thread_func, (void *)i);
+    for (int i = 0; i < NUM_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < NUM_THREADS * ROUNDS; i++) {
+        if (order[i] != i % NUM_THREADS) {
+            printf("turn %d went to %d\n", i, order[i]);
+            __builtin_trap();
+        }
+    }
+    printf("%d turns in order\n", turn);
+    return 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * The WebAssembly Live Migration Project
+ *
+ *  By: Aibo Hu
+ *      Yiwei Yang
+ *      Brian Zhao
+ *      Andrew Quinn
+ *
+ *  Copyright 2024 Regents of the Univeristy of California
+ *  UC Santa Cruz Sluglab.
+ */
+
+#ifndef MVVM_WAMR_UNIT_TEST_H
+#define MVVM_WAMR_UNIT_TEST_H
+
+#include <cstdio>
+#include <cstdlib>
+
+/* the host side tests are plain executables, ctest only looks at the exit code */
+#define MVVM_CHECK(cond)                                                                                               \
+    do {                                                                                                               \
+        if (!(cond)) {                                                                                                 \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);                                                 \
+            exit(EXIT_FAILURE);                                                                                        \
+        }                                                                                                              \
+    } while (0)
+
+#endif // MVVM_WAMR_UNIT_TEST_H